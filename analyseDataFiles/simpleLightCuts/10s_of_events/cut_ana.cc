@@ -20,6 +20,7 @@
 #include "TMarker.h"
 
 //#include "utility_functions.h"
+#include "pmt_layout.h"
 
 using namespace std;
 
@@ -45,6 +46,8 @@ int main(int argc, char* argv[])
 
 	std::string libraryfile1 = argv[1];
 	string type = argv[2];
+	// the PMTs that were simulated, for files without a pmt_tree: the same layout file as given to libraryanalyze_light_histo
+	string layoutfile = (argc > 3) ? argv[3] : "../../../makeDataFiles/pmt_layout_realistic.txt";
 	if(type == "sn" || type == "Sn") {supernova = true;}
 	if(type == "rn" || type == "Rn") {radon = true;}
 	if(type == "ar" || type == "Ar") {argon = true;}
@@ -108,7 +111,32 @@ int main(int argc, char* argv[])
 
 
 	
-	int realisticPMT_IDs[60] = {0, 4, 8, 12, 16, 20, 24, 32, 40, 44, 48, 52, 56, 60, 64, 88, 92, 96, 100, 104, 108, 112, 120, 128, 132, 136, 140, 144, 148, 152, 154, 158, 162, 166, 170, 174, 178, 186, 194, 198, 202, 206, 210, 214, 218, 242, 246, 250, 254, 258, 262, 266, 274, 282, 286, 290, 294, 298, 302, 306};
+	// the PMTs that were simulated are in the pmt_tree, with the mirror channels of the other TPC when both were simulated
+	PMTLayout layout;
+	TTree *pmt_tree1 = nullptr;
+	pmt_tree1 = (TTree*)f1->Get("pmt_tree");
+	if(pmt_tree1 != nullptr)
+	{
+		int pmt_channel, pmt_type;
+		double pmt_x_pos, pmt_y_pos, pmt_z_pos;
+		pmt_tree1->SetBranchAddress("pmt_channel", &pmt_channel);
+		pmt_tree1->SetBranchAddress("pmt_x_pos", &pmt_x_pos);
+		pmt_tree1->SetBranchAddress("pmt_y_pos", &pmt_y_pos);
+		pmt_tree1->SetBranchAddress("pmt_z_pos", &pmt_z_pos);
+		pmt_tree1->SetBranchAddress("pmt_type", &pmt_type);
+		for(int i = 0; i < pmt_tree1->GetEntries(); i++)
+		{
+			pmt_tree1->GetEntry(i);
+			layout.Add(pmt_channel, pmt_x_pos, pmt_y_pos, pmt_z_pos, pmt_type);
+		}
+		cout << "Analysing the " << layout.size() << " PMTs simulated" << endl;
+	}
+	else
+	{
+		if(!layout.Load(layoutfile)) {exit(1); }
+		cout << "Analysing " << layout.size() << " PMTs from the layout " << layoutfile << endl;
+	}
+	int npmts = layout.size();
 
 
 
@@ -122,19 +150,19 @@ int main(int argc, char* argv[])
 	//////////DECALRE HISTOGRAMS THAT NEED FILLING //////////
 	TH1F *E_cut0sn = new TH1F("E_cut0sn","SN energy spectrum - No cuts",50,0,50);
 
-	TH1F *cut10sn = new TH1F("cut10sn","PMTs with more than 10 fast photons",60,0,60);
+	TH1F *cut10sn = new TH1F("cut10sn","PMTs with more than 10 fast photons",npmts,0,npmts);
 	  TH1F *E_cut10sn_8pmts = new TH1F("E_cut10sn_8pmts","Supernova energy spectrum - 8 PMTs & 10 fast photon cut",50,0,50);
 	  
 
-	TH1F *cut8sn = new TH1F("cut8sn","PMTs with more than 8 fast photons",60,0,60);
+	TH1F *cut8sn = new TH1F("cut8sn","PMTs with more than 8 fast photons",npmts,0,npmts);
 	  TH1F *E_cut8sn_15pmts = new TH1F("E_cut8sn_15pmts","Supernova energy spectrum - 15 PMTs & 8 fast photon cut",50,0,50);
 	  TH1F *E_cut8sn_10pmts = new TH1F("E_cut8sn_10pmts","Supernova energy spectrum - 10 PMTs & 8 fast photon cut",50,0,50);
 
 
-	TH1F *cut6sn = new TH1F("cut6sn","PMTs with more than 6 fast photons",60,0,60);
+	TH1F *cut6sn = new TH1F("cut6sn","PMTs with more than 6 fast photons",npmts,0,npmts);
 	  TH1F *E_cut6sn_11pmts = new TH1F("E_cut6sn_11pmts","Supernova energy spectrum - 11 PMTs & 6 fast photon cut",50,0,50);
 
-	TH1F *cut4sn = new TH1F("cut4sn","PMTs with more than 4 fast photons",60,0,60);
+	TH1F *cut4sn = new TH1F("cut4sn","PMTs with more than 4 fast photons",npmts,0,npmts);
           TH1F *E_cut4sn_20pmts = new TH1F("E_cut4sn_20pmts","Supernova energy spectrum - 20 PMTs & 4 fast photon cut",50,0,50);
 
  
@@ -175,39 +203,19 @@ int main(int argc, char* argv[])
 	  /////////////PHOTON TIMES ON EACH PMT FOR CURRENT EVENT////////////////////////////////
 	  ///////////////////////////////////////////////////////////////////////////////////////
 	  cout << endl << "Beginning main loop..." << endl;
-	  vector< vector<double> > pmt_times; // Vector of vectors storing the times in each PMT
-	  vector<double> hit_times;
+	  vector< vector<double> > pmt_times(npmts); // Vector of vectors storing the times in each PMT of the layout
 	  int current_entry = 0;
 	  for(int evt = 0; evt < no_of_evts; evt++){
 
-	  int current_pmt_entry  = 0;
-	    for(int pmt_no  = 0; pmt_no < 60; pmt_no++){
-	   
-
-	      for(int i = current_entry; i < entries1; i++){	      
+	    // the photons are stored event by event, so this event's are read once, each going into the vector of the PMT it hit
+	    for(int i = current_entry; i < entries1; i++){	      
 		data_tree1->GetEntry(i);
-	      
-		//fill a normal vector	    
-		if(data_pmt1 == realisticPMT_IDs[pmt_no] && data_event1 == evt ) //the pmt the photon hit is the pmt we're on in the current iteration
-		  {
-		    hit_times.push_back(data_time1); //fill a vector with all the photon times from event "evt" which hit pmt "pmt_no" 		  
-		  }
-	      
-		if(data_event1 > evt) {
-		  current_pmt_entry = i;
-		  		  
-		  break;
-		}
-		
-	      
-	      } // end of entry (photon) loop
-	     
+		if(data_event1 > evt) {break; } // the next event starts here
+		current_entry = i + 1;
 
-	      pmt_times.push_back(hit_times); //fill the pmts vector with the times from that event hitting that pmt
-	      hit_times.clear();  // clear the vector      
-	    
-	    } // end of pmt loop
-	    current_entry = current_pmt_entry;
+		int pmt_no = layout.Index(data_pmt1); // where the pmt the photon hit is in the layout
+		if(pmt_no >= 0 && data_event1 == evt) {pmt_times[pmt_no].push_back(data_time1); }
+	    } // end of entry (photon) loop
 
 	    ////////////////////////////////////////////////////////////////////////////////////
 	    /////////////////TESTING THE OUTPUT OF THE VECTOR OF VECTORS////////////////////////
@@ -222,7 +230,7 @@ int main(int argc, char* argv[])
 	    /*
 	    // CHECK HOW MANY PHOTONS IN AN EVENT (need to modify the evt loop to one iteration)
 	    int evt_photons = 0;
-	    for(int i = 0; i < 60; i++){
+	    for(int i = 0; i < pmt_times.size(); i++){
 	    evt_photons += pmt_times[i].size();
 	    }
 	    */
@@ -303,7 +311,7 @@ int main(int argc, char* argv[])
 	    if(pmts_with_4fast >= 20) { E_cut4sn_20pmts->Fill(event_Es.at(evt)); }
 
 
-	    pmt_times.clear();
+	    for(int i = 0; i < pmt_times.size(); i++) {pmt_times[i].clear(); }
 	  
 	    if((evt + 1) % 100 == 0) {cout << "Analysis of event " << evt + 1 << " complete." << endl;} //every 50 events
 
@@ -362,18 +370,18 @@ int main(int argc, char* argv[])
 
 	TH1F *E_cut0rn = new TH1F("E_cut0rn","Radon energy spectrum - No cuts",50,5.3,5.8);
 	
-	TH1F *cut10rn = new TH1F("cut10rn","PMTs with more than 10 fast photons",60,0,60);
+	TH1F *cut10rn = new TH1F("cut10rn","PMTs with more than 10 fast photons",npmts,0,npmts);
 	  TH1F *E_cut10rn_8pmts = new TH1F("E_cut10rn_8pmts","Radon energy spectrum - 30 PMTs & 8 fast photon cut",50,5.3,5.8);;
 
-	TH1F *cut8rn = new TH1F("cut8rn","PMTs with more than 8 fast photons",60,0,60);
+	TH1F *cut8rn = new TH1F("cut8rn","PMTs with more than 8 fast photons",npmts,0,npmts);
 	  TH1F *E_cut8rn_15pmts = new TH1F("E_cut8rn_15pmts","Radon energy spectrum - 30 PMTs & 15 fast photon cut",50,5.3,5.8);
 	  TH1F *E_cut8rn_10pmts = new TH1F("E_cut8rn_10pmts","Radon energy spectrum - 20 PMTs & 10 fast photon cut",50,5.3,5.8);
 
 
-	TH1F *cut6rn = new TH1F("cut6rn","PMTs with more than 6 fast photons",60,0,60);
+	TH1F *cut6rn = new TH1F("cut6rn","PMTs with more than 6 fast photons",npmts,0,npmts);
 	  TH1F *E_cut6rn_11pmts = new TH1F("E_cut6rn_11pmts","Radon energy spectrum - 11 PMTs & 6 fast photon cut",50,5.3,5.8);
 
-	TH1F *cut4rn = new TH1F("cut4rn","PMTs with more than 4 fast photons",60,0,60);
+	TH1F *cut4rn = new TH1F("cut4rn","PMTs with more than 4 fast photons",npmts,0,npmts);
 	  TH1F *E_cut4rn_20pmts = new TH1F("E_cut4rn_20pmts","Radon energy spectrum - 20 PMTs & 4 fast photon cut",50,5.3,5.8);       
  
 	  int no_of_evts = event_tree1->GetEntries(); //total number of events will be equal to the entires in the event tree 
@@ -413,39 +421,19 @@ int main(int argc, char* argv[])
 	  /////////////PHOTON TIMES ON EACH PMT FOR CURRENT EVENT////////////////////////////////
 	  ///////////////////////////////////////////////////////////////////////////////////////
 	  cout << endl << "Beginning main loop..." << endl;
-	  vector< vector<double> > pmt_times; // Vector of vectors storing the times in each PMT
-	  vector<double> hit_times;
+	  vector< vector<double> > pmt_times(npmts); // Vector of vectors storing the times in each PMT of the layout
 	  int current_entry = 0;
 	  for(int evt = 0; evt < no_of_evts; evt++){
 
-	  int current_pmt_entry  = 0;
-	    for(int pmt_no  = 0; pmt_no < 60; pmt_no++){
-	   
-
-	      for(int i = current_entry; i < entries1; i++){	      
+	    // the photons are stored event by event, so this event's are read once, each going into the vector of the PMT it hit
+	    for(int i = current_entry; i < entries1; i++){	      
 		data_tree1->GetEntry(i);
-	      
-		//fill a normal vector	    
-		if(data_pmt1 == realisticPMT_IDs[pmt_no] && data_event1 == evt ) //the pmt the photon hit is the pmt we're on in the current iteration
-		  {
-		    hit_times.push_back(data_time1); //fill a vector with all the photon times from event "evt" which hit pmt "pmt_no" 		  
-		  }
-	      
-		if(data_event1 > evt) {
-		  current_pmt_entry = i;
-		  		  
-		  break;
-		}
-		
-	      
-	      } // end of entry (photon) loop
-	     
+		if(data_event1 > evt) {break; } // the next event starts here
+		current_entry = i + 1;
 
-	      pmt_times.push_back(hit_times); //fill the pmts vector with the times from that event hitting that pmt
-	      hit_times.clear();  // clear the vector      
-	    
-	    } // end of pmt loop
-	    current_entry = current_pmt_entry;
+		int pmt_no = layout.Index(data_pmt1); // where the pmt the photon hit is in the layout
+		if(pmt_no >= 0 && data_event1 == evt) {pmt_times[pmt_no].push_back(data_time1); }
+	    } // end of entry (photon) loop
 
 	    ////////////////////////////////////////////////////////////////////////////////////
 	    /////////////////TESTING THE OUTPUT OF THE VECTOR OF VECTORS////////////////////////
@@ -460,7 +448,7 @@ int main(int argc, char* argv[])
 	    /*
 	    // CHECK HOW MANY PHOTONS IN AN EVENT (need to modify the evt loop to one iteration)
 	    int evt_photons = 0;
-	    for(int i = 0; i < 60; i++){
+	    for(int i = 0; i < pmt_times.size(); i++){
 	    evt_photons += pmt_times[i].size();
 	    }
 	    */
@@ -543,7 +531,7 @@ int main(int argc, char* argv[])
 
 
 	    //cout << "Size of pmt_times is: " << pmt_times.size() << endl;
-	    pmt_times.clear();
+	    for(int i = 0; i < pmt_times.size(); i++) {pmt_times[i].clear(); }
 	  
 	    if((evt + 1) % 100 == 0) {cout << "Analysis of event " << evt + 1 << " complete." << endl;} //every 50 events
 
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+
+#include "library_access.h"
+
+using namespace std;
+
+//Lookup latency of the photon library under each memory placement policy.
+//Every thread follows its own chain of random (voxel, channel) lookups, each
+//depending on the one before so that they cannot overlap: the time per
+//lookup is then the memory latency the event loop sees. Run it on the node
+//type the production jobs use, with as many threads as jobs per node.
+namespace {
+
+  double TimeLookups(LibraryAccess& library, long nlookups, int nthreads)
+  {
+    int nvoxels = library.GetNumberOfGridVoxels();
+    int nchannels = library.GetNumberOfChannels();
+    vector<double> sums(nthreads, 0);
+    vector<thread> workers;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(int t = 0; t < nthreads; t++)
+      {
+	workers.push_back(thread([&, t]() {
+	      unsigned long state = 88172645463325252UL + t;
+	      double sum = 0;
+	      for(long i = 0; i < nlookups; i++)
+		{
+		  state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+		  float vis = library.GetCounts(state % nvoxels, library.GetPhysicalChannel((state >> 32) % nchannels));
+		  sum += vis;
+		  state += (vis > 0); // the next lookup depends on this one
+		}
+	      sums[t] = sum;
+	    }));
+      }
+    for(int t = 0; t < nthreads; t++) {workers[t].join(); }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return seconds*1e9/nlookups;
+  }
+
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      cout << "Usage: ./benchmark_library_placement <library.root|library.plib> [lookups per thread (default 10000000)] [threads (default all cores)]" << endl;
+      return 1;
+    }
+  string libraryfile = argv[1];
+  long nlookups = (argc > 2) ? atol(argv[2]) : 10000000;
+  int nthreads = (argc > 3) ? atoi(argv[3]) : max(1u, thread::hardware_concurrency());
+
+  const char* names[4] = {"default", "interleave", "replicate", "huge pages"};
+  vector<string> reports;
+  vector<double> single, multi;
+  for(int placement = kPlacementDefault; placement <= kPlacementHugePages; placement++)
+    {
+      LibraryAccess library;
+      library.SetMemoryPlacement(MemoryPlacement(placement));
+      library.LoadLibraryFromFile(libraryfile, true, true);
+      TimeLookups(library, nlookups/10, nthreads); // warm up: fault in the pages
+      single.push_back(TimeLookups(library, nlookups, 1));
+      multi.push_back(TimeLookups(library, nlookups, nthreads));
+      reports.push_back(library.GetPlacementReport());
+    }
+
+  cout << endl << "Lookup latency, ns (1 thread / " << nthreads << " threads):" << endl;
+  for(size_t i = 0; i < reports.size(); i++)
+    {
+      cout << "  " << names[i] << ": " << single[i] << " / " << multi[i] << "   [" << reports[i] << "]" << endl;
+    }
+
+  return 0;
+}
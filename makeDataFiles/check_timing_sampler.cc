@@ -0,0 +1,127 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "timing_sampler.h"
+#include "timing_kernels.h"
+
+using namespace std;
+
+//Checks that every SIMD kernel of TimingSampler this CPU can run turns the
+//same uniforms into the same times as the plain C++ one, for the
+//distributions the simulation draws from (VUV over distance, visible over
+//t0, both shapes) and for the grid point mixtures of TimingTables. They
+//differ only by rounding (fused multiply-adds, the vector log), so any
+//difference above kTolerance is a bug in a kernel. Exits with 1 if one is
+//found; run by make check.
+namespace {
+
+  const double kTolerance = 1e-9;   //relative, of times in ns
+  const char* kInstructionSets[] = {"sse2", "avx2", "avx512"};
+
+  //Uniforms in (0, 1), a number that is not a multiple of any vector width,
+  //with the ends of the range among them
+  vector<double> Uniforms()
+  {
+    vector<double> u(1001);
+    unsigned long state = 88172645463325252UL;
+    for(size_t i = 0; i < u.size(); i++)
+      {
+	state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+	u[i] = ((state >> 11) + 0.5)/9007199254740992.;
+      }
+    u[0] = 1e-300;
+    u[1] = 1e-6;
+    u[2] = 1 - 1e-16;
+    u[3] = 1.;
+    return u;
+  }
+
+  double Difference(const vector<double>& a, const vector<double>& b)
+  {
+    double worst = 0;
+    for(size_t i = 0; i < a.size(); i++)
+      {
+	double d = fabs(a[i] - b[i])/max(1., fabs(a[i]));
+	if(!(d <= worst)) {worst = d; } // NaN counts as the worst
+      }
+    return worst;
+  }
+
+  struct Result{
+    double worst[3];
+    bool run[3];
+  };
+
+  void Check(const TimingSampler::Table& table, const vector<double>& u, Result& result)
+  {
+    vector<double> reference = u;
+    TimingSampler::TransformWith("scalar", table, reference.size(), &reference[0]);
+    for(int k = 0; k < 3; k++)
+      {
+	vector<double> t = u;
+	if(!TimingSampler::TransformWith(kInstructionSets[k], table, t.size(), &t[0])) {continue; }
+	result.run[k] = true;
+	result.worst[k] = max(result.worst[k], Difference(reference, t));
+      }
+  }
+
+  void CheckBetween(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, const vector<double>& u, Result& result)
+  {
+    vector<double> reference = u;
+    TimingSampler::TransformBetweenWith("scalar", a, b, w, reference.size(), &reference[0]);
+    for(int k = 0; k < 3; k++)
+      {
+	vector<double> t = u;
+	if(!TimingSampler::TransformBetweenWith(kInstructionSets[k], a, b, w, t.size(), &t[0])) {continue; }
+	result.run[k] = true;
+	result.worst[k] = max(result.worst[k], Difference(reference, t));
+      }
+  }
+
+}
+
+int main()
+{
+  vector<double> u = Uniforms();
+  Result result = {{0, 0, 0}, {false, false, false}};
+  int ntables = 0;
+
+  double pars[7];
+  TimingSampler previous;
+  bool have_previous = false;
+  for(double distance = 10; distance <= 750; distance += 20)
+    {
+      TimingSampler sampler;
+      if(!timing::VUVParameters(distance, pars) || !sampler.SetLandauPlusExpo(pars)) {continue; }
+      Check(sampler.GetTable(), u, result);
+      ntables++;
+      if(have_previous)
+	{
+	  double weights[4] = {0, 0.3, 0.77, 1};
+	  for(int i = 0; i < 4; i++) {CheckBetween(previous.GetTable(), sampler.GetTable(), weights[i], u, result); }
+	}
+      previous = sampler;
+      have_previous = true;
+    }
+  for(double t0 = 8; t0 <= 55; t0 += 3)
+    {
+      TimingSampler sampler;
+      if(timing::VisibleOnlyCathodeParameters(t0, pars) && sampler.SetLandauPlusExpo(pars)) {Check(sampler.GetTable(), u, result); ntables++; }
+      if(timing::VisibleFullConfig1Parameters(t0, pars) && sampler.SetLandauPlusLandau(pars)) {Check(sampler.GetTable(), u, result); ntables++; }
+      if(timing::VisibleFullConfig2Parameters(t0, 200., pars) && sampler.SetLandauPlusLandau(pars)) {Check(sampler.GetTable(), u, result); ntables++; }
+    }
+
+  bool ok = ntables > 0;
+  cout << "Timing sampler kernels against the scalar one, " << ntables << " distributions (best here: "
+       << TimingSampler::InstructionSet() << ")" << endl;
+  for(int k = 0; k < 3; k++)
+    {
+      if(!result.run[k]) {cout << "  " << kInstructionSets[k] << ": not supported on this CPU, not checked" << endl; continue; }
+      bool pass = result.worst[k] <= kTolerance;
+      cout << "  " << kInstructionSets[k] << ": largest relative difference " << result.worst[k] << (pass ? "" : "  FAILED") << endl;
+      ok = ok && pass;
+    }
+  return ok ? 0 : 1;
+}
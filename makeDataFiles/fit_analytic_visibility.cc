@@ -0,0 +1,36 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "library_access.h"
+
+using namespace std;
+
+//Fits the corrections of the analytic visibility model against a photon
+//library and writes them to analytic_correction.txt, printing the bias of
+//every PMT before and after. Set analytic_visibility in
+//libraryanalyze_light_histo.h to run from the model instead of a library.
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      cout << "Usage: ./fit_analytic_visibility <library.root|library.plib> [correction file (default analytic_correction.txt)] [PMT layout (default posPMTs_setup1.txt)]" << endl;
+      return 1;
+    }
+
+  string libraryfile = argv[1];
+  string correctionfile = (argc > 2) ? argv[2] : "analytic_correction.txt";
+  string pmtfile = (argc > 3) ? argv[3] : "posPMTs_setup1.txt";
+
+  PMTLayout pmts;
+  if(!pmts.Load(pmtfile)) {return 1; }
+
+  LibraryAccess library;
+  library.LoadLibraryFromFile(libraryfile, true, true);
+
+  LibraryAccess model;
+  model.LoadAnalyticModel(pmts, "", true, true);
+  if(!model.FitAnalyticCorrection(library, correctionfile)) {return 1; }
+
+  return 0;
+}
@@ -1,118 +1,2669 @@
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "TFile.h"
 #include "TTree.h"
 #include "TKey.h"
+#include "TBranch.h"
+#include "TBufferFile.h"
+#include "TROOT.h"
 #include "TRandom3.h"
 #include "TMath.h"
+#include "TMatrixDSym.h"
+#include "TMatrixDSymEigen.h"
+#include "TVectorD.h"
 
 #include "library_access.h"
 #include "utility_functions.h"
 
 using namespace std;
 
+//First page of a shared memory segment; the cache image follows it
+struct SharedLibraryHeader{
+	char magic[8];
+	int32_t creator_pid;
+	std::atomic<int32_t> ready;     //1 once the image is complete, -1 if publishing failed
+	std::atomic<int32_t> refcount;  //attached processes
+	uint64_t image_size;
+	static const int kSlots = 512;
+	std::atomic<int32_t> attached[kSlots];  //pids of the attached processes, 0 for a free slot
+};
+
+namespace {
+
+	const char kCacheMagic[8] = {'S','B','N','D','P','L','I','B'};
+	const uint32_t kCacheVersion = 2;
+	const uint64_t kCachePayloadAlign = 4096;
+
+	//FNV-1a style hash, one 64 bit word at a time
+	uint64_t CacheChecksum(const void* data, size_t bytes)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		uint64_t h = 14695981039346656037ULL;
+		size_t nwords = bytes/8;
+		for(size_t i = 0; i < nwords; i++)
+		{
+			uint64_t w;
+			memcpy(&w, p + 8*i, 8);
+			h = (h ^ w) * 1099511628211ULL;
+		}
+		for(size_t i = 8*nwords; i < bytes; i++) {h = (h ^ p[i]) * 1099511628211ULL; }
+		return h;
+	}
+
+	uint64_t HeaderChecksum(const LibraryCacheHeader& header)
+	{
+		return CacheChecksum(&header, offsetof(LibraryCacheHeader, header_checksum));
+	}
+
+	//IEEE 754 binary16 -> float
+	float HalfToFloat(uint16_t h)
+	{
+		int exponent = (h >> 10) & 0x1f;
+		int mantissa = h & 0x3ff;
+		float value;
+		if(exponent == 0) {value = ldexp(float(mantissa), -24); }
+		else {value = ldexp(float(mantissa | 0x400), exponent - 25); }
+		return (h & 0x8000) ? -value : value;
+	}
+
+	//Columns of one entry cluster of the PhotonLibraryData tree
+	struct LibraryChunk{
+		std::vector<int> voxel;
+		std::vector<int> channel;
+		std::vector<float> vis;
+		std::vector<float> refl;
+		std::vector<float> reflT;
+	};
+
+	//Reads entries [first, first + n) of a single-leaf branch a basket at a
+	//time with the bulk API, which decompresses each basket straight into
+	//buffer and swaps it to host order in place. Baskets the bulk API cannot
+	//start on (it only reads from a basket's first entry) are read entry by
+	//entry up to the next basket.
+	template<class T> void ReadColumn(TBranch* branch, Long64_t first, Long64_t n, T* out, TBufferFile& buffer)
+	{
+		Long64_t i = 0;
+		while(i < n)
+		{
+			Int_t read = branch->GetBulkRead().GetBulkEntries(first + i, buffer);
+			if(read > 0)
+			{
+				const T* values = reinterpret_cast<const T*>(buffer.GetCurrent());
+				Long64_t m = std::min(Long64_t(read), n - i);
+				std::copy(values, values + m, out + i);
+				i += m;
+				continue;
+			}
+
+			Long64_t next = first + n;
+			const Long64_t* basket_entry = branch->GetBasketEntry();
+			for(Int_t b = 0; b <= branch->GetWriteBasket(); b++)
+			{
+				if(basket_entry[b] > first + i) {next = std::min(next, basket_entry[b]); break; }
+			}
+			T value;
+			branch->SetAddress(&value);
+			for(; first + i < next; i++)
+			{
+				branch->GetEntry(first + i);
+				out[i] = value;
+			}
+			branch->ResetAddress(); //value goes out of scope
+		}
+	}
+
+	TTree* OpenLibraryTree(const std::string& libraryfile, TFile*& f)
+	{
+		TTree *tt = nullptr;
+		try
+		{
+			f  =  TFile::Open(libraryfile.c_str());
+			if(!f || f->IsZombie())
+			{
+				cout << "Could not open photon library: " << libraryfile << endl;
+				return nullptr;
+			}
+			tt =  (TTree*)f->Get("PhotonLibraryData");
+
+			if (!tt) {
+
+				TKey *key = f->FindKeyAny("PhotonLibraryData");
+				if (key)
+					tt = (TTree*)key->ReadObj();
+				else {
+					cout << "PhotonLibraryData not found in file" <<libraryfile << endl;
+				}
+			}
+		}
+		catch(...)
+		{
+			cout << "Error in ttree load, reading photon library: " << libraryfile.c_str()<<endl;
+		}
+		return tt;
+	}
+
+	void CloseLibraryFile(TFile* f, const std::string& libraryfile)
+	{
+		try
+		{
+			f->Close();
+			delete f;
+		}
+		catch(...)
+		{
+			cout << "Error in closing file : " << libraryfile.c_str()<<endl;
+		}
+	}
+
+	const char kLowRankMagic[8] = {'S','B','N','D','P','L','L','R'};
+	const uint32_t kLowRankVersion = 1;
+
+	const char kStoreMagic[8] = {'S','B','N','D','P','L','M','S'};
+	const uint32_t kStoreVersion = 1;
+
+	const char kSharedMagic[8] = {'S','B','N','D','S','H','M','2'};
+	const size_t kSharedHeaderSize = 4096;
+
+	//Records pid in a free slot of the segment's list of attached processes
+	//(it goes untracked if the list is full)
+	void RecordAttached(SharedLibraryHeader* shared, int32_t pid)
+	{
+		for(int i = 0; i < SharedLibraryHeader::kSlots; i++)
+		{
+			int32_t empty = 0;
+			if(shared->attached[i].compare_exchange_strong(empty, pid)) {return; }
+		}
+	}
+
+	void ForgetAttached(SharedLibraryHeader* shared, int32_t pid)
+	{
+		for(int i = 0; i < SharedLibraryHeader::kSlots; i++)
+		{
+			int32_t mine = pid;
+			if(shared->attached[i].compare_exchange_strong(mine, 0)) {return; }
+		}
+	}
+
+	//Drops the references held by processes that died without detaching
+	//(killed jobs), so that the last live one out still removes the segment.
+	//The caller must hold a reference of its own.
+	void ReleaseDeadAttached(SharedLibraryHeader* shared)
+	{
+		for(int i = 0; i < SharedLibraryHeader::kSlots; i++)
+		{
+			int32_t pid = shared->attached[i].load();
+			if(pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) {continue; }
+			if(shared->attached[i].compare_exchange_strong(pid, 0)) {shared->refcount.fetch_sub(1); }
+		}
+	}
+
+	//NUMA memory policies (linux/mempolicy.h), used through the raw system
+	//calls so that libnuma is not needed
+	const int kMemoryPolicyBind = 2;
+	const int kMemoryPolicyInterleave = 3;
+	const size_t kHugePageSize = 2 << 20;
+
+	//NUMA nodes with memory, from sysfs ("0-1,3"); empty if there is no NUMA support
+	std::vector<int> OnlineNodes()
+	{
+		std::vector<int> nodes;
+		ifstream in("/sys/devices/system/node/online");
+		std::string ranges;
+		if(!(in >> ranges)) {return nodes; }
+		std::istringstream list(ranges);
+		std::string range;
+		while(std::getline(list, range, ','))
+		{
+			int first, last;
+			char dash;
+			std::istringstream r(range);
+			if(!(r >> first)) {continue; }
+			last = (r >> dash >> last) ? last : first;
+			for(int n = first; n <= last && n < 64; n++) {nodes.push_back(n); }
+		}
+		return nodes;
+	}
+
+	bool EndsWith(const std::string& s, const std::string& suffix)
+	{
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+}
+
 LibraryAccess::LibraryAccess()
-	: table_(std::vector<std::vector<float> >()),
-	reflected_table_(std::vector<std::vector<float> >()),
-	reflT_table_(std::vector<std::vector<float> >())
+	: table_(std::vector<float>()),
+	data_(0),
+	mapped_(0),
+	mapped_size_(0),
+	cache_header_(0),
+	shared_header_(0),
+	nvoxels_(0),
+	nchannels_(0),
+	nfields_(1),
+	refl_offset_(-1),
+	reflT_offset_(-1),
+	zero_(0),
+	encoding_(kEncodingFloat32),
+	loader_threads_(0),
+	shared_memory_(false),
+	sparse_threshold_(-1),
+	symmetry_y_(kNoSymmetry),
+	symmetry_tolerance_(0),
+	fold_y_(false),
+	tile_budget_(0),
+	tile_zlayers_(1),
+	tile_fd_(-1),
+	tile_payload_offset_(0),
+	tile_file_channels_(0),
+	tile_voxels_(1),
+	max_resident_tiles_(0),
+	tile_clock_(0),
+	tile_reads_(0),
+	current_tile_(-1),
+	current_tile_data_(0),
+	lowrank_rank_(0),
+	lowrank_timing_field_(-1),
+	analytic_(false),
+	row_voxel_(-1),
+	store_config_(0),
+	store_direct_(0),
+	store_refl_(0),
+	store_nrefl_(0),
+	placement_(kPlacementDefault),
+	placement_report_("default")
+{
+	for(int f = 0; f < 3; f++) {store_field_[f] = -1; }
+
+}
+
+LibraryAccess::~LibraryAccess()
+{
+	ReleaseLibrary();
+}
+
+void LibraryAccess::ReleaseLibrary()
+{
+	if(mapped_) {munmap(mapped_, mapped_size_); }
+	mapped_ = 0;
+	mapped_size_ = 0;
+	cache_header_ = 0;
+	std::vector<float>().swap(table_);
+	data_ = 0;
+	std::vector<uint16_t>().swap(encoded_);
+	std::vector<uint32_t>().swap(sparse_offsets_);
+	std::vector<SparseLibraryEntry>().swap(sparse_entries_);
+	fold_y_ = false;
+
+	if(tile_fd_ >= 0) {close(tile_fd_); }
+	tile_fd_ = -1;
+	std::vector<std::vector<float> >().swap(tiles_);
+	std::vector<float>().swap(tile_buffer_);
+	tile_last_use_.clear();
+	resident_tiles_.clear();
+	current_tile_ = -1;
+	current_tile_data_ = 0;
+
+	lowrank_rank_ = 0;
+	for(int f = 0; f < 3; f++)
+	{
+		std::vector<float>().swap(lowrank_mean_[f]);
+		std::vector<float>().swap(lowrank_basis_[f]);
+		std::vector<float>().swap(lowrank_scores_[f]);
+	}
+	analytic_ = false;
+	analytic_x_.clear();
+	analytic_y_.clear();
+	analytic_z_.clear();
+	for(int f = 0; f < 3; f++) {analytic_correction_[f].clear(); }
+	row_voxel_ = -1;
+
+	table_level_ = 0;
+	level_grid_ = LevelGrid(0);
+
+	store_configs_.clear();
+	std::vector<std::vector<float> >().swap(store_tables_);
+	store_direct_ = 0;
+	store_refl_ = 0;
+
+	for(size_t i = 0; i < placed_regions_.size(); i++) {munmap(placed_regions_[i].first, placed_regions_[i].second); }
+	placed_regions_.clear();
+	replicas_.clear();
+	placement_report_ = "default";
+
+	if(shared_header_)
+	{
+		ReleaseDeadAttached(shared_header_);
+		ForgetAttached(shared_header_, getpid());
+		if(shared_header_->refcount.fetch_sub(1) == 1) {shm_unlink(shared_name_.c_str()); }
+		munmap(shared_header_, kSharedHeaderSize);
+		shared_header_ = 0;
+		shared_name_.clear();
+	}
+}
+
+void LibraryAccess::SetActiveChannels(const std::vector<int>& channels)
+{
+	active_channels_ = channels;
+}
+
+void LibraryAccess::SetChannelMap(const std::vector<int>& channels)
+{
+	channels_ = channels;
+	nchannels_ = channels_.size();
+	channel_index_.clear();
+	for(int i = 0; i < nchannels_; i++)
+	{
+		if(channels_[i] >= int(channel_index_.size())) {channel_index_.resize(channels_[i] + 1, -1); }
+		channel_index_[channels_[i]] = i;
+	}
+}
+
+//The channels a library with maxopChannel channels should be loaded with
+std::vector<int> LibraryAccess::SelectChannels(int maxopChannel) const
+{
+	std::vector<int> channels;
+	if(active_channels_.empty())
+	{
+		for(int i = 0; i < maxopChannel; i++) {channels.push_back(i); }
+		return channels;
+	}
+	for(size_t i = 0; i < active_channels_.size(); i++)
+	{
+		if(active_channels_[i] >= 0 && active_channels_[i] < maxopChannel) {channels.push_back(active_channels_[i]); }
+		else {cout << "WARNING: channel " << active_channels_[i] << " is not in the library" << endl; }
+	}
+	return channels;
+}
+
+std::string LibraryAccess::CacheFileName(std::string libraryfile, int level)
+{
+	if(EndsWith(libraryfile, ".root")) {libraryfile.erase(libraryfile.size() - 5); }
+	if(EndsWith(libraryfile, ".plib")) {libraryfile.erase(libraryfile.size() - 5); }
+	if(level > 0)
+	{
+		std::ostringstream name;
+		name << libraryfile << "_L" << level;
+		libraryfile = name.str();
+	}
+	return libraryfile + ".plib";
+}
+
+
+
+void LibraryAccess::LoadLibraryFromFile(std::string libraryfile, bool reflected, bool reflT0)
+{
+	bool is_cache = EndsWith(libraryfile, ".plib");
+	std::string cachefile = is_cache ? libraryfile : CacheFileName(libraryfile);
+	std::string levelfile = CacheFileName(cachefile, resolution_level_);
+
+	if(EndsWith(libraryfile, ".plms"))
+	{
+		if(encoding_ != kEncodingFloat32 || sparse_threshold_ >= 0 || symmetry_y_ != kNoSymmetry || tile_budget_ > 0 || resolution_level_ > 0)
+		{
+			cout << "A library store is used as it is: float, full resolution, in memory and without sparse layout or folding" << endl;
+		}
+		if(!LoadLibraryStore(libraryfile, reflected, reflT0)) {cout << "Could not load photon library store: " << libraryfile << endl; }
+		requested_.clear();
+		return;
+	}
+
+	if(EndsWith(libraryfile, ".plr"))
+	{
+		if(!LoadLowRankLibrary(libraryfile, reflected, reflT0)) {cout << "Could not load low-rank photon library: " << libraryfile << endl; }
+		requested_.clear();
+		return;
+	}
+
+	//Tiles are read straight from the cache file, so they can be neither
+	//folded nor re-encoded
+	if(tile_budget_ > 0)
+	{
+		if(encoding_ != kEncodingFloat32 || sparse_threshold_ >= 0 || symmetry_y_ != kNoSymmetry || shared_memory_)
+		{
+			cout << "The tiled library is kept in float, without sparse layout, y folding or shared memory" << endl;
+		}
+		if(LoadTiledLibrary(levelfile, reflected, reflT0))
+		{
+			requested_.clear();
+			return;
+		}
+		cout << "The tiled library needs a library cache, run ./make_library_cache " << libraryfile << " to create one. Loading it all into memory instead." << endl;
+	}
+
+	//Coarse levels are not folded (the fold is defined on the full grid)
+	SymmetryMode symmetry = symmetry_y_;
+	if(symmetry != kNoSymmetry && resolution_level_ > 0)
+	{
+		cout << "Resolution level " << resolution_level_ << " libraries are not folded" << endl;
+		symmetry = kNoSymmetry;
+	}
+
+	//A folded table needs the mirror partner of every active channel
+	std::vector<int> requested_channels = active_channels_;
+	if(symmetry != kNoSymmetry && !active_channels_.empty())
+	{
+		for(size_t i = 0; i < requested_channels.size(); i++)
+		{
+			int partner = Mirror(mirror_y_, requested_channels[i]);
+			if(partner >= 0 && std::find(active_channels_.begin(), active_channels_.end(), partner) == active_channels_.end())
+			{
+				active_channels_.push_back(partner);
+			}
+		}
+	}
+
+	bool sparse = sparse_threshold_ >= 0;
+	bool shared = shared_memory_ && encoding_ == kEncodingFloat32 && !sparse && symmetry == kNoSymmetry && resolution_level_ == 0;
+	if(shared_memory_ && !shared) {cout << "The library is not shared between processes when it is re-encoded, sparse, folded or coarse" << endl; }
+	if(sparse && encoding_ != kEncodingFloat32) {cout << "The sparse library is kept in float, ignoring the encoding" << endl; }
+
+	if(shared && LoadLibraryFromSharedMemory(libraryfile, reflected, reflT0)) {return; }
+	bool level_loaded = resolution_level_ > 0 && LoadLibraryFromCache(levelfile, reflected, reflT0);
+	if(!level_loaded && !LoadLibraryFromCache(cachefile, reflected, reflT0))
+	{
+		if(is_cache)
+		{
+			cout << "Could not load photon library cache: " << cachefile << endl;
+			return;
+		}
+		cout << "No usable library cache (" << cachefile << "), run ./make_library_cache " << libraryfile << " to create one." << endl;
+		LoadLibraryFromRootFile(libraryfile, reflected, reflT0);
+	}
+
+	active_channels_ = requested_channels;
+	requested_.clear();
+	if(nchannels_ > int(requested_channels.size()))
+	{
+		for(size_t i = 0; i < requested_channels.size(); i++)
+		{
+			if(requested_channels[i] >= int(requested_.size())) {requested_.resize(requested_channels[i] + 1, false); }
+			requested_[requested_channels[i]] = true;
+		}
+	}
+
+	if(data_ && table_level_ != resolution_level_) {DownsampleTable(resolution_level_); }
+	if(symmetry == kDeclaredSymmetry || (symmetry == kDetectSymmetry && CheckMirrorSymmetryY(symmetry_tolerance_))) {FoldTableY(); }
+	if(sparse) {BuildSparseTable(); }
+	else if(encoding_ != kEncodingFloat32) {EncodeTable(); }
+	PlaceTable();
+}
+
+void LibraryAccess::SetLoaderThreads(int nthreads)
+{
+	loader_threads_ = nthreads;
+}
+
+//Reads the PhotonLibraryData tree in parallel: each thread opens the file
+//itself and takes whole entry clusters, reading them one branch at a time,
+//a basket per bulk read, so every basket is decompressed once, by that
+//thread, and copied into the columns without a call per entry. The table size is only
+//known once everything has been read, so clusters are kept as columns
+//until then and scattered into the table at the end.
+void LibraryAccess::LoadLibraryFromRootFile(std::string libraryfile, bool reflected, bool reflT0)
+{
+	cout << "Reading photon library from input file: " << libraryfile.c_str()<<endl;
+	ReleaseLibrary();
+
+	TFile *f = nullptr;
+	TTree *tt = OpenLibraryTree(libraryfile, f);
+	if(!tt) {return; }
+
+	if(reflected && !tt->GetBranch("ReflVisibility")) {cout << "No ReflVisibility branch in " << libraryfile << endl; reflected = false; }
+	if(reflT0 && !tt->GetBranch("ReflTfirst")) {cout << "No ReflTfirst branch in " << libraryfile << endl; reflT0 = false; }
+
+	Long64_t nentries = tt->GetEntries();
+	std::vector<std::pair<Long64_t, Long64_t> > clusters;
+	TTree::TClusterIterator cluster_iter = tt->GetClusterIterator(0);
+	Long64_t first;
+	while((first = cluster_iter()) < nentries) {clusters.push_back(std::make_pair(first, std::min(cluster_iter.GetNextEntry(), nentries))); }
+	CloseLibraryFile(f, libraryfile);
+
+	int nthreads = (loader_threads_ > 0) ? loader_threads_ : std::max(1u, std::thread::hardware_concurrency());
+	nthreads = std::max(1, std::min(nthreads, int(clusters.size())));
+	ROOT::EnableThreadSafety();
+
+	std::vector<std::vector<LibraryChunk> > chunks(nthreads);
+	std::vector<int> max_voxel(nthreads, -1);
+	std::vector<int> max_channel(nthreads, -1);
+	std::atomic<size_t> next_cluster(0);
+
+	std::vector<std::thread> workers;
+	for(int t = 0; t < nthreads; t++)
+	{
+		workers.push_back(std::thread([&, t]()
+		{
+			TFile* tf = nullptr;
+			TTree* tree = OpenLibraryTree(libraryfile, tf);
+			if(!tree) {return; }
+			TBufferFile buffer(TBuffer::kWrite, 32*1024);
+			for(size_t c = next_cluster++; c < clusters.size(); c = next_cluster++)
+			{
+				Long64_t start = clusters[c].first;
+				Long64_t n = clusters[c].second - start;
+				tree->SetCacheEntryRange(start, clusters[c].second);
+
+				chunks[t].push_back(LibraryChunk());
+				LibraryChunk& chunk = chunks[t].back();
+				chunk.voxel.resize(n);
+				chunk.channel.resize(n);
+				chunk.vis.resize(n);
+				ReadColumn(tree->GetBranch("Voxel"), start, n, &chunk.voxel[0], buffer);
+				ReadColumn(tree->GetBranch("OpChannel"), start, n, &chunk.channel[0], buffer);
+				ReadColumn(tree->GetBranch("Visibility"), start, n, &chunk.vis[0], buffer);
+				if(reflected) {chunk.refl.resize(n); ReadColumn(tree->GetBranch("ReflVisibility"), start, n, &chunk.refl[0], buffer); }
+				if(reflT0) {chunk.reflT.resize(n); ReadColumn(tree->GetBranch("ReflTfirst"), start, n, &chunk.reflT[0], buffer); }
+
+				max_voxel[t] = std::max(max_voxel[t], *std::max_element(chunk.voxel.begin(), chunk.voxel.end()));
+				max_channel[t] = std::max(max_channel[t], *std::max_element(chunk.channel.begin(), chunk.channel.end()));
+			}
+			CloseLibraryFile(tf, libraryfile);
+		}));
+	}
+	for(int t = 0; t < nthreads; t++) {workers[t].join(); }
+
+	int maxvoxel = *std::max_element(max_voxel.begin(), max_voxel.end())+1;
+	int maxopChannel = *std::max_element(max_channel.begin(), max_channel.end())+2;
+
+	SetChannelMap(SelectChannels(maxopChannel));
+	cout << "Photon lookup table size : " <<  maxvoxel << " voxels,  " << nchannels_ << " of " << maxopChannel <<" channels " << endl;
+
+	//One contiguous block: the reflected/reflT0 planes are only allocated if asked for
+	nvoxels_ = maxvoxel;
+	nfields_ = 1;
+	refl_offset_ = reflected ? nfields_++ : -1;
+	reflT_offset_ = reflT0 ? nfields_++ : -1;
+	table_.assign(size_t(nvoxels_)*nchannels_*nfields_, 0);
+	data_ = table_.data();
+
+	//Every voxel is < maxvoxel and every channel < maxopChannel by construction,
+	//so only negative voxels and inactive channels need skipping
+	workers.clear();
+	for(int t = 0; t < nthreads; t++)
+	{
+		workers.push_back(std::thread([&, t]()
+		{
+			float* table = table_.data();
+			const int* index_of = channel_index_.data();
+			for(size_t c = 0; c < chunks[t].size(); c++)
+			{
+				LibraryChunk& chunk = chunks[t][c];
+				for(size_t i = 0; i < chunk.voxel.size(); i++)
+				{
+					int index = (chunk.channel[i] < int(channel_index_.size())) ? index_of[chunk.channel[i]] : -1;
+					if(chunk.voxel[i] < 0 || chunk.channel[i] < 0 || index < 0) {continue; }
+					float* entry = table + Index(chunk.voxel[i], index);
+					entry[0] = chunk.vis[i];
+					if(reflected) {entry[refl_offset_] = chunk.refl[i]; }
+					if(reflT0) {entry[reflT_offset_] = chunk.reflT[i]; }
+				}
+				chunk = LibraryChunk(); // free the columns as we go
+			}
+		}));
+	}
+	for(int t = 0; t < nthreads; t++) {workers[t].join(); }
+}
+
+bool LibraryAccess::LoadLibraryFromCache(std::string cachefile, bool reflected, bool reflT0)
+{
+	int fd = open(cachefile.c_str(), O_RDONLY);
+	if(fd < 0) {return false; }
+
+	struct stat st;
+	void* mapped = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(LibraryCacheHeader))
+	{
+		mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(mapped == MAP_FAILED) {return false; }
+
+	if(!AttachCacheImage(static_cast<const char*>(mapped), st.st_size, mapped, st.st_size, reflected, reflT0, cachefile, false))
+	{
+		munmap(mapped, st.st_size);
+		return false;
+	}
+	return true;
+}
+
+void LibraryAccess::SetTiling(size_t memory_budget_bytes, int zlayers_per_tile)
+{
+	tile_budget_ = memory_budget_bytes;
+	tile_zlayers_ = std::max(1, zlayers_per_tile);
+}
+
+//Opens the cache for tiled reading: only the header and channel map are read here
+bool LibraryAccess::LoadTiledLibrary(const std::string& cachefile, bool reflected, bool reflT0)
+{
+	int fd = open(cachefile.c_str(), O_RDONLY);
+	if(fd < 0) {return false; }
+
+	LibraryCacheHeader header;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) || !CheckCacheHeader(header, st.st_size, cachefile))
+	{
+		close(fd);
+		return false;
+	}
+	std::vector<int32_t> cache_channels(header.nchannels);
+	ssize_t map_bytes = header.nchannels*sizeof(int32_t);
+	if(header.nchannels > 0 && pread(fd, &cache_channels[0], map_bytes, header.channel_map_offset) != map_bytes)
+	{
+		close(fd);
+		return false;
+	}
+
+	ReleaseLibrary();
+	table_level_ = GridLevel(header.grid_steps);
+	level_grid_ = LevelGrid(table_level_);
+	tile_fd_ = fd;
+	tile_payload_offset_ = header.payload_offset;
+	tile_file_channels_ = header.nchannels;
+	nvoxels_ = header.nvoxels;
+	nfields_ = header.nfields;
+
+	//Tiles only hold the active channels
+	SetChannelMap(std::vector<int>(cache_channels.begin(), cache_channels.end()));
+	std::vector<int> wanted;
+	tile_columns_.clear();
+	for(size_t i = 0; i < (active_channels_.empty() ? channels_.size() : active_channels_.size()); i++)
+	{
+		int channel = active_channels_.empty() ? channels_[i] : active_channels_[i];
+		int index = GetChannelIndex(channel);
+		if(index < 0) {cout << "WARNING: channel " << channel << " is not in the library cache" << endl; continue; }
+		wanted.push_back(channel);
+		tile_columns_.push_back(index);
+	}
+	SetChannelMap(wanted);
+
+	refl_offset_ = reflected ? header.refl_offset : -1;
+	reflT_offset_ = reflT0 ? header.reflT_offset : -1;
+	if((reflected && header.refl_offset < 0) || (reflT0 && header.reflT_offset < 0))
+	{
+		cout << "WARNING: library cache " << cachefile << " has no reflected light, it will read as zero" << endl;
+	}
+
+	tile_voxels_ = tile_zlayers_*level_grid_.nx()*level_grid_.ny();
+	int ntiles = (nvoxels_ + tile_voxels_ - 1)/tile_voxels_;
+	size_t tile_bytes = size_t(tile_voxels_)*nchannels_*nfields_*sizeof(float);
+	max_resident_tiles_ = std::max<size_t>(1, std::min<size_t>(ntiles, tile_budget_/tile_bytes));
+	tiles_.assign(ntiles, std::vector<float>());
+	tile_last_use_.assign(ntiles, 0);
+	tile_clock_ = 0;
+	tile_reads_ = 0;
+
+	cout << "Tiled photon library: " << cachefile << " (" << nvoxels_ << " voxels, " << nchannels_ << " channels), "
+	     << ntiles << " tiles of " << tile_bytes/1048576. << " MB, at most " << max_resident_tiles_ << " in memory" << endl;
+	return true;
+}
+
+//Makes tile the current one, reading it from the cache if it is not in
+//memory and making room for it by dropping the least recently used tile
+bool LibraryAccess::LoadTile(int tile) const
+{
+	if(tile < 0 || tile >= int(tiles_.size())) {return false; }
+
+	if(tiles_[tile].empty())
+	{
+		if(int(resident_tiles_.size()) >= max_resident_tiles_)
+		{
+			size_t lru = 0;
+			for(size_t i = 1; i < resident_tiles_.size(); i++)
+			{
+				if(tile_last_use_[resident_tiles_[i]] < tile_last_use_[resident_tiles_[lru]]) {lru = i; }
+			}
+			std::vector<float>().swap(tiles_[resident_tiles_[lru]]);
+			resident_tiles_.erase(resident_tiles_.begin() + lru);
+		}
+
+		size_t first = size_t(tile)*tile_voxels_;
+		size_t nvoxels = std::min<size_t>(tile_voxels_, nvoxels_ - first);
+		size_t file_row = size_t(tile_file_channels_)*nfields_;
+		size_t row = size_t(nchannels_)*nfields_;
+		bool all_columns = nchannels_ == tile_file_channels_;
+		for(int i = 0; all_columns && i < nchannels_; i++) {all_columns = tile_columns_[i] == i; }
+
+		//Whole file rows are read, into the tile itself when every column is kept
+		std::vector<float>& out = tiles_[tile];
+		out.resize(nvoxels*row);
+		std::vector<float>& in = all_columns ? out : tile_buffer_;
+		in.resize(nvoxels*file_row);
+		char* p = reinterpret_cast<char*>(&in[0]);
+		size_t bytes = nvoxels*file_row*sizeof(float);
+		off_t offset = tile_payload_offset_ + first*file_row*sizeof(float);
+		while(bytes > 0)
+		{
+			ssize_t n = pread(tile_fd_, p, bytes, offset);
+			if(n <= 0)
+			{
+				if(n < 0 && errno == EINTR) {continue; }
+				cout << "Error reading tile " << tile << " of the photon library: " << strerror(errno) << endl;
+				std::vector<float>().swap(out);
+				return false;
+			}
+			p += n;
+			offset += n;
+			bytes -= n;
+		}
+		if(!all_columns)
+		{
+			for(size_t v = 0; v < nvoxels; v++)
+			{
+				for(int c = 0; c < nchannels_; c++)
+				{
+					const float* from = &in[v*file_row + tile_columns_[c]*nfields_];
+					std::copy(from, from + nfields_, &out[v*row + c*nfields_]);
+				}
+			}
+		}
+		resident_tiles_.push_back(tile);
+		tile_reads_++;
+	}
+
+	tile_last_use_[tile] = ++tile_clock_;
+	current_tile_ = tile;
+	current_tile_data_ = tiles_[tile].data();
+	return true;
+}
+
+//Starts the kernel reading the tiles these voxels are in (those not already
+//in memory) into the page cache, so that LoadTile later finds them there
+void LibraryAccess::PrefetchVoxels(const std::vector<int>& voxels) const
+{
+	if(tile_fd_ < 0) {return; }
+
+	std::vector<bool> requested(tiles_.size(), false);
+	size_t file_row = size_t(tile_file_channels_)*nfields_*sizeof(float);
+	for(size_t i = 0; i < voxels.size(); i++)
+	{
+		if(voxels[i] < 0) {continue; }
+		size_t voxel = voxels[i];
+		int probe = 0;
+		MapSymmetry(voxel, probe);
+		size_t tile = voxel/tile_voxels_;
+		if(tile >= tiles_.size() || requested[tile] || !tiles_[tile].empty()) {continue; }
+		requested[tile] = true;
+		size_t first = tile*tile_voxels_;
+		size_t nvoxels = std::min<size_t>(tile_voxels_, nvoxels_ - first);
+		posix_fadvise(tile_fd_, tile_payload_offset_ + first*file_row, nvoxels*file_row, POSIX_FADV_WILLNEED);
+	}
+}
+
+void LibraryAccess::PrintTileReport() const
+{
+	if(tile_fd_ < 0) {return; }
+	cout << "Tiled photon library: " << tile_reads_ << " tile reads for " << tiles_.size() << " tiles, "
+	     << resident_tiles_.size() << " in memory" << endl;
+}
+
+//Principal components of each plane of the loaded table: the eigenvectors
+//of the channel x channel covariance matrix (accumulated over voxels by
+//several threads) with the largest eigenvalues
+bool LibraryAccess::WriteLowRankLibrary(std::string lowrankfile, int rank)
+{
+	if(!data_ || encoding_ != kEncodingFloat32 || !sparse_offsets_.empty())
+	{
+		cout << "A low-rank library can only be made from a dense float table" << endl;
+		return false;
+	}
+	//It covers the whole grid: a y-folded table holds only half its voxels
+	if(fold_y_)
+	{
+		cout << "A low-rank library can only be made from an unfolded table (library_symmetry = kNoSymmetry)" << endl;
+		return false;
+	}
+	rank = std::max(1, std::min(rank, nchannels_));
+	size_t nch = nchannels_;
+	size_t row = nch*nfields_;
+	int nthreads = (loader_threads_ > 0) ? loader_threads_ : std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<float> mean[3], basis[3], scores[3];
+	std::vector<double> sum[3], sum_rec[3], sum_sq_err[3], max_err[3], max_val[3];
+	for(int f = 0; f < nfields_; f++)
+	{
+		//Mean and covariance
+		mean[f].assign(nch, 0);
+		std::vector<double> m(nch, 0);
+		for(size_t v = 0; v < size_t(nvoxels_); v++)
+		{
+			for(size_t c = 0; c < nch; c++) {m[c] += data_[v*row + c*nfields_ + f]; }
+		}
+		for(size_t c = 0; c < nch; c++) {m[c] /= nvoxels_; mean[f][c] = m[c]; }
+
+		std::vector<std::vector<double> > partial(nthreads, std::vector<double>(nch*nch, 0));
+		std::vector<std::thread> workers;
+		for(int t = 0; t < nthreads; t++)
+		{
+			workers.push_back(std::thread([&, t]() {
+				std::vector<double>& cov = partial[t];
+				std::vector<double> x(nch);
+				for(size_t v = t; v < size_t(nvoxels_); v += nthreads)
+				{
+					for(size_t c = 0; c < nch; c++) {x[c] = data_[v*row + c*nfields_ + f] - m[c]; }
+					for(size_t a = 0; a < nch; a++)
+					{
+						double xa = x[a];
+						double* out = &cov[a*nch];
+						for(size_t b = a; b < nch; b++) {out[b] += xa*x[b]; }
+					}
+				}
+			}));
+		}
+		for(int t = 0; t < nthreads; t++) {workers[t].join(); }
+
+		TMatrixDSym cov(nch);
+		for(size_t a = 0; a < nch; a++)
+		{
+			for(size_t b = a; b < nch; b++)
+			{
+				double c = 0;
+				for(int t = 0; t < nthreads; t++) {c += partial[t][a*nch + b]; }
+				cov(a, b) = c;
+				cov(b, a) = c;
+			}
+		}
+		TMatrixDSymEigen eigen(cov);
+		const TVectorD& values = eigen.GetEigenValues();
+		const TMatrixD& vectors = eigen.GetEigenVectors();
+		double total = 0, kept = 0;
+		for(size_t k = 0; k < nch; k++) {total += std::max(0., values(k)); }
+		for(int k = 0; k < rank; k++) {kept += std::max(0., values(k)); }
+		cout << "Plane " << f << ": " << rank << " components keep " << ((total > 0) ? 100*kept/total : 100) << "% of the variance" << endl;
+
+		basis[f].resize(size_t(rank)*nch);
+		for(int k = 0; k < rank; k++)
+		{
+			for(size_t c = 0; c < nch; c++) {basis[f][k*nch + c] = vectors(c, k); }
+		}
+
+		//Scores, and the error of the reconstruction they give
+		scores[f].resize(size_t(nvoxels_)*rank);
+		sum[f].assign(nch, 0);
+		sum_rec[f].assign(nch, 0);
+		sum_sq_err[f].assign(nch, 0);
+		max_err[f].assign(nch, 0);
+		max_val[f].assign(nch, 0);
+		std::vector<double> x(nch), rec(nch);
+		for(size_t v = 0; v < size_t(nvoxels_); v++)
+		{
+			for(size_t c = 0; c < nch; c++) {x[c] = data_[v*row + c*nfields_ + f] - m[c]; rec[c] = m[c]; }
+			for(int k = 0; k < rank; k++)
+			{
+				const float* b = &basis[f][k*nch];
+				double s = 0;
+				for(size_t c = 0; c < nch; c++) {s += x[c]*b[c]; }
+				scores[f][v*rank + k] = s;
+				for(size_t c = 0; c < nch; c++) {rec[c] += float(s)*b[c]; }
+			}
+			for(size_t c = 0; c < nch; c++)
+			{
+				double exact = x[c] + m[c];
+				double r = (f == reflT_offset_) ? rec[c] : std::max(0., rec[c]); // visibilities are clamped at 0 on lookup
+				sum[f][c] += exact;
+				sum_rec[f][c] += r;
+				sum_sq_err[f][c] += (r - exact)*(r - exact);
+				max_err[f][c] = std::max(max_err[f][c], fabs(r - exact));
+				max_val[f][c] = std::max(max_val[f][c], fabs(exact));
+			}
+		}
+	}
+
+	//Per channel error report: shift of the channel's total (what the mean
+	//number of photoelectrons follows), and the rms and largest error
+	//relative to the channel's mean and largest value
+	const char* plane_names[3] = {"vis", "refl", "reflT0"};
+	cout << "Reconstruction error per channel (total shift %, rms/mean %, max/max %):" << endl;
+	for(size_t c = 0; c < nch; c++)
+	{
+		cout << "  PMT " << channels_[c] << ":";
+		for(int f = 0; f < nfields_; f++)
+		{
+			const char* name = (f == 0) ? plane_names[0] : (f == refl_offset_) ? plane_names[1] : plane_names[2];
+			double channel_mean = sum[f][c]/nvoxels_;
+			double shift = (sum[f][c] != 0) ? 100*(sum_rec[f][c] - sum[f][c])/sum[f][c] : 0;
+			double rms = (channel_mean != 0) ? 100*sqrt(sum_sq_err[f][c]/nvoxels_)/fabs(channel_mean) : 0;
+			double max = (max_val[f][c] > 0) ? 100*max_err[f][c]/max_val[f][c] : 0;
+			cout << "  " << name << " " << shift << " / " << rms << " / " << max;
+		}
+		cout << endl;
+	}
+
+	LowRankLibraryHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kLowRankMagic, sizeof(kLowRankMagic));
+	header.version = kLowRankVersion;
+	header.header_size = sizeof(header);
+	header.nvoxels = nvoxels_;
+	header.nchannels = nchannels_;
+	header.nfields = nfields_;
+	header.refl_offset = refl_offset_;
+	header.reflT_offset = reflT_offset_;
+	header.rank = rank;
+	header.grid_steps[0] = level_grid_.nx();
+	header.grid_steps[1] = level_grid_.ny();
+	header.grid_steps[2] = level_grid_.nz();
+	header.header_checksum = CacheChecksum(&header, offsetof(LowRankLibraryHeader, header_checksum));
+
+	std::vector<int32_t> channel_map(channels_.begin(), channels_.end());
+	std::string tmpfile = lowrankfile + ".tmp";
+	ofstream out(tmpfile.c_str(), ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(&channel_map[0]), channel_map.size()*sizeof(int32_t));
+	for(int f = 0; f < nfields_; f++)
+	{
+		out.write(reinterpret_cast<const char*>(&mean[f][0]), mean[f].size()*sizeof(float));
+		out.write(reinterpret_cast<const char*>(&basis[f][0]), basis[f].size()*sizeof(float));
+		out.write(reinterpret_cast<const char*>(&scores[f][0]), scores[f].size()*sizeof(float));
+	}
+	out.close();
+	if(!out || rename(tmpfile.c_str(), lowrankfile.c_str()) != 0)
+	{
+		cout << "Error writing low-rank library: " << lowrankfile << endl;
+		remove(tmpfile.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool LibraryAccess::LoadLowRankLibrary(std::string lowrankfile, bool reflected, bool reflT0)
+{
+	ifstream in(lowrankfile.c_str(), ios::binary);
+	LowRankLibraryHeader header;
+	if(!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {return false; }
+	if(memcmp(header.magic, kLowRankMagic, sizeof(kLowRankMagic)) != 0 || header.version != kLowRankVersion ||
+	   header.header_size != sizeof(header) || header.header_checksum != CacheChecksum(&header, offsetof(LowRankLibraryHeader, header_checksum)))
+	{
+		cout << "Low-rank library " << lowrankfile << " is not in the format of this build" << endl;
+		return false;
+	}
+	if(GridLevel(header.grid_steps) < 0 || header.nvoxels != header.grid_steps[0]*header.grid_steps[1]*header.grid_steps[2])
+	{
+		cout << "Low-rank library " << lowrankfile << " was built for a different voxel grid" << endl;
+		return false;
+	}
+
+	size_t nch = header.nchannels;
+	size_t rank = header.rank;
+	std::vector<int32_t> file_channels(nch);
+	std::vector<float> mean[3], basis[3], scores[3];
+	in.read(reinterpret_cast<char*>(&file_channels[0]), nch*sizeof(int32_t));
+	for(int f = 0; f < header.nfields && f < 3; f++)
+	{
+		mean[f].resize(nch);
+		basis[f].resize(rank*nch);
+		scores[f].resize(size_t(header.nvoxels)*rank);
+		in.read(reinterpret_cast<char*>(&mean[f][0]), mean[f].size()*sizeof(float));
+		in.read(reinterpret_cast<char*>(&basis[f][0]), basis[f].size()*sizeof(float));
+		in.read(reinterpret_cast<char*>(&scores[f][0]), scores[f].size()*sizeof(float));
+	}
+	if(!in)
+	{
+		cout << "Low-rank library " << lowrankfile << " is truncated" << endl;
+		return false;
+	}
+
+	ReleaseLibrary();
+	table_level_ = GridLevel(header.grid_steps);
+	level_grid_ = LevelGrid(table_level_);
+	nvoxels_ = header.nvoxels;
+	nfields_ = header.nfields;
+	lowrank_rank_ = rank;
+	lowrank_timing_field_ = header.reflT_offset;
+
+	//Keep only the columns of the active channels
+	SetChannelMap(std::vector<int>(file_channels.begin(), file_channels.end()));
+	std::vector<int> wanted;
+	std::vector<int> source;
+	for(size_t i = 0; i < (active_channels_.empty() ? channels_.size() : active_channels_.size()); i++)
+	{
+		int channel = active_channels_.empty() ? channels_[i] : active_channels_[i];
+		int index = GetChannelIndex(channel);
+		if(index < 0) {cout << "WARNING: channel " << channel << " is not in the low-rank library" << endl; continue; }
+		wanted.push_back(channel);
+		source.push_back(index);
+	}
+	SetChannelMap(wanted);
+	for(int f = 0; f < nfields_; f++)
+	{
+		lowrank_mean_[f].resize(nchannels_);
+		lowrank_basis_[f].resize(rank*nchannels_);
+		for(int c = 0; c < nchannels_; c++)
+		{
+			lowrank_mean_[f][c] = mean[f][source[c]];
+			for(size_t k = 0; k < rank; k++) {lowrank_basis_[f][k*nchannels_ + c] = basis[f][k*nch + source[c]]; }
+		}
+		lowrank_scores_[f].swap(scores[f]);
+	}
+	computed_row_.assign(size_t(nchannels_)*nfields_, 0);
+	row_voxel_ = -1;
+
+	refl_offset_ = reflected ? header.refl_offset : -1;
+	reflT_offset_ = reflT0 ? header.reflT_offset : -1;
+	if((reflected && header.refl_offset < 0) || (reflT0 && header.reflT_offset < 0))
+	{
+		cout << "WARNING: low-rank library " << lowrankfile << " has no reflected light, it will read as zero" << endl;
+	}
+
+	size_t bytes = 0;
+	for(int f = 0; f < nfields_; f++) {bytes += (lowrank_mean_[f].size() + lowrank_basis_[f].size() + lowrank_scores_[f].size())*sizeof(float); }
+	cout << "Loaded low-rank photon library: " << lowrankfile << " (" << nvoxels_ << " voxels, " << nchannels_ << " channels, rank "
+	     << rank << ", " << bytes/1048576. << " MB)" << endl;
+	return true;
+}
+
+//Rebuilds the table row of voxel from its scores: for each plane,
+//mean + scores x basis over the loaded channels
+void LibraryAccess::ReconstructRow(size_t voxel) const
+{
+	int rank = lowrank_rank_;
+	int nch = nchannels_;
+	float* row = &computed_row_[0];
+	for(int f = 0; f < nfields_; f++)
+	{
+		const float* s = &lowrank_scores_[f][voxel*rank];
+		const float* b = &lowrank_basis_[f][0];
+		for(int c = 0; c < nch; c++) {row[c*nfields_ + f] = lowrank_mean_[f][c]; }
+		for(int k = 0; k < rank; k++)
+		{
+			float sk = s[k];
+			const float* bk = b + k*nch;
+			for(int c = 0; c < nch; c++) {row[c*nfields_ + f] += sk*bk[c]; }
+		}
+		//the visibilities must not come out negative
+		if(f == lowrank_timing_field_) {continue; }
+		for(int c = 0; c < nch; c++) {row[c*nfields_ + f] = std::max(0.f, row[c*nfields_ + f]); }
+	}
+}
+
+//Semi-analytic model, see LoadAnalyticModel. The correction tables are
+//binned in the distance from the (image) source to the PMT and in the
+//cosine of the angle to the PMT axis, which is along x
+namespace {
+
+	const int kAnalyticDistanceBins = 40;
+	const double kAnalyticDistanceStep = 20.; //cm
+	const int kAnalyticCosBins = 10;
+	const int kAnalyticBins = kAnalyticDistanceBins*kAnalyticCosBins;
+	const double kPMTRadius = 10.16;          //cm, 8" PMTs
+	const double kRayleighLength = 60.;       //cm, VUV scintillation light in LAr
+	const double kVisibleSpeed = 29.98/1.23;  //cm/ns, visible light in LAr
+
+	int AnalyticBin(double distance, double cos_angle)
+	{
+		int d = std::min(int(distance/kAnalyticDistanceStep), kAnalyticDistanceBins - 1);
+		int c = std::min(int(cos_angle*kAnalyticCosBins), kAnalyticCosBins - 1);
+		return d*kAnalyticCosBins + c;
+	}
+
+	//Fraction of the light from a point source at distance d that hits a
+	//disc of radius kPMTRadius seen at an angle with cosine cos_angle,
+	//0.5*(1 - d/s) with s = sqrt(d^2 + R^2) written as R^2/(2 s (s + d)) so
+	//it keeps its precision in floats far from the PMT
+	float SolidAngleFraction(float d, float cos_angle)
+	{
+		const float r2 = kPMTRadius*kPMTRadius;
+		float s = sqrt(d*d + r2);
+		return 0.5f*r2/(s*(s + d))*cos_angle;
+	}
+
+#ifdef __SSE2__
+	__m128 SolidAngleFraction(__m128 d, __m128 cos_angle)
+	{
+		const __m128 r2 = _mm_set1_ps(kPMTRadius*kPMTRadius);
+		__m128 s = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(d, d), r2));
+		__m128 fraction = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r2), _mm_mul_ps(s, _mm_add_ps(s, d)));
+		return _mm_mul_ps(fraction, cos_angle);
+	}
+
+	//exp(x) for x <= 0, four at a time: 2^n e^r with |r| <= ln2/2 and a
+	//polynomial for e^r (Cephes expf), relative error ~1e-7; below -87 it
+	//gives the smallest normal float rather than 0
+	__m128 ExpNegative(__m128 x)
+	{
+		x = _mm_max_ps(x, _mm_set1_ps(-87.f));
+		__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f));
+		__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+		n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, fx), _mm_set1_ps(1.f))); //floor
+		__m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f))), _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+		__m128 p = _mm_set1_ps(1.9875691500e-4f);
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+		p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+		p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), r), _mm_set1_ps(1.f));
+		__m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+	}
+#endif
+
+	//Per channel quantities of an analytic row, one array each
+	struct AnalyticColumns{
+		std::vector<float> vis;
+		std::vector<float> d;
+		std::vector<float> cos_angle;
+		std::vector<float> side;       //1 on the voxel's side of the cathode, else 0
+		std::vector<float> refl;
+		std::vector<float> image_d;
+		std::vector<float> image_cos;
+		void Resize(size_t n)
+		{
+			vis.resize(n); d.resize(n); cos_angle.resize(n); side.resize(n);
+			refl.resize(n); image_d.resize(n); image_cos.resize(n);
+		}
+	};
+
+	//The uncorrected model for channels [c, nch) at PMT positions px, py, pz
+	//seen from (x, y, z); the reflected light only if reflected is set
+	void AnalyticColumnsScalar(int c, int nch, const float* px, const float* py, const float* pz, float x, float y, float z,
+	                           bool reflected, AnalyticColumns& columns)
+	{
+		for(; c < nch; c++)
+		{
+			float dx = fabs(px[c] - x);
+			float dyz2 = (py[c] - y)*(py[c] - y) + (pz[c] - z)*(pz[c] - z);
+			float side = (px[c]*x > 0) ? 1.f : 0.f;
+			float d = sqrt(dx*dx + dyz2);
+			float cos_angle = dx/d;
+			columns.d[c] = d;
+			columns.cos_angle[c] = cos_angle;
+			columns.side[c] = side;
+			columns.vis[c] = SolidAngleFraction(d, cos_angle)*exp(-d*float(1/kRayleighLength))*side;
+			if(!reflected) {continue; }
+			float image_dx = fabs(px[c]) + fabs(x);
+			float image_d = sqrt(image_dx*image_dx + dyz2);
+			float image_cos = image_dx/image_d;
+			columns.image_d[c] = image_d;
+			columns.image_cos[c] = image_cos;
+			columns.refl[c] = SolidAngleFraction(image_d, image_cos)*side;
+		}
+	}
+
+	//As AnalyticColumnsScalar, four channels at a time
+	void AnalyticColumnsSimd(int nch, const float* px, const float* py, const float* pz, float x, float y, float z,
+	                         bool reflected, AnalyticColumns& columns)
+	{
+		int c = 0;
+#ifdef __SSE2__
+		const __m128 vx = _mm_set1_ps(x), vy = _mm_set1_ps(y), vz = _mm_set1_ps(z);
+		const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		const __m128 one = _mm_set1_ps(1.f), zero = _mm_setzero_ps();
+		const __m128 image_x = _mm_and_ps(vx, abs_mask);
+		for(; c + 4 <= nch; c += 4)
+		{
+			__m128 pxc = _mm_loadu_ps(px + c);
+			__m128 dx = _mm_and_ps(_mm_sub_ps(pxc, vx), abs_mask);
+			__m128 dy = _mm_sub_ps(_mm_loadu_ps(py + c), vy);
+			__m128 dz = _mm_sub_ps(_mm_loadu_ps(pz + c), vz);
+			__m128 dyz2 = _mm_add_ps(_mm_mul_ps(dy, dy), _mm_mul_ps(dz, dz));
+			__m128 side = _mm_and_ps(_mm_cmpgt_ps(_mm_mul_ps(pxc, vx), zero), one);
+			__m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dyz2));
+			__m128 cos_angle = _mm_div_ps(dx, d);
+			__m128 attenuation = ExpNegative(_mm_mul_ps(d, _mm_set1_ps(-1/kRayleighLength)));
+			_mm_storeu_ps(&columns.d[c], d);
+			_mm_storeu_ps(&columns.cos_angle[c], cos_angle);
+			_mm_storeu_ps(&columns.side[c], side);
+			_mm_storeu_ps(&columns.vis[c], _mm_mul_ps(_mm_mul_ps(SolidAngleFraction(d, cos_angle), attenuation), side));
+			if(!reflected) {continue; }
+			__m128 image_dx = _mm_add_ps(_mm_and_ps(pxc, abs_mask), image_x);
+			__m128 image_d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(image_dx, image_dx), dyz2));
+			__m128 image_cos = _mm_div_ps(image_dx, image_d);
+			_mm_storeu_ps(&columns.image_d[c], image_d);
+			_mm_storeu_ps(&columns.image_cos[c], image_cos);
+			_mm_storeu_ps(&columns.refl[c], _mm_mul_ps(SolidAngleFraction(image_d, image_cos), side));
+		}
+#endif
+		AnalyticColumnsScalar(c, nch, px, py, pz, x, y, z, reflected, columns);
+	}
+}
+
+void LibraryAccess::LoadAnalyticModel(const PMTLayout& pmts, std::string correction_file, bool reflected, bool reflT0)
+{
+	ReleaseLibrary();
+	table_level_ = resolution_level_;
+	level_grid_ = LevelGrid(table_level_);
+	nvoxels_ = GetNumberOfGridVoxels();
+	nfields_ = 1;
+	refl_offset_ = reflected ? nfields_++ : -1;
+	reflT_offset_ = reflT0 ? nfields_++ : -1;
+
+	SetChannelMap(SelectChannels(pmts.index.size()));
+	std::vector<int> channels;
+	for(int c = 0; c < nchannels_; c++)
+	{
+		int i = pmts.Index(channels_[c]);
+		if(i < 0) {continue; } //a gap in the layout's channel numbers
+		channels.push_back(channels_[c]);
+		analytic_x_.push_back(pmts.x[i]);
+		analytic_y_.push_back(pmts.y[i]);
+		analytic_z_.push_back(pmts.z[i]);
+	}
+	SetChannelMap(channels);
+	analytic_ = true;
+	computed_row_.assign(size_t(nchannels_)*nfields_, 0);
+	row_voxel_ = -1;
+	requested_.clear();
+
+	if(!correction_file.empty() && !ReadAnalyticCorrection(correction_file))
+	{
+		cout << "WARNING: no analytic visibility correction read from " << correction_file << ", the model is used uncorrected" << endl;
+	}
+	cout << "Analytic visibility model: " << nvoxels_ << " voxels, " << nchannels_ << " channels, "
+	     << (analytic_correction_[0].empty() ? "uncorrected" : "corrected") << endl;
+}
+
+//Text file: the bin counts, then for vis, refl and reflT0 in turn one line
+//of kAnalyticCosBins values per distance bin
+bool LibraryAccess::ReadAnalyticCorrection(const std::string& correction_file)
+{
+	ifstream in(correction_file.c_str());
+	int ndistance, ncos;
+	double step;
+	if(!(in >> ndistance >> step >> ncos)) {return false; }
+	if(ndistance != kAnalyticDistanceBins || step != kAnalyticDistanceStep || ncos != kAnalyticCosBins)
+	{
+		cout << "Analytic visibility correction " << correction_file << " has a different binning" << endl;
+		return false;
+	}
+	std::vector<float> correction[3];
+	for(int f = 0; f < 3; f++)
+	{
+		correction[f].resize(kAnalyticBins);
+		for(int b = 0; b < kAnalyticBins; b++) {in >> correction[f][b]; }
+	}
+	if(!in)
+	{
+		cout << "Analytic visibility correction " << correction_file << " is truncated" << endl;
+		return false;
+	}
+	for(int f = 0; f < 3; f++) {analytic_correction_[f].swap(correction[f]); }
+	row_voxel_ = -1;
+	return true;
+}
+
+//The table row of voxel (already mapped into the stored half of the
+//detector), for all channels at once: the model in one pass over the
+//channels, vectorised, then the binned corrections, which are lookups, in
+//a second
+void LibraryAccess::EvaluateAnalyticRow(size_t voxel, float* row, bool corrected) const
+{
+	double position[3];
+	GetVoxelPosition(voxel, position);
+	const int nch = nchannels_;
+	bool correct = corrected && !analytic_correction_[0].empty();
+
+	static thread_local AnalyticColumns columns;
+	columns.Resize(nch);
+	if(nch == 0) {return; }
+	AnalyticColumnsSimd(nch, &analytic_x_[0], &analytic_y_[0], &analytic_z_[0], position[0], position[1], position[2], nfields_ > 1, columns);
+
+	for(int c = 0; c < nch; c++)
+	{
+		float vis = columns.vis[c];
+		if(correct) {vis *= analytic_correction_[0][AnalyticBin(columns.d[c], columns.cos_angle[c])]; }
+		row[c*nfields_] = vis;
+	}
+	if(nfields_ == 1) {return; }
+
+	//reflected light: from the image of the voxel in the cathode plane
+	for(int c = 0; c < nch; c++)
+	{
+		int bin = correct ? AnalyticBin(columns.image_d[c], columns.image_cos[c]) : 0;
+		if(refl_offset_ > 0)
+		{
+			float refl = columns.refl[c];
+			if(correct) {refl *= analytic_correction_[1][bin]; }
+			row[c*nfields_ + refl_offset_] = refl;
+		}
+		if(reflT_offset_ > 0)
+		{
+			float t0 = columns.image_d[c]/kVisibleSpeed;
+			if(correct) {t0 += analytic_correction_[2][bin]; }
+			row[c*nfields_ + reflT_offset_] = t0*columns.side[c];
+		}
+	}
+}
+
+//Fits the corrections bin by bin: vis and refl by the ratio of the summed
+//library and model values, reflT0 by the mean difference where the library
+//has reflected light
+bool LibraryAccess::FitAnalyticCorrection(LibraryAccess& library, std::string correction_file)
+{
+	if(!analytic_ || library.GetNumberOfGridVoxels() != GetNumberOfGridVoxels())
+	{
+		cout << "The analytic model and the library must be loaded on the same grid to fit the correction" << endl;
+		return false;
+	}
+	PrintAnalyticBias(library, false);
+
+	std::vector<double> sum_library[3], sum_model[3], entries(kAnalyticBins, 0);
+	for(int f = 0; f < 3; f++)
+	{
+		sum_library[f].assign(kAnalyticBins, 0);
+		sum_model[f].assign(kAnalyticBins, 0);
+	}
+	std::vector<float> row(size_t(nchannels_)*nfields_);
+	for(int voxel = 0; voxel < nvoxels_; voxel++)
+	{
+		EvaluateAnalyticRow(voxel, &row[0], false);
+		double position[3];
+		GetVoxelPosition(voxel, position);
+		for(int c = 0; c < nchannels_; c++)
+		{
+			const float* model = &row[c*nfields_];
+			if(model[0] <= 0) {continue; } //the far side of the cathode
+			int channel = channels_[c];
+			double dx = fabs(analytic_x_[c] - position[0]);
+			double dyz2 = pow(analytic_y_[c] - position[1], 2) + pow(analytic_z_[c] - position[2], 2);
+			double d = sqrt(dx*dx + dyz2);
+			int bin = AnalyticBin(d, dx/d);
+			sum_library[0][bin] += library.GetCounts(voxel, channel);
+			sum_model[0][bin] += model[0];
+			if(nfields_ == 1) {continue; }
+
+			double image_dx = fabs(analytic_x_[c]) + fabs(position[0]);
+			double image_d = sqrt(image_dx*image_dx + dyz2);
+			int image_bin = AnalyticBin(image_d, image_dx/image_d);
+			float refl = library.GetReflCounts(voxel, channel, true);
+			if(refl_offset_ > 0)
+			{
+				sum_library[1][image_bin] += refl;
+				sum_model[1][image_bin] += model[refl_offset_];
+			}
+			if(reflT_offset_ > 0 && refl > 0)
+			{
+				sum_library[2][image_bin] += library.GetReflT0(voxel, channel);
+				sum_model[2][image_bin] += model[reflT_offset_];
+				entries[image_bin]++;
+			}
+		}
+	}
+
+	ofstream out(correction_file.c_str());
+	out << kAnalyticDistanceBins << " " << kAnalyticDistanceStep << " " << kAnalyticCosBins << endl;
+	for(int f = 0; f < 3; f++)
+	{
+		for(int b = 0; b < kAnalyticBins; b++)
+		{
+			double value = (f == 2) ? 0 : 1; //empty bins are left as they are
+			if(f < 2 && sum_model[f][b] > 0) {value = sum_library[f][b]/sum_model[f][b]; }
+			if(f == 2 && entries[b] > 0) {value = (sum_library[f][b] - sum_model[f][b])/entries[b]; }
+			out << value << ((b + 1) % kAnalyticCosBins ? " " : "\n");
+		}
+	}
+	out.close();
+	if(!out || !ReadAnalyticCorrection(correction_file))
+	{
+		cout << "Could not write the analytic visibility correction " << correction_file << endl;
+		return false;
+	}
+	cout << "Wrote the analytic visibility correction " << correction_file << endl;
+	PrintAnalyticBias(library, true);
+	return true;
+}
+
+//Per channel: summed model over summed library - 1 and the rms of the
+//differences relative to the rms library value, for vis and refl, and the
+//mean reflT0 offset (ns) where the library has reflected light
+void LibraryAccess::PrintAnalyticBias(LibraryAccess& library, bool corrected) const
+{
+	std::vector<double> sum_library[2], sum_model[2], sum_diff2[2], sum_library2[2], sum_dt(nchannels_, 0), nt(nchannels_, 0);
+	for(int f = 0; f < 2; f++)
+	{
+		sum_library[f].assign(nchannels_, 0);
+		sum_model[f].assign(nchannels_, 0);
+		sum_diff2[f].assign(nchannels_, 0);
+		sum_library2[f].assign(nchannels_, 0);
+	}
+	std::vector<float> row(size_t(nchannels_)*nfields_);
+	for(int voxel = 0; voxel < nvoxels_; voxel++)
+	{
+		EvaluateAnalyticRow(voxel, &row[0], corrected);
+		for(int c = 0; c < nchannels_; c++)
+		{
+			int channel = channels_[c];
+			float lib[2] = {library.GetCounts(voxel, channel), refl_offset_ > 0 ? library.GetReflCounts(voxel, channel, true) : 0};
+			float model[2] = {row[c*nfields_], refl_offset_ > 0 ? row[c*nfields_ + refl_offset_] : 0};
+			for(int f = 0; f < 2; f++)
+			{
+				sum_library[f][c] += lib[f];
+				sum_model[f][c] += model[f];
+				sum_diff2[f][c] += (model[f] - lib[f])*(model[f] - lib[f]);
+				sum_library2[f][c] += lib[f]*lib[f];
+			}
+			if(reflT_offset_ > 0 && lib[1] > 0)
+			{
+				sum_dt[c] += row[c*nfields_ + reflT_offset_] - library.GetReflT0(voxel, channel);
+				nt[c]++;
+			}
+		}
+	}
+
+	cout << "Analytic visibility bias against the library, " << (corrected ? "corrected" : "uncorrected") << ":" << endl;
+	cout << "channel   vis bias  vis rms   refl bias  refl rms  reflT0 offset [ns]" << endl;
+	double worst = 0;
+	for(int c = 0; c < nchannels_; c++)
+	{
+		cout << channels_[c];
+		for(int f = 0; f < 2; f++)
+		{
+			double bias = sum_library[f][c] > 0 ? sum_model[f][c]/sum_library[f][c] - 1 : 0;
+			double rms = sum_library2[f][c] > 0 ? sqrt(sum_diff2[f][c]/sum_library2[f][c]) : 0;
+			cout << "\t" << bias << "\t" << rms;
+			if(f == 0 && sum_model[f][c] > 0) {worst = std::max(worst, fabs(bias)); }
+		}
+		cout << "\t" << (nt[c] > 0 ? sum_dt[c]/nt[c] : 0) << endl;
+	}
+	cout << "Largest |vis bias| over the channels the model sees the voxels from: " << worst << endl;
+}
+
+//Builds a store from libraries that differ only in their reflected light:
+//the direct visibility of the first one is kept for all of them, after
+//checking every other library's against it (entries differing by more than
+//tolerance, relative, are reported, and such a library keeps its own).
+//Only one library is in memory at a time.
+bool LibraryAccess::WriteLibraryStore(std::string storefile, const std::vector<std::string>& libraryfiles, double tolerance)
+{
+	int nconfigs = libraryfiles.size();
+	if(nconfigs == 0) {return false; }
+
+	std::vector<float> direct;
+	std::vector<int> channels;
+	std::vector<LibraryStoreEntry> entries(nconfigs);
+	LibraryStoreHeader header;
+	memset(&header, 0, sizeof(header));
+
+	std::string tmpfile = storefile + ".tmp";
+	ofstream out(tmpfile.c_str(), ios::binary | ios::trunc);
+	uint64_t offset = 0;
+
+	for(int k = 0; k < nconfigs; k++)
+	{
+		LibraryAccess library;
+		library.LoadLibraryFromFile(libraryfiles[k], true, true);
+		if(!library.data_ || library.table_level_ != 0)
+		{
+			cout << "Could not load " << libraryfiles[k] << endl;
+			out.close();
+			remove(tmpfile.c_str());
+			return false;
+		}
+		size_t nvoxels = library.nvoxels_;
+		size_t nch = library.nchannels_;
+		int nfields = library.nfields_;
+
+		if(k == 0)
+		{
+			header.nvoxels = nvoxels;
+			header.nchannels = nch;
+			channels = library.channels_;
+			direct.resize(nvoxels*nch);
+			for(size_t i = 0; i < nvoxels*nch; i++) {direct[i] = library.data_[i*nfields]; }
+
+			//Room for the header, channel map and entries, then the shared plane
+			size_t prefix = sizeof(header) + nch*sizeof(int32_t) + nconfigs*sizeof(LibraryStoreEntry);
+			offset = (prefix/kCachePayloadAlign + 1)*kCachePayloadAlign;
+			std::vector<char> zeros(offset, 0);
+			out.write(&zeros[0], zeros.size());
+			header.direct_offset = offset;
+			out.write(reinterpret_cast<const char*>(&direct[0]), direct.size()*sizeof(float));
+			offset += direct.size()*sizeof(float);
+		}
+		else if(int(nvoxels) != header.nvoxels || library.channels_ != channels)
+		{
+			cout << libraryfiles[k] << " does not have the voxels and channels of " << libraryfiles[0] << ", it cannot share its direct visibility" << endl;
+			out.close();
+			remove(tmpfile.c_str());
+			return false;
+		}
+
+		//Compare the direct visibility with the shared one
+		size_t ndiffer = 0;
+		double max_abs = 0, max_rel = 0;
+		int worst_channel = -1;
+		for(size_t i = 0; i < nvoxels*nch; i++)
+		{
+			double a = direct[i], b = library.data_[i*nfields];
+			double diff = fabs(a - b);
+			double rel = (diff > 0) ? diff/std::max(fabs(a), fabs(b)) : 0;
+			if(rel > tolerance) {ndiffer++; }
+			if(diff > max_abs) {max_abs = diff; worst_channel = channels[i % nch]; }
+			max_rel = std::max(max_rel, rel);
+		}
+
+		LibraryStoreEntry& entry = entries[k];
+		memset(&entry, 0, sizeof(entry));
+		strncpy(entry.name, libraryfiles[k].c_str(), sizeof(entry.name) - 1);
+		entry.direct_offset = header.direct_offset;
+		if(k > 0)
+		{
+			cout << libraryfiles[k] << ": direct visibility differs from " << libraryfiles[0] << " in " << ndiffer << " of " << nvoxels*nch
+			     << " entries (largest difference " << max_abs << ", PMT " << worst_channel << "; largest relative difference " << max_rel << ")" << endl;
+		}
+		if(ndiffer > 0)
+		{
+			cout << "  keeping the direct visibility of " << libraryfiles[k] << " separately" << endl;
+			entry.own_direct = 1;
+			entry.direct_offset = offset;
+			for(size_t i = 0; i < nvoxels*nch; i++) {out.write(reinterpret_cast<const char*>(&library.data_[i*nfields]), sizeof(float)); }
+			offset += nvoxels*nch*sizeof(float);
+		}
+
+		//The reflected planes, as they are interleaved in the table
+		entry.nrefl = nfields - 1;
+		entry.refl_index = (library.refl_offset_ > 0) ? library.refl_offset_ - 1 : -1;
+		entry.reflT_index = (library.reflT_offset_ > 0) ? library.reflT_offset_ - 1 : -1;
+		entry.refl_offset = offset;
+		if(entry.nrefl > 0)
+		{
+			std::vector<float> refl(nch*entry.nrefl);
+			for(size_t v = 0; v < nvoxels; v++)
+			{
+				for(size_t c = 0; c < nch; c++)
+				{
+					const float* from = library.data_ + (v*nch + c)*nfields + 1;
+					std::copy(from, from + entry.nrefl, &refl[c*entry.nrefl]);
+				}
+				out.write(reinterpret_cast<const char*>(&refl[0]), refl.size()*sizeof(float));
+			}
+			offset += nvoxels*nch*entry.nrefl*sizeof(float);
+		}
+	}
+
+	memcpy(header.magic, kStoreMagic, sizeof(kStoreMagic));
+	header.version = kStoreVersion;
+	header.header_size = sizeof(header);
+	header.nconfigs = nconfigs;
+	header.grid_steps[0] = SBNDVoxelGrid::kNx;
+	header.grid_steps[1] = SBNDVoxelGrid::kNy;
+	header.grid_steps[2] = SBNDVoxelGrid::kNz;
+	header.header_checksum = CacheChecksum(&header, offsetof(LibraryStoreHeader, header_checksum));
+	std::vector<int32_t> channel_map(channels.begin(), channels.end());
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(&channel_map[0]), channel_map.size()*sizeof(int32_t));
+	out.write(reinterpret_cast<const char*>(&entries[0]), entries.size()*sizeof(LibraryStoreEntry));
+	out.close();
+	if(!out || rename(tmpfile.c_str(), storefile.c_str()) != 0)
+	{
+		cout << "Error writing library store: " << storefile << endl;
+		remove(tmpfile.c_str());
+		return false;
+	}
+	return true;
+}
+
+//Maps the store; if only some of its channels are wanted, their columns of
+//every plane are copied out and the mapping dropped
+bool LibraryAccess::LoadLibraryStore(std::string storefile, bool reflected, bool reflT0)
+{
+	int fd = open(storefile.c_str(), O_RDONLY);
+	if(fd < 0) {return false; }
+	struct stat st;
+	void* mapped = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(LibraryStoreHeader))
+	{
+		mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(mapped == MAP_FAILED) {return false; }
+
+	const char* image = static_cast<const char*>(mapped);
+	LibraryStoreHeader header;
+	memcpy(&header, image, sizeof(header));
+	uint64_t size = st.st_size;
+	uint64_t plane_bytes = uint64_t(header.nvoxels)*header.nchannels*sizeof(float);
+	bool ok = memcmp(header.magic, kStoreMagic, sizeof(kStoreMagic)) == 0 && header.version == kStoreVersion && header.header_size == sizeof(header) &&
+	          header.header_checksum == CacheChecksum(&header, offsetof(LibraryStoreHeader, header_checksum));
+	ok = ok && header.grid_steps[0] == gxSteps && header.grid_steps[1] == gySteps && header.grid_steps[2] == gzSteps;
+	ok = ok && sizeof(header) + header.nchannels*sizeof(int32_t) + header.nconfigs*sizeof(LibraryStoreEntry) <= size && header.direct_offset + plane_bytes <= size;
+	const LibraryStoreEntry* entries = reinterpret_cast<const LibraryStoreEntry*>(image + sizeof(header) + header.nchannels*sizeof(int32_t));
+	for(int k = 0; ok && k < header.nconfigs; k++)
+	{
+		ok = entries[k].direct_offset + plane_bytes <= size && entries[k].refl_offset + plane_bytes*entries[k].nrefl <= size &&
+		     entries[k].nrefl >= 0 && entries[k].nrefl <= 2;
+	}
+	if(!ok)
+	{
+		cout << "Library store " << storefile << " is corrupt or not in the format of this build" << endl;
+		munmap(mapped, st.st_size);
+		return false;
+	}
+
+	ReleaseLibrary();
+	mapped_ = mapped;
+	mapped_size_ = st.st_size;
+	nvoxels_ = header.nvoxels;
+	nfields_ = 3;
+	refl_offset_ = reflected ? 1 : -1;
+	reflT_offset_ = reflT0 ? 2 : -1;
+
+	const int32_t* file_channels = reinterpret_cast<const int32_t*>(image + sizeof(header));
+	SetChannelMap(std::vector<int>(file_channels, file_channels + header.nchannels));
+	std::vector<int> wanted;
+	std::vector<int> source;
+	for(size_t i = 0; i < (active_channels_.empty() ? channels_.size() : active_channels_.size()); i++)
+	{
+		int channel = active_channels_.empty() ? channels_[i] : active_channels_[i];
+		int index = GetChannelIndex(channel);
+		if(index < 0) {cout << "WARNING: channel " << channel << " is not in the library store" << endl; continue; }
+		wanted.push_back(channel);
+		source.push_back(index);
+	}
+	bool all_channels = int(wanted.size()) == header.nchannels;
+	for(size_t i = 0; all_channels && i < source.size(); i++) {all_channels = source[i] == int(i); }
+	SetChannelMap(wanted);
+
+	const float* shared_direct = reinterpret_cast<const float*>(image + header.direct_offset);
+	if(!all_channels) {shared_direct = StoreColumns(shared_direct, 1, source, header.nchannels); }
+	for(int k = 0; k < header.nconfigs; k++)
+	{
+		StoreConfiguration config;
+		config.name = std::string(entries[k].name, strnlen(entries[k].name, sizeof(entries[k].name)));
+		config.direct = shared_direct;
+		if(entries[k].own_direct)
+		{
+			config.direct = reinterpret_cast<const float*>(image + entries[k].direct_offset);
+			if(!all_channels) {config.direct = StoreColumns(config.direct, 1, source, header.nchannels); }
+		}
+		config.nrefl = entries[k].nrefl;
+		config.refl = reinterpret_cast<const float*>(image + entries[k].refl_offset);
+		if(!all_channels && config.nrefl > 0) {config.refl = StoreColumns(config.refl, config.nrefl, source, header.nchannels); }
+		config.field[0] = 0;
+		config.field[1] = entries[k].refl_index;
+		config.field[2] = entries[k].reflT_index;
+		store_configs_.push_back(config);
+	}
+	if(!all_channels)
+	{
+		munmap(mapped_, mapped_size_);
+		mapped_ = 0;
+		mapped_size_ = 0;
+	}
+
+	cout << "Loaded photon library store: " << storefile << " (" << header.nconfigs << " configurations, " << nvoxels_ << " voxels, " << nchannels_ << " channels)" << endl;
+	SelectConfiguration(store_config_);
+	return true;
+}
+
+//Copy of the columns source of a plane with stride floats per channel
+const float* LibraryAccess::StoreColumns(const float* plane, int stride, const std::vector<int>& source, int file_nchannels)
+{
+	store_tables_.push_back(std::vector<float>(size_t(nvoxels_)*source.size()*stride));
+	std::vector<float>& table = store_tables_.back();
+	for(size_t v = 0; v < size_t(nvoxels_); v++)
+	{
+		for(size_t c = 0; c < source.size(); c++)
+		{
+			const float* from = plane + (v*file_nchannels + source[c])*stride;
+			std::copy(from, from + stride, &table[(v*source.size() + c)*stride]);
+		}
+	}
+	return table.data();
+}
+
+void LibraryAccess::SelectConfiguration(int config)
+{
+	store_config_ = config;
+	if(store_configs_.empty()) {return; }
+	if(config < 0 || config >= int(store_configs_.size()))
+	{
+		cout << "WARNING: the library store has no configuration " << config << ", using configuration 0" << endl;
+		config = 0;
+	}
+	const StoreConfiguration& selected = store_configs_[config];
+	store_direct_ = selected.direct;
+	store_refl_ = selected.refl;
+	store_nrefl_ = selected.nrefl;
+	store_field_[0] = 0;
+	store_field_[1] = (refl_offset_ >= 0) ? selected.field[1] : -1;
+	store_field_[2] = (reflT_offset_ >= 0) ? selected.field[2] : -1;
+	cout << "Photon library configuration " << config << ": " << selected.name << endl;
+}
+
+thread_local int LibraryAccess::local_node_ = -1;
+
+void LibraryAccess::SetMemoryPlacement(MemoryPlacement placement)
+{
+	placement_ = placement;
+}
+
+int LibraryAccess::CurrentNode()
+{
+	unsigned cpu = 0, node = 0;
+	if(syscall(SYS_getcpu, &cpu, &node, 0) != 0) {return 0; }
+	return node;
+}
+
+//Anonymous memory for the table, on the given node (-1 = any), interleaved
+//over all nodes or huge page backed. how says what was obtained; returns 0
+//if the NUMA policy could not be applied.
+void* LibraryAccess::AllocatePlaced(size_t bytes, int node, bool interleave, bool huge_pages, std::string& how)
+{
+	size_t length = (bytes + kHugePageSize - 1)/kHugePageSize*kHugePageSize;
+	void* p = MAP_FAILED;
+	how = "4 kB pages";
+	if(huge_pages)
+	{
+		p = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(p != MAP_FAILED) {how = "2 MB hugetlbfs pages"; }
+	}
+	if(p == MAP_FAILED)
+	{
+		p = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED) {return 0; }
+		if(huge_pages) {how = (madvise(p, length, MADV_HUGEPAGE) == 0) ? "transparent huge pages" : "4 kB pages (no huge page support)"; }
+	}
+
+	//The policy must be set before the pages are first touched
+	if(interleave || node >= 0)
+	{
+		unsigned long mask = 0;
+		if(node >= 0) {mask = 1UL << node; }
+		else
+		{
+			std::vector<int> nodes = OnlineNodes();
+			for(size_t i = 0; i < nodes.size(); i++) {mask |= 1UL << nodes[i]; }
+		}
+		if(syscall(SYS_mbind, p, length, interleave ? kMemoryPolicyInterleave : kMemoryPolicyBind, &mask, sizeof(mask)*8 + 1, 0) != 0)
+		{
+			how = strerror(errno);
+			munmap(p, length);
+			return 0;
+		}
+	}
+	placed_regions_.push_back(std::make_pair(p, length));
+	return p;
+}
+
+//Moves the loaded table into memory placed as asked by SetMemoryPlacement
+void LibraryAccess::PlaceTable()
+{
+	if(placement_ == kPlacementDefault) {return; }
+
+	const char* names[4] = {"default", "interleaved", "replicated", "huge pages"};
+	std::ostringstream report;
+	std::vector<int> nodes = OnlineNodes();
+	size_t bytes = size_t(nvoxels_)*nchannels_*nfields_*sizeof(float);
+	std::string how;
+
+	if(!data_ || encoding_ != kEncodingFloat32 || !sparse_offsets_.empty() || shared_header_)
+	{
+		report << "default (only a private, dense float table is placed)";
+	}
+	else if((placement_ == kPlacementInterleave || placement_ == kPlacementReplicate) && nodes.size() < 2)
+	{
+		report << "default (" << nodes.size() << " NUMA node" << ((nodes.size() == 1) ? "" : "s") << ", nothing to " << ((placement_ == kPlacementInterleave) ? "interleave" : "replicate") << ")";
+	}
+	else if(placement_ == kPlacementReplicate)
+	{
+		std::vector<const float*> replicas(nodes.back() + 1, 0);
+		bool ok = true;
+		for(size_t i = 0; ok && i < nodes.size(); i++)
+		{
+			float* copy = static_cast<float*>(AllocatePlaced(bytes, nodes[i], false, false, how));
+			ok = copy != 0;
+			if(ok) {memcpy(copy, data_, bytes); replicas[nodes[i]] = copy; }
+		}
+		if(ok)
+		{
+			//nodes without memory read the first copy
+			for(size_t n = 0; n < replicas.size(); n++) {if(!replicas[n]) {replicas[n] = replicas[nodes[0]]; } }
+			replicas_ = replicas;
+			report << "replicated on " << nodes.size() << " NUMA nodes";
+		}
+		else
+		{
+			for(size_t i = 0; i < placed_regions_.size(); i++) {munmap(placed_regions_[i].first, placed_regions_[i].second); }
+			placed_regions_.clear();
+			report << "default (could not bind memory to a node: " << how << ")";
+		}
+	}
+	else
+	{
+		bool interleave = placement_ == kPlacementInterleave;
+		float* copy = static_cast<float*>(AllocatePlaced(bytes, -1, interleave, placement_ == kPlacementHugePages, how));
+		if(copy)
+		{
+			memcpy(copy, data_, bytes);
+			replicas_.assign(1, copy);
+			if(interleave) {report << "interleaved over " << nodes.size() << " NUMA nodes"; }
+			else {report << how; }
+		}
+		else {report << "default (could not " << (interleave ? "interleave" : "allocate") << " the table: " << how << ")"; }
+	}
+
+	//The placed copies replace the original table
+	if(!replicas_.empty())
+	{
+		if(mapped_) {munmap(mapped_, mapped_size_); }
+		mapped_ = 0;
+		mapped_size_ = 0;
+		cache_header_ = 0;
+		std::vector<float>().swap(table_);
+		data_ = replicas_[std::min<size_t>(CurrentNode(), replicas_.size() - 1)];
+		//one copy (interleaved or huge pages) is read by every thread
+		if(placement_ != kPlacementReplicate) {data_ = replicas_[0]; replicas_.clear(); }
+	}
+
+	placement_report_ = report.str();
+	cout << "Photon library memory placement (" << names[placement_] << " asked for): " << placement_report_ << endl;
+}
+
+//Rejects anything that is not exactly what this build would have written
+bool LibraryAccess::CheckCacheHeader(const LibraryCacheHeader& header, size_t size, const std::string& name) const
 {
+	bool ok = memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) == 0;
+	if(ok && (header.version != kCacheVersion || header.header_size != sizeof(header)))
+	{
+		cout << "Library cache " << name << " has version " << header.version << ", expected " << kCacheVersion << endl;
+		ok = false;
+	}
+	if(ok && header.header_checksum != HeaderChecksum(header))
+	{
+		cout << "Library cache " << name << " has a corrupt header" << endl;
+		ok = false;
+	}
+	if(ok && (header.payload_offset + header.payload_bytes > uint64_t(size) ||
+	          header.channel_map_offset + header.nchannels*sizeof(int32_t) > header.payload_offset ||
+	          header.payload_bytes != uint64_t(header.nvoxels)*header.nchannels*header.nfields*sizeof(float)))
+	{
+		cout << "Library cache " << name << " is truncated" << endl;
+		ok = false;
+	}
+	if(ok && GridLevel(header.grid_steps) < 0)
+	{
+		cout << "Library cache " << name << " was built for a different voxel grid" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+//Checks a cache image (the contents of a .plib file, wherever it is mapped)
+//and points the library at it. On success the library owns the mapping.
+//A shared image must hold exactly the channels wanted (those of the active
+//ones its creator found), as a private copy of it would not be shared.
+bool LibraryAccess::AttachCacheImage(const char* image, size_t size, void* mapping, size_t mapping_size, bool reflected, bool reflT0, const std::string& name, bool shared)
+{
+	LibraryCacheHeader header;
+	memcpy(&header, image, sizeof(header));
+	if(!CheckCacheHeader(header, size, name)) {return false; }
+
+	ReleaseLibrary();
+	table_level_ = GridLevel(header.grid_steps);
+	level_grid_ = LevelGrid(table_level_);
+	mapped_ = mapping;
+	mapped_size_ = mapping_size;
+	cache_header_ = reinterpret_cast<const LibraryCacheHeader*>(image);
+	data_ = reinterpret_cast<const float*>(image + header.payload_offset);
+	nvoxels_ = header.nvoxels;
+	nfields_ = header.nfields;
+
+	const int32_t* cache_channels = reinterpret_cast<const int32_t*>(image + header.channel_map_offset);
+	SetChannelMap(std::vector<int>(cache_channels, cache_channels + header.nchannels));
+
+	//If only some of the cached channels are wanted, copy those columns out
+	//into a compact table rather than keeping the whole file resident
+	bool subset = !active_channels_.empty() && active_channels_ != channels_;
+	std::vector<int> wanted;
+	std::vector<int> source;
+	if(subset)
+	{
+		for(size_t i = 0; i < active_channels_.size(); i++)
+		{
+			int index = GetChannelIndex(active_channels_[i]);
+			if(index < 0) {cout << "WARNING: channel " << active_channels_[i] << " is not in the library cache" << endl; continue; }
+			wanted.push_back(active_channels_[i]);
+			source.push_back(index);
+		}
+	}
+	subset = subset && wanted != channels_;
+	if(subset && shared)
+	{
+		cout << "ERROR: shared memory segment " << name << " does not hold the channels of this configuration" << endl;
+		mapped_ = 0;
+		mapped_size_ = 0;
+		cache_header_ = 0;
+		data_ = 0;
+		return false;
+	}
+	if(subset)
+	{
+		int cache_nchannels = header.nchannels;
+		table_.resize(size_t(nvoxels_)*wanted.size()*nfields_);
+		for(size_t v = 0; v < size_t(nvoxels_); v++)
+		{
+			for(size_t c = 0; c < wanted.size(); c++)
+			{
+				const float* from = data_ + (v*cache_nchannels + source[c])*nfields_;
+				std::copy(from, from + nfields_, &table_[(v*wanted.size() + c)*nfields_]);
+			}
+		}
+		munmap(mapped_, mapped_size_);
+		mapped_ = 0;
+		mapped_size_ = 0;
+		cache_header_ = 0;
+		data_ = table_.data();
+		SetChannelMap(wanted);
+	}
+
+	refl_offset_ = reflected ? header.refl_offset : -1;
+	reflT_offset_ = reflT0 ? header.reflT_offset : -1;
+	if((reflected && header.refl_offset < 0) || (reflT0 && header.reflT_offset < 0))
+	{
+		cout << "WARNING: library cache " << name << " has no reflected light, it will read as zero" << endl;
+	}
+
+	cout << "Loaded photon library cache: " << name << " (" << nvoxels_ << " voxels, " << nchannels_ << " channels)" << endl;
+	return true;
+}
+
+//Everything of a cache image that comes before the payload: the header,
+//the channel map and padding up to the payload alignment
+std::vector<char> LibraryAccess::CacheImagePrefix() const
+{
+	LibraryCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+	header.version = kCacheVersion;
+	header.header_size = sizeof(header);
+	header.nvoxels = nvoxels_;
+	header.nchannels = nchannels_;
+	header.nfields = nfields_;
+	header.channel_map_offset = sizeof(header);
+	header.refl_offset = refl_offset_;
+	header.reflT_offset = reflT_offset_;
+	header.grid_steps[0] = level_grid_.nx();
+	header.grid_steps[1] = level_grid_.ny();
+	header.grid_steps[2] = level_grid_.nz();
+	for(int i = 0; i < 3; i++)
+	{
+		header.grid_lower[i] = gLowerCorner[i];
+		header.grid_upper[i] = gUpperCorner[i];
+	}
+	header.payload_offset = ((sizeof(header) + nchannels_*sizeof(int32_t))/kCachePayloadAlign + 1)*kCachePayloadAlign;
+	header.payload_bytes = uint64_t(nvoxels_)*nchannels_*nfields_*sizeof(float);
+	header.payload_checksum = CacheChecksum(data_, header.payload_bytes);
+	header.header_checksum = HeaderChecksum(header);
 
+	std::vector<char> prefix(header.payload_offset, 0);
+	std::vector<int32_t> channel_map(channels_.begin(), channels_.end());
+	memcpy(&prefix[0], &header, sizeof(header));
+	if(!channel_map.empty()) {memcpy(&prefix[header.channel_map_offset], &channel_map[0], channel_map.size()*sizeof(int32_t)); }
+	return prefix;
 }
 
+bool LibraryAccess::WriteLibraryCache(std::string cachefile)
+{
+	if(!data_) {return false; }
 
+	std::vector<char> prefix = CacheImagePrefix();
+	size_t payload_bytes = size_t(nvoxels_)*nchannels_*nfields_*sizeof(float);
 
-void LibraryAccess::LoadLibraryFromFile(std::string libraryfile, bool reflected, bool reflT0)
+	//Write next to the target and rename, so that jobs starting meanwhile never
+	//map a half written file
+	std::string tmpfile = cachefile + ".tmp";
+	ofstream out(tmpfile.c_str(), ios::binary | ios::trunc);
+	out.write(&prefix[0], prefix.size());
+	out.write(reinterpret_cast<const char*>(data_), payload_bytes);
+	out.close();
+	if(!out || rename(tmpfile.c_str(), cachefile.c_str()) != 0)
+	{
+		cout << "Error writing library cache: " << cachefile << endl;
+		remove(tmpfile.c_str());
+		return false;
+	}
+	return true;
+}
+
+//Checksums the whole payload, which touches every page of the library, so
+//this is only done by make_library_cache and not on every load
+bool LibraryAccess::VerifyLibraryCache()
 {
-	cout << "Reading photon library from input file: " << libraryfile.c_str()<<endl;
+	if(!cache_header_) {return false; }
+	return CacheChecksum(data_, cache_header_->payload_bytes) == cache_header_->payload_checksum;
+}
 
-	TFile *f = nullptr;
-	TTree *tt = nullptr;
+void LibraryAccess::SetSharedMemory(bool shared)
+{
+	shared_memory_ = shared;
+}
+
+//Segment name for this library/configuration: anything that changes the
+//table contents (the library file itself, the planes, the channels, the
+//image format) changes the name, so different setups never share a segment
+std::string LibraryAccess::SharedMemoryName(const std::string& libraryfile, bool reflected, bool reflT0) const
+{
+	std::ostringstream key;
+	struct stat st;
+	std::string source = EndsWith(libraryfile, ".plib") ? libraryfile : CacheFileName(libraryfile);
+	if(stat(source.c_str(), &st) != 0 && stat(libraryfile.c_str(), &st) != 0) {memset(&st, 0, sizeof(st)); }
+	key << libraryfile.substr(libraryfile.find_last_of('/') + 1) << "|" << st.st_size << "|" << st.st_mtime
+	    << "|" << reflected << reflT0 << "|" << kCacheVersion << "|";
+	for(size_t i = 0; i < active_channels_.size(); i++) {key << active_channels_[i] << ","; }
+
+	std::string k = key.str();
+	std::ostringstream name;
+	name << "/sbnd_plib_" << hex << CacheChecksum(k.data(), k.size());
+	return name.str();
+}
+
+//The first process to get here creates the segment and publishes the
+//library into it, the others wait for it to be ready and map it read only.
+//Each attached process holds one reference and the last one out removes it.
+bool LibraryAccess::LoadLibraryFromSharedMemory(std::string libraryfile, bool reflected, bool reflT0)
+{
+	std::string name = SharedMemoryName(libraryfile, reflected, reflT0);
 
-	try
+	for(int attempt = 0; attempt < 5; attempt++)
 	{
-		f  =  TFile::Open(libraryfile.c_str());
-		tt =  (TTree*)f->Get("PhotonLibraryData");
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+		if(fd >= 0) {return CreateSharedLibrary(fd, name, libraryfile, reflected, reflT0); }
+		if(errno != EEXIST)
+		{
+			cout << "Could not create shared memory segment " << name << ": " << strerror(errno) << endl;
+			return false;
+		}
 
-		if (!tt) {
+		fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd < 0) {continue; } // removed since, try creating it again
+		if(AttachSharedLibrary(fd, name, reflected, reflT0)) {return true; }
+	}
+	cout << "Giving up on shared memory segment " << name << endl;
+	return false;
+}
 
-			TKey *key = f->FindKeyAny("PhotonLibraryData");
-			if (key)
-				tt = (TTree*)key->ReadObj();
-			else {
-				cout << "PhotonLibraryData not found in file" <<libraryfile;
-			}
+bool LibraryAccess::CreateSharedLibrary(int fd, const std::string& name, const std::string& libraryfile, bool reflected, bool reflT0)
+{
+	SharedLibraryHeader* shared = 0;
+	if(ftruncate(fd, kSharedHeaderSize) == 0)
+	{
+		void* p = mmap(0, kSharedHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(p != MAP_FAILED) {shared = static_cast<SharedLibraryHeader*>(p); }
+	}
+	if(!shared)
+	{
+		close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	memcpy(shared->magic, kSharedMagic, sizeof(kSharedMagic));
+	shared->creator_pid = getpid();
+	shared->refcount.store(0);
+	shared->ready.store(0);
+
+	cout << "Publishing photon library in shared memory segment " << name << endl;
+	std::string cachefile = EndsWith(libraryfile, ".plib") ? libraryfile : CacheFileName(libraryfile);
+	if(!LoadLibraryFromCache(cachefile, reflected, reflT0)) {LoadLibraryFromRootFile(libraryfile, reflected, reflT0); }
+
+	void* image = MAP_FAILED;
+	size_t image_size = 0;
+	if(data_)
+	{
+		std::vector<char> prefix = CacheImagePrefix();
+		size_t payload_bytes = size_t(nvoxels_)*nchannels_*nfields_*sizeof(float);
+		image_size = prefix.size() + payload_bytes;
+		//posix_fallocate so that running out of /dev/shm is an error here
+		//rather than a SIGBUS when the pages are first written
+		if(posix_fallocate(fd, 0, kSharedHeaderSize + image_size) == 0)
+		{
+			image = mmap(0, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, kSharedHeaderSize);
+		}
+		if(image != MAP_FAILED)
+		{
+			memcpy(image, &prefix[0], prefix.size());
+			memcpy(static_cast<char*>(image) + prefix.size(), data_, payload_bytes);
+			mprotect(image, image_size, PROT_READ);
 		}
 	}
-	catch(...)
+	close(fd);
+
+	if(image == MAP_FAILED || !AttachCacheImage(static_cast<const char*>(image), image_size, image, image_size, reflected, reflT0, name, true))
+	{
+		cout << "Could not publish the photon library in shared memory" << (data_ ? ", keeping a private copy" : "") << endl;
+		if(image != MAP_FAILED) {munmap(image, image_size); }
+		shared->ready.store(-1);
+		munmap(shared, kSharedHeaderSize);
+		shm_unlink(name.c_str());
+		return data_ != 0;
+	}
+
+	shared->image_size = image_size;
+	shared->refcount.store(1);
+	RecordAttached(shared, getpid());
+	shared->ready.store(1);
+	shared_header_ = shared;
+	shared_name_ = name;
+	return true;
+}
+
+bool LibraryAccess::AttachSharedLibrary(int fd, const std::string& name, bool reflected, bool reflT0)
+{
+	//Wait for the creator to have at least set up the header
+	struct stat st;
+	for(int i = 0; i < 100 && (fstat(fd, &st) != 0 || size_t(st.st_size) < kSharedHeaderSize); i++) {usleep(10000); }
+	void* p = (size_t(st.st_size) >= kSharedHeaderSize) ?
+	          mmap(0, kSharedHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if(p == MAP_FAILED || memcmp(static_cast<SharedLibraryHeader*>(p)->magic, kSharedMagic, sizeof(kSharedMagic)) != 0)
+	{
+		if(p != MAP_FAILED) {munmap(p, kSharedHeaderSize); }
+		close(fd);
+		usleep(100000);
+		return false;
+	}
+	SharedLibraryHeader* shared = static_cast<SharedLibraryHeader*>(p);
+
+	//The creator may still be reading the library; if it died doing so the
+	//segment will never become ready, so remove it and let the caller retry
+	bool announced = false;
+	while(shared->ready.load() == 0)
 	{
-		cout << "Error in ttree load, reading photon library: " << libraryfile.c_str()<<endl;
+		if(kill(shared->creator_pid, 0) != 0 && errno == ESRCH)
+		{
+			cout << "Removing stale shared memory segment " << name << endl;
+			shm_unlink(name.c_str());
+			munmap(shared, kSharedHeaderSize);
+			close(fd);
+			return false;
+		}
+		if(!announced) {cout << "Waiting for process " << shared->creator_pid << " to publish the photon library..." << endl; announced = true; }
+		usleep(100000);
 	}
 
-	int voxel;
-	int opChannel;
-	float visibility;
-	float reflVisibility;
-	float reflT;
-	int maxvoxel = tt->GetMaximum("Voxel")+1;
-	int maxopChannel = tt->GetMaximum("OpChannel")+2;
+	if(shared->ready.load() != 1)
+	{
+		munmap(shared, kSharedHeaderSize);
+		close(fd);
+		return false;
+	}
+	//A count of zero means the last user is removing the segment
+	if(shared->refcount.fetch_add(1) <= 0)
+	{
+		shared->refcount.fetch_sub(1);
+		munmap(shared, kSharedHeaderSize);
+		close(fd);
+		return false;
+	}
+	RecordAttached(shared, getpid());
+	ReleaseDeadAttached(shared);
 
-	cout << "Photon lookup table size : " <<  maxvoxel << " voxels,  " << maxopChannel <<" channels " << endl;
+	size_t image_size = shared->image_size;
+	void* image = mmap(0, image_size, PROT_READ, MAP_SHARED, fd, kSharedHeaderSize);
+	close(fd);
+	if(image == MAP_FAILED || !AttachCacheImage(static_cast<const char*>(image), image_size, image, image_size, reflected, reflT0, name, true))
+	{
+		if(image != MAP_FAILED) {munmap(image, image_size); }
+		ForgetAttached(shared, getpid());
+		if(shared->refcount.fetch_sub(1) == 1) {shm_unlink(name.c_str()); }
+		munmap(shared, kSharedHeaderSize);
+		return false;
+	}
 
-	table_.resize(maxvoxel, std::vector<float>(maxopChannel, 0));
-	reflected_table_.resize(maxvoxel, std::vector<float>(maxopChannel, 0));
-	reflT_table_.resize(maxvoxel, std::vector<float>(maxopChannel, 0));
+	shared_header_ = shared;
+	shared_name_ = name;
+	cout << "Attached to shared photon library " << name << " (" << shared->refcount.load() << " processes)" << endl;
+	return true;
+}
 
+void LibraryAccess::SetEncoding(LibraryEncoding encoding)
+{
+	encoding_ = encoding;
+}
 
-	tt->SetBranchAddress("Voxel",      &voxel);
-	tt->SetBranchAddress("OpChannel",  &opChannel);
-	tt->SetBranchAddress("Visibility", &visibility);
-	if(reflected) {tt->SetBranchAddress("ReflVisibility", &reflVisibility); }
-	if(reflT0) {tt->SetBranchAddress("ReflTfirst", &reflT); }
+//Replaces the float table by its 16 bit encoding, measuring the error made
+void LibraryAccess::EncodeTable()
+{
+	size_t n = size_t(nvoxels_)*nchannels_*nfields_;
+	LibraryEncoding encoding = encoding_;
+	encoding_ = kEncodingFloat32; // so that Value() reads the float table until we are done
 
-	size_t nentries = tt->GetEntries();
+	//Per plane range of the non-zero entries
+	float vmin[3], vmax[3];
+	for(int f = 0; f < nfields_; f++) {vmin[f] = 3.4e38f; vmax[f] = 0; }
+	for(size_t k = 0; k < n; k++)
+	{
+		int f = k % nfields_;
+		float v = data_[k];
+		if(v > 0) {vmin[f] = std::min(vmin[f], v); vmax[f] = std::max(vmax[f], v); }
+	}
 
-	for(size_t i=0; i!=nentries; ++i)
+	//Value of every code; encoding is then a search in this table, so that
+	//the encoder always picks the nearest representable value
+	for(int f = 0; f < nfields_; f++)
 	{
-		tt->GetEntry(i);
-		if((voxel<0)||(voxel>= maxvoxel)||(opChannel<0)||(opChannel>= maxopChannel))
-		{}
+		decode_[f].assign(65536, 0);
+		if(vmax[f] <= 0) {continue; }
+		if(encoding == kEncodingHalf)
+		{
+			int exponent;
+			frexp(65504./vmax[f], &exponent);
+			float scale = ldexp(1., exponent - 1);
+			for(int code = 0; code < 0x7c00; code++) {decode_[f][code] = HalfToFloat(code)/scale; }
+			for(int code = 0x7c00; code < 65536; code++) {decode_[f][code] = 0; } // inf/nan/negative are never produced
+		}
 		else
 		{
-			table_.at(voxel).at(opChannel) = visibility;
-			if(reflected) {reflected_table_.at(voxel).at(opChannel) = reflVisibility; }
-			else{reflected_table_.at(voxel).at(opChannel) = 0; }
-			if(reflT0) {reflT_table_.at(voxel).at(opChannel) = reflT; }
-			else{reflT_table_.at(voxel).at(opChannel) = 0; }
+			double lmin = log(vmin[f]), lmax = log(vmax[f]);
+			double step = (lmax > lmin) ? (lmax - lmin)/65534. : 0;
+			for(int code = 1; code < 65536; code++) {decode_[f][code] = exp(lmin + (code - 1)*step); }
+		}
+	}
+
+	encoded_.resize(n);
+	for(int f = 0; f < 3; f++) {max_rel_error_[f] = 0; mean_rel_error_[f] = 0; }
+	size_t nonzero[3] = {0, 0, 0};
+	for(int f = 0; f < 2; f++)
+	{
+		vis_sum_[f].assign(nchannels_, 0);
+		encoded_vis_sum_[f].assign(nchannels_, 0);
+	}
+
+	for(size_t k = 0; k < n; k++)
+	{
+		int f = k % nfields_;
+		float v = data_[k];
+		uint16_t code = 0;
+		if(v > 0)
+		{
+			//decode_[f] is increasing over the codes used, so bracket v in it
+			const std::vector<float>& values = decode_[f];
+			size_t last = (encoding == kEncodingHalf) ? 0x7c00 : 65536;
+			size_t hi = std::lower_bound(values.begin() + 1, values.begin() + last, v) - values.begin();
+			if(hi >= last) {hi = last - 1; }
+			code = (v - values[hi-1] < values[hi] - v) ? hi - 1 : hi;
+		}
+		encoded_[k] = code;
+
+		float decoded = decode_[f][code];
+		if(v > 0)
+		{
+			double rel = fabs(decoded - v)/v;
+			max_rel_error_[f] = std::max(max_rel_error_[f], rel);
+			mean_rel_error_[f] += rel;
+			nonzero[f]++;
+		}
+		int index = (k / nfields_) % nchannels_;
+		if(f == 0) {vis_sum_[0][index] += v; encoded_vis_sum_[0][index] += decoded; }
+		if(f > 0 && f == refl_offset_) {vis_sum_[1][index] += v; encoded_vis_sum_[1][index] += decoded; }
+	}
+	for(int f = 0; f < nfields_; f++)
+	{
+		if(nonzero[f]) {mean_rel_error_[f] /= nonzero[f]; }
+	}
+
+	//The float table is no longer needed
+	if(mapped_) {munmap(mapped_, mapped_size_); }
+	mapped_ = 0;
+	mapped_size_ = 0;
+	std::vector<float>().swap(table_);
+	data_ = 0;
+	encoding_ = encoding;
+
+	cout << "Photon library encoded with 16 bits per entry (" << n*sizeof(uint16_t)/(1024*1024) << " MB)" << endl;
+}
+
+void LibraryAccess::PrintEncodingReport(double photons_created, double quantum_efficiency) const
+{
+	if(encoding_ == kEncodingFloat32) {return; }
+
+	const char* names[3] = {"Visibility", "ReflVisibility", "ReflTfirst"};
+	int plane_offset[3] = {0, refl_offset_, reflT_offset_};
+	cout << "Library encoding report (" << (encoding_ == kEncodingHalf ? "scaled fp16" : "log16") << "):" << endl;
+	for(int p = 0; p < 3; p++)
+	{
+		if(plane_offset[p] < 0) {continue; }
+		cout << "  " << names[p] << ": max relative error " << max_rel_error_[plane_offset[p]]
+		     << ", mean relative error " << mean_rel_error_[plane_offset[p]] << endl;
+	}
+
+	//Mean expected photoelectrons over all voxels, exact vs encoded
+	double norm = photons_created*quantum_efficiency/nvoxels_;
+	cout << "  Expected PE per PMT for " << photons_created << " photons (VUV exact/encoded, visible exact/encoded):" << endl;
+	for(int index = 0; index < nchannels_; index++)
+	{
+		cout << "  PMT " << channels_[index] << ": "
+		     << vis_sum_[0][index]*norm << " / " << encoded_vis_sum_[0][index]*norm;
+		if(refl_offset_ > 0) {cout << ", " << vis_sum_[1][index]*norm << " / " << encoded_vis_sum_[1][index]*norm; }
+		cout << endl;
+	}
+}
+
+void LibraryAccess::SetSparseThreshold(float threshold)
+{
+	sparse_threshold_ = threshold;
+}
+
+//Replaces the dense table by per voxel lists of the channels above threshold
+void LibraryAccess::BuildSparseTable()
+{
+	std::vector<uint32_t> offsets(nvoxels_ + 1, 0);
+	double kept_vis = 0, total_vis = 0;
+	for(int pass = 0; pass < 2; pass++)
+	{
+		if(pass == 1) {sparse_entries_.resize(offsets[nvoxels_]); }
+		size_t n = 0;
+		for(int v = 0; v < nvoxels_; v++)
+		{
+			offsets[v] = n;
+			for(int index = 0; index < nchannels_; index++)
+			{
+				const float* entry = data_ + Index(v, index);
+				float refl = (refl_offset_ > 0) ? entry[refl_offset_] : 0;
+				if(pass == 0) {total_vis += entry[0] + refl; }
+				if(!(entry[0] > sparse_threshold_ || refl > sparse_threshold_)) {continue; }
+				if(pass == 1)
+				{
+					SparseLibraryEntry& e = sparse_entries_[n];
+					e.channel = channels_[index];
+					e.vis = entry[0];
+					e.refl_vis = refl;
+					e.refl_t0 = (reflT_offset_ > 0) ? entry[reflT_offset_] : 0;
+				}
+				else {kept_vis += entry[0] + refl; }
+				n++;
+			}
+		}
+		offsets[nvoxels_] = n;
+	}
+
+	size_t dense_entries = size_t(nvoxels_)*nchannels_;
+	cout << "Sparse photon library: kept " << sparse_entries_.size() << " of " << dense_entries << " voxel/channel entries ("
+	     << ((dense_entries > 0) ? 100.*sparse_entries_.size()/dense_entries : 0) << "%), "
+	     << ((total_vis > 0) ? 100.*(1 - kept_vis/total_vis) : 0) << "% of the visibility dropped" << endl;
+
+	//The dense table is no longer needed
+	if(mapped_) {munmap(mapped_, mapped_size_); }
+	mapped_ = 0;
+	mapped_size_ = 0;
+	cache_header_ = 0;
+	std::vector<float>().swap(table_);
+	data_ = 0;
+	sparse_offsets_.swap(offsets);
+}
+
+void LibraryAccess::SetMirrorSymmetryY(SymmetryMode mode, const std::vector<int>& channel_mirror, double tolerance)
+{
+	symmetry_y_ = mode;
+	mirror_y_ = channel_mirror;
+	symmetry_tolerance_ = tolerance;
+}
+
+void LibraryAccess::SetMirrorTPC(const std::vector<int>& channel_mirror)
+{
+	mirror_x_ = channel_mirror;
+}
+
+//Returns, for each channel of the layout, the channel at its reflection in
+//the given axis (-1 if there is none within 1 cm).
+std::vector<int> LibraryAccess::FindMirrorChannels(const PMTLayout& pmts, int axis)
+{
+	std::vector<int> mirror(pmts.index.size(), -1);
+	for(size_t i = 0; i < pmts.size(); i++)
+	{
+		float image[3] = {pmts.x[i], pmts.y[i], pmts.z[i]};
+		image[axis] = -image[axis];
+		for(size_t j = 0; j < pmts.size(); j++)
+		{
+			if(fabs(pmts.x[j] - image[0]) < 1 && fabs(pmts.y[j] - image[1]) < 1 && fabs(pmts.z[j] - image[2]) < 1)
+			{
+				mirror[pmts.channel[i]] = pmts.channel[j];
+				break;
+			}
+		}
+	}
+	return mirror;
+}
+
+//Compares every y > 0 entry of the loaded table with its mirror image. Only
+//entries above 1e-3 of the largest value of their plane are compared, below
+//that the library statistics dominate.
+bool LibraryAccess::CheckMirrorSymmetryY(double tolerance) const
+{
+	if(nvoxels_ != gxSteps*gySteps*gzSteps || gySteps % 2 != 0 || !data_) {return false; }
+
+	float floor[3] = {0, 0, 0};
+	size_t n = size_t(nvoxels_)*nchannels_*nfields_;
+	for(size_t k = 0; k < n; k++) {floor[k % nfields_] = std::max(floor[k % nfields_], data_[k]); }
+	for(int f = 0; f < nfields_; f++) {floor[f] *= 1e-3; }
+
+	double max_deviation = 0;
+	for(int v = 0; v < nvoxels_; v++)
+	{
+		int iy = (v / gxSteps) % gySteps;
+		if(iy < gySteps/2) {continue; }
+		int image = v + (gySteps - 1 - 2*iy)*gxSteps;
+		for(int index = 0; index < nchannels_; index++)
+		{
+			int partner = GetChannelIndex(Mirror(mirror_y_, channels_[index]));
+			if(partner < 0)
+			{
+				cout << "Channel " << channels_[index] << " has no mirror image in the library, not folding it" << endl;
+				return false;
+			}
+			const float* a = data_ + Index(v, index);
+			const float* b = data_ + Index(image, partner);
+			for(int f = 0; f < nfields_; f++)
+			{
+				float scale = std::max(a[f], b[f]);
+				if(scale > floor[f]) {max_deviation = std::max(max_deviation, double(fabs(a[f] - b[f])/scale)); }
+			}
+		}
+	}
+
+	cout << "Largest deviation from y -> -y symmetry: " << max_deviation*100 << "%" << endl;
+	return max_deviation <= tolerance;
+}
+
+//Keeps only the y < 0 half of the voxels
+void LibraryAccess::FoldTableY()
+{
+	if(nvoxels_ != gxSteps*gySteps*gzSteps || gySteps % 2 != 0 || !data_)
+	{
+		cout << "The library does not cover the whole voxel grid, not folding it" << endl;
+		return;
+	}
+
+	int half = gySteps/2;
+	int nfolded = nvoxels_/2;
+	std::vector<float> folded(size_t(nfolded)*nchannels_*nfields_);
+	size_t row = size_t(nchannels_)*nfields_;
+	for(int v = 0; v < nfolded; v++)
+	{
+		int ix = v % gxSteps;
+		int iy = (v / gxSteps) % half;
+		int iz = v / (gxSteps*half);
+		int source = ix + iy*gxSteps + iz*gxSteps*gySteps;
+		std::copy(data_ + source*row, data_ + (source + 1)*row, &folded[v*row]);
+	}
+
+	ReplaceTable(folded, nfolded);
+	fold_y_ = true;
+	cout << "Photon library folded about y = 0: " << nvoxels_ << " voxels stored" << endl;
+}
+
+void LibraryAccess::SetResolutionLevel(int level)
+{
+	resolution_level_ = std::max(0, level);
+}
+
+VoxelGrid<> LibraryAccess::LevelGrid(int level) const
+{
+	int factor = 1 << level;
+	int steps[3] = {(gxSteps + factor - 1)/factor, (gySteps + factor - 1)/factor, (gzSteps + factor - 1)/factor};
+	return VoxelGrid<>(steps, gLowerCorner, gUpperCorner);
+}
+
+//The resolution level a table on this grid is at, if it is one we accept
+//(the full grid or the level asked for), -1 otherwise
+int LibraryAccess::GridLevel(const int32_t steps[3]) const
+{
+	int levels[2] = {0, resolution_level_};
+	for(int i = 0; i < 2; i++)
+	{
+		VoxelGrid<> grid = LevelGrid(levels[i]);
+		if(steps[0] == grid.nx() && steps[1] == grid.ny() && steps[2] == grid.nz()) {return levels[i]; }
+	}
+	return -1;
+}
+
+//Makes table the library's table (of nvoxels voxels), in place of whatever it pointed at
+void LibraryAccess::ReplaceTable(std::vector<float>& table, int nvoxels)
+{
+	if(mapped_) {munmap(mapped_, mapped_size_); }
+	mapped_ = 0;
+	mapped_size_ = 0;
+	cache_header_ = 0;
+	table_.swap(table);
+	data_ = table_.data();
+	nvoxels_ = nvoxels;
+}
+
+//Averages the full resolution table down to the given level
+void LibraryAccess::DownsampleTable(int level)
+{
+	if(!data_ || table_level_ != 0 || nvoxels_ != grid_.NumberOfVoxels() || fold_y_)
+	{
+		cout << "Only a full resolution library can be downsampled" << endl;
+		return;
+	}
+	if(level == 0) {return; }
+
+	VoxelGrid<> coarse = LevelGrid(level);
+	int factor = 1 << level;
+	size_t row = size_t(nchannels_)*nfields_;
+	std::vector<float> table(coarse.NumberOfVoxels()*row);
+	std::vector<double> sum(row), weighted_t(nchannels_), weight(nchannels_);
+	for(int id = 0; id < coarse.NumberOfVoxels(); id++)
+	{
+		int cx, cy, cz;
+		coarse.Coords(id, cx, cy, cz);
+		std::fill(sum.begin(), sum.end(), 0.);
+		std::fill(weighted_t.begin(), weighted_t.end(), 0.);
+		std::fill(weight.begin(), weight.end(), 0.);
+		int n = 0;
+		for(int iz = cz*factor; iz < std::min(gzSteps, (cz + 1)*factor); iz++)
+		{
+			for(int iy = cy*factor; iy < std::min(gySteps, (cy + 1)*factor); iy++)
+			{
+				for(int ix = cx*factor; ix < std::min(gxSteps, (cx + 1)*factor); ix++)
+				{
+					const float* from = data_ + grid_.ID(ix, iy, iz)*row;
+					for(size_t k = 0; k < row; k++) {sum[k] += from[k]; }
+					if(refl_offset_ >= 0 && reflT_offset_ >= 0)
+					{
+						for(int c = 0; c < nchannels_; c++)
+						{
+							const float* entry = from + c*nfields_;
+							weighted_t[c] += entry[reflT_offset_]*entry[refl_offset_];
+							weight[c] += entry[refl_offset_];
+						}
+					}
+					n++;
+				}
+			}
+		}
+
+		float* to = &table[id*row];
+		for(size_t k = 0; k < row; k++) {to[k] = sum[k]/n; }
+		//reflT0 is averaged over the reflected light, when there is some
+		for(int c = 0; c < nchannels_ && reflT_offset_ >= 0; c++)
+		{
+			if(weight[c] > 0) {to[c*nfields_ + reflT_offset_] = weighted_t[c]/weight[c]; }
 		}
 	}
 
-	try
+	ReplaceTable(table, coarse.NumberOfVoxels());
+	table_level_ = level;
+	level_grid_ = coarse;
+	cout << "Photon library at resolution level " << level << ": " << coarse.nx() << "x" << coarse.ny() << "x" << coarse.nz()
+	     << " voxels, " << table_.size()*sizeof(float)/1048576. << " MB" << endl;
+}
+
+float LibraryAccess::SparseValue(size_t voxel, int no_pmt, int offset) const
+{
+	int nentries;
+	const SparseLibraryEntry* row = GetSparseRow(voxel, nentries);
+	for(int i = 0; i < nentries; i++)
+	{
+		if(row[i].channel != no_pmt) {continue; }
+		if(offset == 0) {return row[i].vis; }
+		return (offset == refl_offset_) ? row[i].refl_vis : row[i].refl_t0;
+	}
+	return 0;
+}
+
+const SparseLibraryEntry* LibraryAccess::GetSparseRow(int voxel, int& nentries) const
+{
+	nentries = sparse_offsets_[voxel + 1] - sparse_offsets_[voxel];
+	return nentries ? &sparse_entries_[sparse_offsets_[voxel]] : 0;
+}
+
+//Physical channels worth simulating for an event in voxel: all loaded
+//channels for a dense library, those above threshold for a sparse one
+//(through the mirror symmetries if voxel is not stored itself; for the other
+//TPC these are the mirror images of the active channels)
+void LibraryAccess::GetVisibleChannels(int voxel, std::vector<int>& pmts) const
+{
+	//The stored row may be the mirror image of voxel, in which case so are its channels
+	bool image_x = !mirror_x_.empty() && voxel >= GetNumberOfGridVoxels();
+	bool image_y = fold_y_ && ((voxel % GetNumberOfGridVoxels()) / gxSteps) % gySteps >= gySteps/2;
+	const SparseLibraryEntry* row = 0;
+	int nentries = nchannels_;
+	if(!sparse_offsets_.empty())
 	{
-		f->Close();
+		size_t stored = voxel;
+		int probe = 0;
+		MapSymmetry(stored, probe);
+		row = GetSparseRow(stored, nentries);
 	}
-	catch(...)
+
+	pmts.clear();
+	for(int i = 0; i < nentries; i++)
 	{
-		cout << "Error in closing file : " << libraryfile.c_str()<<endl;
+		int channel = row ? row[i].channel : channels_[i];
+		if(image_y) {channel = Mirror(mirror_y_, channel); }
+		//mirror partners loaded only for the fold are not reported
+		if(!requested_.empty() && (channel < 0 || channel >= int(requested_.size()) || !requested_[channel])) {continue; }
+		if(image_x) {channel = Mirror(mirror_x_, channel); }
+		pmts.push_back(channel);
 	}
 }
 
-const float* LibraryAccess::GetReflT0(size_t voxel, int no_pmt)
+float LibraryAccess::GetReflT0(size_t voxel, int no_pmt)
 {
-	return &reflT_table_.at(voxel).at(no_pmt);
+	return Value(voxel, no_pmt, reflT_offset_);
 }
 
-const float* LibraryAccess::GetReflCounts(size_t voxel, int no_pmt, bool reflected)
+float LibraryAccess::GetReflCounts(size_t voxel, int no_pmt, bool reflected)
 {
-	if(reflected) {return &reflected_table_.at(voxel).at(no_pmt); }
-	else{return 0; }
+	if(!reflected) {return 0; }
+	return Value(voxel, no_pmt, refl_offset_);
 }
 
-const float* LibraryAccess::GetCounts(size_t voxel, int no_pmt)
+float LibraryAccess::GetCounts(size_t voxel, int no_pmt)
 {
-	return &table_.at(voxel).at(no_pmt);
+	return Value(voxel, no_pmt, 0);
 }
 
-const float* LibraryAccess::GetLibraryEntries(int voxID, bool reflected, int no_pmt)
+float LibraryAccess::GetLibraryEntries(int voxID, bool reflected, int no_pmt)
 {
 	if(!reflected)
 		return GetCounts(voxID, no_pmt);
@@ -123,53 +2674,66 @@ const float* LibraryAccess::GetLibraryEntries(int voxID, bool reflected, int no_
 
 vector<int> LibraryAccess::GetVoxelCoords(int id, double position[3])
 {
-	vector<int> returnvector;
-	returnvector.resize(3);
-	returnvector.at(0) =  id % gxSteps;
-	returnvector.at(1) =  ((id - returnvector.at(0) ) / gxSteps) % gySteps;
-	returnvector.at(2) =  ((id - returnvector.at(0) - (returnvector.at(1) * gxSteps)) / (gySteps * gxSteps)) % gzSteps;
-
-	position[0] = gLowerCorner[0] + (returnvector.at(0) + 0.5)*(gUpperCorner[0] - gLowerCorner[0])/gxSteps;
-	position[1] = gLowerCorner[1] + (returnvector.at(1) + 0.5)*(gUpperCorner[1] - gLowerCorner[1])/gySteps;
-	position[2] = gLowerCorner[2] + (returnvector.at(2) + 0.5)*(gUpperCorner[2] - gLowerCorner[2])/gzSteps;
+	GetVoxelPosition(id, position);
 
+	vector<int> returnvector(3);
+	level_grid_.Coords(id % GetNumberOfGridVoxels(), returnvector[0], returnvector[1], returnvector[2]);
 	return returnvector;
 
 }
 
+void LibraryAccess::GetVoxelPosition(int id, double position[3]) const
+{
+	//IDs past the grid are in the other TPC, the mirror image in x
+	bool other_tpc = !mirror_x_.empty() && id >= GetNumberOfGridVoxels();
+	if(other_tpc) {id -= GetNumberOfGridVoxels(); }
+	if(table_level_ > 0) {level_grid_.Position(id, position); }
+	else {grid_.Position(id, position); }
+	if(other_tpc) {position[0] = -position[0]; }
+}
+
+void LibraryAccess::GetVoxelPositions(const int* ids, size_t n, double* x, double* y, double* z) const
+{
+	if(table_level_ > 0) {level_grid_.Positions(ids, n, x, y, z); }
+	else {grid_.Positions(ids, n, x, y, z); }
+	if(mirror_x_.empty()) {return; }
+	int nvoxels = GetNumberOfGridVoxels();
+	for(size_t i = 0; i < n; i++)
+	{
+		if(ids[i] < nvoxels) {continue; }
+		double position[3];
+		GetVoxelPosition(ids[i], position);
+		x[i] = position[0];
+		y[i] = position[1];
+		z[i] = position[2];
+	}
+}
+
 // GetVoxelID
 int LibraryAccess::GetVoxelID(double* Position) //const
 {
-  // figure out how many steps this point is in the x,y,z directions                                                                                                              
-  int xStep = int ((Position[0]-gLowerCorner[0]) / (gUpperCorner[0]-gLowerCorner[0]) * gxSteps );
-  int yStep = int ((Position[1]-gLowerCorner[1]) / (gUpperCorner[1]-gLowerCorner[1]) * gySteps );
-  int zStep = int ((Position[2]-gLowerCorner[2]) / (gUpperCorner[2]-gLowerCorner[2]) * gzSteps );
- 
-  int ID;
- 
-  // check if point lies within the voxelized region                                                                                                                              
-  if((0 <= xStep) && (xStep < gxSteps) &&
-     (0 <= yStep) && (yStep < gySteps) &&
-     (0 <= zStep) && (zStep < gzSteps) )
-    {
-      // if within bounds, generate the voxel ID                                                                                                                                  
-      ID = xStep
-    + yStep * (gxSteps)
-    + zStep * (gxSteps * gySteps);
-    }
-  else
+  // with the TPC mirror set, x < 0 is the other TPC: IDs offset by the grid size
+  if(!mirror_x_.empty() && Position[0] < 0)
     {
-      // if out of bounds, print warning and return -1                                                                                                                            
-      ID = -1;
+      double image[3] = {-Position[0], Position[1], Position[2]};
+      int ID = GetVoxelID(image);
+      return (ID < 0) ? -1 : ID + GetNumberOfGridVoxels();
     }
- 
-  return ID;
- 
+
+  // -1 if the point is outside the voxelized region
+  return (table_level_ > 0) ? level_grid_.FindID(Position) : grid_.FindID(Position);
 }
 
 //This function takes is most of the information needed to calculate the number
 //of photoelectrons on a given PMT
-std::vector<double> LibraryAccess::PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel)
+PMTHits LibraryAccess::PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel)
+{
+	double position[3];
+	GetVoxelPosition(_rand_voxel, position);
+	return PhotonLibraryAnalyzer(_energy, _scint_yield, _quantum_efficiency, _pmt_number, _rand_voxel, position);
+}
+
+PMTHits LibraryAccess::PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel, const double position[3])
 {
 	//The number of photons created is determined by this formula:
 	//Nphotons_created = Poisson < Scintillation Yield (24000/MeV) * dE/dX (MeV)>
@@ -178,58 +2742,165 @@ std::vector<double> LibraryAccess::PhotonLibraryAnalyzer(double _energy, const i
 	const double quantum_efficiency = _quantum_efficiency;
 	double energy = _energy;
   int i = _rand_voxel;
-  vector<double> pmt_hits;
-
-	int pre_Nphotons_created = scint_yield * energy;
 
-  //Applying quantum efficiency right after calculation reduces total number
-  //of photons working with initially
-	int Nphotons_created = utility::poisson(pre_Nphotons_created, gRandom->Uniform(1.), energy);
-
-  //Find position of event
-	double position[3];
-	vector<int> Coords = GetVoxelCoords(i, position);
+	//Poisson about the yield, from the caller's generator
+	int Nphotons_created = gRandom->Poisson(scint_yield * energy);
 
   //Look up visibility parameter/timing by comparing the optical channel (PMT Number)
   //and the detector location (voxel, i)
-	const float* Visibilities = GetLibraryEntries(i, false, _pmt_number);
-	const float* ReflVisibilities = GetLibraryEntries(i, true, _pmt_number);
-	const float* reflected_T0 = GetReflT0(i, _pmt_number);
+	const float vis = GetLibraryEntries(i, false, _pmt_number);
+	const float reflvis = GetLibraryEntries(i, true, _pmt_number);
+	const float reflected_T0 = GetReflT0(i, _pmt_number);
 
-	const float vis = *Visibilities;
-	const float reflvis = *ReflVisibilities;
+  //Each created photon reaches the PMT directly with probability vis, after
+  //reflection with probability reflvis, or not at all, and is then detected
+  //with the quantum efficiency: a multinomial split of the photons into
+  //(VUV pe, visible pe, undetected), drawn as two binomials rather than one
+  //random number per photon
+	double p_vuv = vis * quantum_efficiency;
+	double p_vis = reflvis * quantum_efficiency;
 
-	//int ichan = _pmt_number;
+	PMTHits pmt_hits;
+	pmt_hits.vuv = utility::binomial(Nphotons_created, p_vuv, gRandom);
+	pmt_hits.visible = (p_vuv < 1) ? utility::binomial(Nphotons_created - pmt_hits.vuv, std::min(1., p_vis / (1 - p_vuv)), gRandom) : 0;
+	pmt_hits.position[0] = position[0];
+	pmt_hits.position[1] = position[1];
+	pmt_hits.position[2] = position[2];
+	pmt_hits.reflT0 = reflected_T0;
 
-  //Number of photoelectrons for a given PMT
-	double hits_vuv = Nphotons_created * vis;
-	double hits_vis = Nphotons_created * reflvis;
-	double reflT0 = *reflected_T0;
+	return pmt_hits;
+}
+
+//Copies the planes of a stored voxel's row (after MapSymmetry) to vis, refl
+//and reflT, one entry per table column; planes not loaded read zero
+void LibraryAccess::ReadRow(size_t voxel, float* vis, float* refl, float* reflT) const
+{
+	const int offsets[3] = {0, refl_offset_, reflT_offset_};
+	float* planes[3] = {vis, refl, reflT};
+	bool computed = tile_fd_ >= 0 || lowrank_rank_ > 0 || analytic_;
+	const float* row = 0;
+	if(computed) {row = (tile_fd_ >= 0) ? TileRow(voxel) : ComputedRow(voxel); }
+	else if(!store_direct_ && encoding_ == kEncodingFloat32) {row = (replicas_.empty() ? data_ : LocalReplica()) + Index(voxel, 0); }
+
+	for(int f = 0; f < 3; f++)
+	{
+		int offset = offsets[f];
+		float* to = planes[f];
+		if(offset < 0 || (computed && !row) || (store_direct_ && offset > 0 && store_field_[offset] < 0))
+		{
+			std::fill(to, to + nchannels_, zero_);
+			continue;
+		}
+		if(store_direct_)
+		{
+			size_t k = voxel*nchannels_;
+			if(offset == 0) {std::copy(store_direct_ + k, store_direct_ + k + nchannels_, to); }
+			else
+			{
+				for(int c = 0; c < nchannels_; c++) {to[c] = store_refl_[(k + c)*store_nrefl_ + store_field_[offset]]; }
+			}
+		}
+		else if(row)
+		{
+			for(int c = 0; c < nchannels_; c++) {to[c] = row[c*nfields_ + offset]; }
+		}
+		else
+		{
+			for(int c = 0; c < nchannels_; c++) {to[c] = decode_[offset][encoded_[Index(voxel, c) + offset]]; }
+		}
+	}
+}
+
+namespace {
+
+//row[c] *= scale for the n channels of a row, four at a time
+void ScaleRow(float* row, int n, float scale)
+{
+	int c = 0;
+#ifdef __SSE2__
+	const __m128 s = _mm_set1_ps(scale);
+	for(; c + 4 <= n; c += 4) {_mm_storeu_ps(row + c, _mm_mul_ps(_mm_loadu_ps(row + c), s)); }
+#endif
+	for(; c < n; c++) {row[c] *= scale; }
+}
+
+}
 
-	/// Cast the hits into int type
-	int int_hits_vuv = hits_vuv;
-	int int_hits_vis = hits_vis;
+void LibraryAccess::CountEventHits(int voxel, double energy, int scint_yield, double quantum_efficiency, EventHits& hits) const
+{
+	//Value() no longer checks the range, so the caller must
+	assert(voxel >= 0 && voxel < GetNumberOfGridVoxels() * (mirror_x_.empty() ? 1 : 2));
+	GetVoxelPosition(voxel, hits.position);
+	//Poisson about the yield, from the event's stream
+	hits.nphotons = gRandom->Poisson(scint_yield * energy);
 
-	int total_hits_vuv = 0;
-	int total_hits_vis = 0;
+	//The stored row may be the mirror image of voxel, in which case so are
+	//its channels (as in GetVisibleChannels)
+	bool image_x = !mirror_x_.empty() && voxel >= GetNumberOfGridVoxels();
+	bool image_y = fold_y_ && ((voxel % GetNumberOfGridVoxels()) / gxSteps) % gySteps >= gySteps/2;
+	size_t stored = voxel;
+	int probe = 0;
+	MapSymmetry(stored, probe);
 
-	for(int i = 0; i < int_hits_vuv; i++)
+	//The row, as contiguous planes with the physical channel of each column
+	int ncolumns = nchannels_;
+	const SparseLibraryEntry* sparse_row = 0;
+	if(!sparse_offsets_.empty()) {sparse_row = GetSparseRow(stored, ncolumns); }
+	hits.p_vuv.resize(ncolumns);
+	hits.p_vis.resize(ncolumns);
+	hits.t0.resize(ncolumns);
+	hits.column_channel.resize(ncolumns);
+	if(sparse_row)
 	{
-		if(gRandom->Uniform(1.) <= quantum_efficiency){total_hits_vuv++;}
+		for(int i = 0; i < ncolumns; i++)
+		{
+			hits.p_vuv[i] = sparse_row[i].vis;
+			hits.p_vis[i] = sparse_row[i].refl_vis;
+			hits.t0[i] = sparse_row[i].refl_t0;
+			hits.column_channel[i] = sparse_row[i].channel;
+		}
 	}
-	for(int j = 0; j < int_hits_vis; j++)
+	else if(ncolumns > 0)
 	{
-		if(gRandom->Uniform(1.) <= quantum_efficiency){total_hits_vis++;}
+		ReadRow(stored, hits.p_vuv.data(), hits.p_vis.data(), hits.t0.data());
+		std::copy(channels_.begin(), channels_.end(), hits.column_channel.begin());
 	}
+	ScaleRow(hits.p_vuv.data(), ncolumns, quantum_efficiency);
+	ScaleRow(hits.p_vis.data(), ncolumns, quantum_efficiency);
 
-  //Push information back into a vector to readout in:
-  //libraryanalyze_light_histo
-	pmt_hits.push_back(total_hits_vuv);
-	pmt_hits.push_back(total_hits_vis);
-	pmt_hits.push_back(position[0]);//x position of voxel
-	pmt_hits.push_back(position[1]);//y
-	pmt_hits.push_back(position[2]);//z
-	pmt_hits.push_back(reflT0);
+	//Multinomial split of the created photons, one channel and plane at a
+	//time: each takes a binomial share of the photons left, with its
+	//probability conditional on the photon not having been taken already
+	hits.channel.clear();
+	hits.vuv.clear();
+	hits.visible.clear();
+	hits.reflT0.clear();
+	int remaining = hits.nphotons;
+	double untaken = 1;
+	for(int i = 0; i < ncolumns; i++)
+	{
+		int channel = hits.column_channel[i];
+		if(image_y) {channel = Mirror(mirror_y_, channel); }
+		//mirror partners loaded only for the fold are not reported
+		if(!requested_.empty() && (channel < 0 || channel >= int(requested_.size()) || !requested_[channel])) {continue; }
+		if(image_x) {channel = Mirror(mirror_x_, channel); }
 
-	return pmt_hits;
+		int n_vuv = 0;
+		int n_vis = 0;
+		if(remaining > 0 && untaken > 0)
+		{
+			n_vuv = utility::binomial(remaining, std::min(1., hits.p_vuv[i] / untaken), gRandom);
+			remaining -= n_vuv;
+			untaken -= hits.p_vuv[i];
+			if(remaining > 0 && untaken > 0) {n_vis = utility::binomial(remaining, std::min(1., hits.p_vis[i] / untaken), gRandom); }
+			remaining -= n_vis;
+			untaken -= hits.p_vis[i];
+		}
+		//a channel with no partner in the other TPC sees its photons lost
+		if(channel < 0) {continue; }
+		hits.channel.push_back(channel);
+		hits.vuv.push_back(n_vuv);
+		hits.visible.push_back(n_vis);
+		hits.reflT0.push_back(hits.t0[i]);
+	}
 }
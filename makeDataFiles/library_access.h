@@ -3,35 +3,523 @@
 
 #include <string>
 #include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#include "voxel_grid.h"
+#include "pmt_layout.h"
 
 //This file is designed to access the visibility parameters from the
 //optical libraries, which are needed to calculate the number of photoelectrons
 //incident on each PMT.
 
+//Header of the native library cache (.plib) written by make_library_cache.
+//The float table follows at payload_offset, in exactly the layout held in
+//memory by LibraryAccess, so the file can be mmap'ed and used as it is.
+struct LibraryCacheHeader{
+    char magic[8];              //"SBNDPLIB"
+    uint32_t version;
+    uint32_t header_size;       //sizeof(LibraryCacheHeader) when written
+    int32_t nvoxels;
+    int32_t nchannels;
+    int32_t nfields;
+    int32_t refl_offset;        //-1 if the plane is not stored
+    int32_t reflT_offset;
+    int32_t channel_map_offset; //nchannels physical channel IDs, one per table column
+    int32_t grid_steps[3];
+    double grid_lower[3];
+    double grid_upper[3];
+    uint64_t payload_offset;
+    uint64_t payload_bytes;
+    uint64_t payload_checksum;
+    uint64_t header_checksum;   //over every field above
+};
+
+struct SharedLibraryHeader;
+
+//Header of a low-rank library (.plr) written by make_lowrank_library. It is
+//followed by the channel map and then, for each of the nfields planes, the
+//mean of every channel (nchannels floats), the basis (rank x nchannels) and
+//the scores of every voxel (nvoxels x rank): plane[v][c] is approximated by
+//mean[c] + sum_k scores[v][k]*basis[k][c].
+struct LowRankLibraryHeader{
+    char magic[8];              //"SBNDPLLR"
+    uint32_t version;
+    uint32_t header_size;
+    int32_t nvoxels;
+    int32_t nchannels;
+    int32_t nfields;
+    int32_t refl_offset;
+    int32_t reflT_offset;
+    int32_t rank;
+    int32_t grid_steps[3];
+    int32_t reserved;
+    uint64_t header_checksum;   //over every field above
+};
+
+//Store of several configurations of the same library (.plms), written by
+//make_library_store: the direct visibility, which does not depend on the
+//foils, is kept once and each configuration only adds its reflected planes
+//(and its own direct plane if it was found to differ). After the header come
+//the channel map, nconfigs LibraryStoreEntry and the planes, each a
+//voxel-major float array.
+struct LibraryStoreHeader{
+    char magic[8];              //"SBNDPLMS"
+    uint32_t version;
+    uint32_t header_size;
+    int32_t nvoxels;
+    int32_t nchannels;
+    int32_t nconfigs;
+    int32_t grid_steps[3];
+    uint64_t direct_offset;     //shared direct visibility, nvoxels x nchannels
+    uint64_t header_checksum;   //over every field above
+};
+
+struct LibraryStoreEntry{
+    char name[112];             //library file the configuration came from
+    int32_t nrefl;              //reflected planes stored (0 to 2), interleaved per channel
+    int32_t refl_index;         //position of ReflVisibility among them, -1 if absent
+    int32_t reflT_index;
+    int32_t own_direct;         //1 if direct_offset is this configuration's own direct plane
+    uint64_t direct_offset;
+    uint64_t refl_offset;
+};
+
+//How the tables are held in memory once loaded. The 16 bit encodings halve
+//the footprint: kEncodingHalf is fp16 with a power-of-two scale per plane (so
+//small visibilities stay out of the subnormal range), kEncodingLog16 spaces
+//the codes evenly in log(value) between the smallest and largest non-zero
+//entry of each plane.
+enum LibraryEncoding { kEncodingFloat32 = 0, kEncodingHalf = 1, kEncodingLog16 = 2 };
+
+//Where LoadLibraryFromFile puts the (dense, float) table in memory:
+//kPlacementInterleave spreads its pages over all NUMA nodes,
+//kPlacementReplicate gives each node its own copy and lookups read the copy
+//of the node the calling thread runs on, kPlacementHugePages backs it with
+//huge pages (hugetlbfs if some are reserved, transparent huge pages
+//otherwise). Whatever cannot be done on this machine falls back to the
+//default placement; GetPlacementReport() says what took effect.
+enum MemoryPlacement { kPlacementDefault = 0, kPlacementInterleave = 1, kPlacementReplicate = 2, kPlacementHugePages = 3 };
+
+//One channel of a voxel in the sparse library layout
+struct SparseLibraryEntry{
+    int channel;        //physical channel
+    float vis;
+    float refl_vis;
+    float refl_t0;
+};
+
+//Photoelectrons one PMT sees from an event, from PhotonLibraryAnalyzer
+struct PMTHits{
+    int vuv;            //direct (VUV) photoelectrons
+    int visible;        //reflected (visible) photoelectrons
+    double position[3]; //of the event's voxel
+    double reflT0;      //earliest arrival of the reflected light (ns)
+};
+
+//Photoelectrons every channel that can see an event gets, from
+//CountEventHits. Reusing one EventHits for all events avoids allocating.
+struct EventHits{
+    int nphotons;               //scintillation photons created by the event
+    double position[3];         //of the event's voxel
+    std::vector<int> channel;   //physical channel
+    std::vector<int> vuv;
+    std::vector<int> visible;
+    std::vector<float> reflT0;
+
+    //scratch: the voxel's row, one entry per table column
+    std::vector<float> p_vuv;
+    std::vector<float> p_vis;
+    std::vector<float> t0;
+    std::vector<int> column_channel;
+};
+
+//Whether LoadLibraryFromFile folds the library about y = 0
+enum SymmetryMode { kNoSymmetry = 0, kDetectSymmetry = 1, kDeclaredSymmetry = 2 };
+
 class LibraryAccess{
 
   public:
+    //Loads the .plib cache next to libraryfile if there is one (or libraryfile
+    //itself if it is a .plib), and only falls back to reading the ROOT tree otherwise
     void LoadLibraryFromFile(std::string libraryfile, bool reflected, bool reflT0);
-    const float* GetReflT0(size_t Voxel, int no_pmt);
-    const float* GetReflCounts(size_t Voxel, int no_pmt, bool is_reflT0);
-    const float* GetCounts(size_t Voxel, int no_pmt);
-    const float* GetLibraryEntries(int VoxID, bool wantReflected, int no_pmt);
+    void LoadLibraryFromRootFile(std::string libraryfile, bool reflected, bool reflT0);
+    void SetLoaderThreads(int nthreads); //for LoadLibraryFromRootFile, 0 = one per core
+    bool LoadLibraryFromCache(std::string cachefile, bool reflected, bool reflT0);
+    bool WriteLibraryCache(std::string cachefile);
+    bool VerifyLibraryCache();
+    static std::string CacheFileName(std::string libraryfile, int level = 0);
+
+    //With shared memory on, LoadLibraryFromFile publishes the library in a
+    //POSIX shared memory segment (or attaches to the one another process
+    //already published for the same library and configuration)
+    void SetSharedMemory(bool shared);
+    bool LoadLibraryFromSharedMemory(std::string libraryfile, bool reflected, bool reflT0);
+
+    //Low-rank library: WriteLowRankLibrary factorizes the loaded (float,
+    //dense) table plane by plane, keeping the rank largest principal
+    //components, and prints the reconstruction error of every channel.
+    //LoadLibraryFromFile loads .plr files with LoadLowRankLibrary, after which
+    //a voxel's row is rebuilt (one rank x channels product per plane) when a
+    //lookup first needs it.
+    bool WriteLowRankLibrary(std::string lowrankfile, int rank);
+    bool LoadLowRankLibrary(std::string lowrankfile, bool reflected, bool reflT0);
+    bool IsLowRank() const { return lowrank_rank_ > 0; }
+
+    //Semi-analytic visibilities, needing no library: the solid angle of each
+    //PMT of the layout (restricted to the active channels) seen from
+    //the voxel centre, attenuated by Rayleigh scattering, for the direct
+    //light; the same from the voxel's image in the cathode for the reflected
+    //light, with reflT0 the straight line travel time from there. Each is
+    //multiplied (reflT0: shifted) by a correction binned in distance and
+    //angle to the PMT, fitted against a real library by FitAnalyticCorrection
+    //and read from correction_file (none: uncorrected). A voxel's row is
+    //evaluated for all channels together when a lookup first needs it.
+    void LoadAnalyticModel(const PMTLayout& pmts, std::string correction_file, bool reflected, bool reflT0);
+    bool IsAnalytic() const { return analytic_; }
+    //Fits the correction tables against library (loaded with the same
+    //planes), writes them to correction_file and uses them from then on.
+    //Prints every channel's bias against the library before and after.
+    bool FitAnalyticCorrection(LibraryAccess& library, std::string correction_file);
+
+    //Multi-configuration store: LoadLibraryFromFile loads .plms files with
+    //LoadLibraryStore, and lookups then go to the selected configuration
+    //(0 = the first library given to make_library_store). Switching is free.
+    static bool WriteLibraryStore(std::string storefile, const std::vector<std::string>& libraryfiles, double tolerance);
+    bool LoadLibraryStore(std::string storefile, bool reflected, bool reflT0);
+    void SelectConfiguration(int config);
+    int GetNumberOfConfigurations() const { return store_configs_.size(); }
+    std::string GetConfigurationName(int config) const { return store_configs_[config].name; }
+
+    void SetMemoryPlacement(MemoryPlacement placement);
+    const std::string& GetPlacementReport() const { return placement_report_; }
+
+    //Restricts the next load to these physical channels; the table then only
+    //has one column per active channel. Lookups keep taking physical IDs.
+    void SetActiveChannels(const std::vector<int>& channels);
+    int GetNumberOfChannels() const { return nchannels_; }
+    int GetPhysicalChannel(int index) const { return channels_[index]; }
+    int GetChannelIndex(int no_pmt) const
+    { return (no_pmt >= 0 && no_pmt < int(channel_index_.size())) ? channel_index_[no_pmt] : -1; }
+
+    //Encoding applied by LoadLibraryFromFile after the float table is read.
+    //The errors it introduces are accumulated while encoding and can be
+    //printed afterwards, including the shift in the mean number of
+    //photoelectrons per PMT (averaged over voxels) for a given photon budget.
+    void SetEncoding(LibraryEncoding encoding);
+    void PrintEncodingReport(double photons_created, double quantum_efficiency) const;
+
+    //With a threshold >= 0, LoadLibraryFromFile keeps only the channels of
+    //each voxel whose direct or reflected visibility is above it, and lookups
+    //of the other channels read zero. The event loop can then visit just the
+    //channels that can see a voxel.
+    void SetSparseThreshold(float threshold);
+    bool IsSparse() const { return !sparse_offsets_.empty(); }
+    const SparseLibraryEntry* GetSparseRow(int voxel, int& nentries) const;
+    void GetVisibleChannels(int voxel, std::vector<int>& pmts) const;
+
+    //Mirror symmetries of the detector. channel_mirror[c] is the channel at
+    //the mirror image of channel c (see FindMirrorChannels).
+    //y: the library is folded to y < 0 after loading, either because it is
+    //declared symmetric or, for kDetectSymmetry, if every entry matches its
+    //mirror image to within tolerance (relative). Lookups for y > 0 go through
+    //the reflection, and the mirror partners of the active channels are loaded too.
+    //x: the library covers one TPC and voxel IDs from GetNumberOfGridVoxels()
+    //up address the other one (x < 0), looked up through the reflection
+    //onto this TPC and the mirror PMT plane; nothing extra is stored.
+    void SetMirrorSymmetryY(SymmetryMode mode, const std::vector<int>& channel_mirror, double tolerance = 0.01);
+    void SetMirrorTPC(const std::vector<int>& channel_mirror);
+    static std::vector<int> FindMirrorChannels(const PMTLayout& pmts, int axis);
+    bool IsFoldedY() const { return fold_y_; }
+
+    //Resolution levels: level L is the library on a grid 2^L times coarser
+    //in each direction (rounded up), each coarse voxel holding the average
+    //over the voxels it covers (reflT0 weighted by the reflected visibility).
+    //LoadLibraryFromFile loads the level's own cache if make_library_cache
+    //wrote one, and otherwise builds it from the full library. Voxel IDs,
+    //coordinates and positions are then all on the level's grid.
+    void SetResolutionLevel(int level);
+    int GetResolutionLevel() const { return table_level_; }
+    void DownsampleTable(int level);
+    int GetNumberOfGridVoxels() const { return level_grid_.NumberOfVoxels(); }
+    const VoxelGrid<>& GetLevelGrid() const { return level_grid_; }
+
+    //Out-of-core mode for libraries that do not fit in memory. With a budget
+    //> 0, LoadLibraryFromFile keeps the .plib cache on disk and reads it in
+    //tiles of zlayers_per_tile z layers of voxels as lookups need them, holding
+    //at most budget bytes of tiles and dropping the least recently used.
+    //PrefetchVoxels asks the kernel to start reading the tiles of upcoming
+    //events in the background. Lookups are then not thread safe.
+    void SetTiling(size_t memory_budget_bytes, int zlayers_per_tile = 1);
+    bool IsTiled() const { return tile_fd_ >= 0; }
+    void PrefetchVoxels(const std::vector<int>& voxels) const;
+    void PrintTileReport() const;
+
+    float GetReflT0(size_t Voxel, int no_pmt);
+    float GetReflCounts(size_t Voxel, int no_pmt, bool is_reflT0);
+    float GetCounts(size_t Voxel, int no_pmt);
+    float GetLibraryEntries(int VoxID, bool wantReflected, int no_pmt);
     std::vector<int> GetVoxelCoords(int id, double position[3]);
     int GetVoxelID(double* Position);
-    std::vector<double> PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel);
+    //Allocation free versions, also for many voxels at once (including the
+    //other TPC when SetMirrorTPC is used)
+    void GetVoxelPosition(int id, double position[3]) const;
+    void GetVoxelPositions(const int* ids, size_t n, double* x, double* y, double* z) const;
+    const SBNDVoxelGrid& GetGrid() const { return grid_; }
+    PMTHits PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel);
+    //Same, for an event whose voxel position was already worked out
+    PMTHits PhotonLibraryAnalyzer(double _energy, const int _scint_yield, const double _quantum_efficiency, int _pmt_number, int _rand_voxel, const double position[3]);
+    //All channels of GetVisibleChannels at once: the photons created are
+    //drawn once for the event and split multinomially over the channels
+    //(VUV and visible) and undetected, so no channel or sum of channels can
+    //see more than were created. The voxel's row is read once.
+    void CountEventHits(int voxel, double energy, int scint_yield, double quantum_efficiency, EventHits& hits) const;
 
     LibraryAccess();
+    ~LibraryAccess();
 
   private:
-    std::vector<std::vector<float> > table_;
-    std::vector<std::vector<float> > reflected_table_;
-    std::vector<std::vector<float> > reflT_table_;
+    LibraryAccess(const LibraryAccess&);
+    LibraryAccess& operator=(const LibraryAccess&);
+
+    void ReleaseLibrary();
+    bool CheckCacheHeader(const LibraryCacheHeader& header, size_t size, const std::string& name) const;
+    VoxelGrid<> LevelGrid(int level) const;
+    int GridLevel(const int32_t steps[3]) const;
+    void ReplaceTable(std::vector<float>& table, int nvoxels);
+    bool LoadTiledLibrary(const std::string& cachefile, bool reflected, bool reflT0);
+    bool LoadTile(int tile) const;
+    void ReconstructRow(size_t voxel) const;
+    void EvaluateAnalyticRow(size_t voxel, float* row, bool corrected) const;
+    bool ReadAnalyticCorrection(const std::string& correction_file);
+    void PrintAnalyticBias(LibraryAccess& library, bool corrected) const;
+    void PlaceTable();
+    void* AllocatePlaced(size_t bytes, int node, bool interleave, bool huge_pages, std::string& how);
+    const float* StoreColumns(const float* plane, int stride, const std::vector<int>& source, int file_nchannels);
+    bool AttachCacheImage(const char* image, size_t size, void* mapping, size_t mapping_size, bool reflected, bool reflT0, const std::string& name, bool shared);
+    std::vector<char> CacheImagePrefix() const;
+    std::string SharedMemoryName(const std::string& libraryfile, bool reflected, bool reflT0) const;
+    bool CreateSharedLibrary(int fd, const std::string& name, const std::string& libraryfile, bool reflected, bool reflT0);
+    bool AttachSharedLibrary(int fd, const std::string& name, bool reflected, bool reflT0);
+    void SetChannelMap(const std::vector<int>& channels);
+    std::vector<int> SelectChannels(int maxopChannel) const;
+    void EncodeTable();
+    void BuildSparseTable();
+    bool CheckMirrorSymmetryY(double tolerance) const;
+    void FoldTableY();
+    float SparseValue(size_t voxel, int no_pmt, int offset) const;
+    void ReadRow(size_t voxel, float* vis, float* refl, float* reflT) const;
+
+    //Voxel-major table: each voxel row holds, for every channel, the direct
+    //visibility followed by the reflected visibility and reflT0 (the last two
+    //only if they were requested when loading).
+    //data_ points either into table_ or into a mapped cache image (a .plib
+    //file or a shared memory segment)
+    std::vector<float> table_;
+    const float* data_;
+    void* mapped_;
+    size_t mapped_size_;
+    const LibraryCacheHeader* cache_header_;
+    SharedLibraryHeader* shared_header_;
+    std::string shared_name_;
+    int nvoxels_;
+    int nchannels_;
+    int nfields_;
+    int refl_offset_;
+    int reflT_offset_;
+    const float zero_;
+
+    //active_channels_ is what was asked for (empty = all), channels_ maps a
+    //table column to its physical channel and channel_index_ the other way
+    std::vector<int> active_channels_;
+    std::vector<int> channels_;
+    std::vector<int> channel_index_;
+
+    //Encoded copy of the table (same layout) and, per plane, the value of
+    //every 16 bit code
+    LibraryEncoding encoding_;
+    std::vector<uint16_t> encoded_;
+    std::vector<float> decode_[3];
+
+    //Filled by EncodeTable: per plane max/mean relative error, and per table
+    //column the voxel sums of the exact and encoded (reflected) visibility
+    double max_rel_error_[3];
+    double mean_rel_error_[3];
+    std::vector<double> vis_sum_[2];
+    std::vector<double> encoded_vis_sum_[2];
+
+    int loader_threads_;
+    bool shared_memory_;
+
+    //Sparse layout: the entries of voxel v are sparse_entries_[sparse_offsets_[v] .. sparse_offsets_[v+1])
+    float sparse_threshold_;
+    std::vector<uint32_t> sparse_offsets_;
+    std::vector<SparseLibraryEntry> sparse_entries_;
+
+    //Symmetries: fold_y_ once the table only holds y < 0 (then stored voxel
+    //rows are numbered on the half grid)
+    SymmetryMode symmetry_y_;
+    double symmetry_tolerance_;
+    bool fold_y_;
+    std::vector<int> mirror_y_;
+    std::vector<int> mirror_x_;
+    std::vector<bool> requested_; //active channels when more were loaded for the fold
+
+    //Tiled layout: the table is split into tiles of tile_voxels_ consecutive
+    //voxels (whole z layers), each a contiguous range of the .plib payload
+    //read into tiles_[tile] on demand, same layout as the in-memory table.
+    //current_tile_ is the tile of the last lookup, the common case being
+    //many lookups in the same voxel.
+    size_t tile_budget_;
+    int tile_zlayers_;
+    int tile_fd_;
+    uint64_t tile_payload_offset_;
+    int tile_file_channels_;
+    std::vector<int> tile_columns_; //cache column of each loaded channel
+    int tile_voxels_;
+    int max_resident_tiles_;
+    mutable std::vector<std::vector<float> > tiles_;
+    mutable std::vector<uint64_t> tile_last_use_;
+    mutable std::vector<int> resident_tiles_;
+    mutable std::vector<float> tile_buffer_;
+    mutable uint64_t tile_clock_;
+    mutable uint64_t tile_reads_;
+    mutable int current_tile_;
+    mutable const float* current_tile_data_;
+
+    const float* TileRow(size_t voxel) const
+    {
+      int tile = voxel / tile_voxels_;
+      if(tile != current_tile_ && !LoadTile(tile)) {return 0; }
+      return current_tile_data_ + (voxel - size_t(tile)*tile_voxels_)*nchannels_*nfields_;
+    }
+
+    //Low-rank layout, see LowRankLibraryHeader (columns restricted to the
+    //loaded channels)
+    int lowrank_rank_;
+    int lowrank_timing_field_; //the reflT0 plane, not clamped at 0
+    std::vector<float> lowrank_mean_[3];
+    std::vector<float> lowrank_basis_[3];
+    std::vector<float> lowrank_scores_[3];
+
+    //Analytic model: positions of the loaded channels' PMTs and the
+    //correction tables (distance x cos(angle) bins, one per plane)
+    bool analytic_;
+    std::vector<float> analytic_x_;
+    std::vector<float> analytic_y_;
+    std::vector<float> analytic_z_;
+    std::vector<float> analytic_correction_[3];
+
+    //Backends that compute a voxel's row (low-rank, analytic) keep the last
+    //one in computed_row_, in the layout of a table row
+    mutable int row_voxel_;
+    mutable std::vector<float> computed_row_;
+
+    const float* ComputedRow(size_t voxel) const
+    {
+      if(voxel >= size_t(nvoxels_)) {return 0; }
+      if(int(voxel) != row_voxel_)
+      {
+        if(analytic_) {EvaluateAnalyticRow(voxel, &computed_row_[0], true); }
+        else {ReconstructRow(voxel); }
+        row_voxel_ = voxel;
+      }
+      return &computed_row_[0];
+    }
+
+    //Multi-configuration store: per configuration its direct and reflected
+    //planes (pointing into the mapped store, or into store_tables_ when only
+    //some channels are loaded). store_direct_ etc. are those of the
+    //selected configuration; store_field_ maps a lookup offset (refl_offset_
+    //= 1, reflT_offset_ = 2) to the field in its reflected plane.
+    struct StoreConfiguration{
+      std::string name;
+      const float* direct;
+      const float* refl;
+      int nrefl;
+      int field[3];
+    };
+    std::vector<StoreConfiguration> store_configs_;
+    std::vector<std::vector<float> > store_tables_;
+    int store_config_;
+    const float* store_direct_;
+    const float* store_refl_;
+    int store_nrefl_;
+    int store_field_[3];
+
+    //Memory placement: the regions the table was copied to, and for
+    //kPlacementReplicate one table per NUMA node (indexed by node)
+    MemoryPlacement placement_;
+    std::string placement_report_;
+    std::vector<std::pair<void*, size_t> > placed_regions_;
+    std::vector<const float*> replicas_;
+    static thread_local int local_node_;
+    static int CurrentNode();
+    const float* LocalReplica() const
+    {
+      if(local_node_ < 0) {local_node_ = CurrentNode(); }
+      return replicas_[std::min<size_t>(local_node_, replicas_.size() - 1)];
+    }
+
+    static int Mirror(const std::vector<int>& mirror, int no_pmt)
+    { return (no_pmt >= 0 && no_pmt < int(mirror.size())) ? mirror[no_pmt] : -1; }
+    //Maps a (voxel, channel) lookup onto the row actually stored
+    void MapSymmetry(size_t& voxel, int& no_pmt) const
+    {
+      if(!mirror_x_.empty() && voxel >= size_t(GetNumberOfGridVoxels()))
+      {
+        voxel -= GetNumberOfGridVoxels();
+        no_pmt = Mirror(mirror_x_, no_pmt);
+      }
+      if(fold_y_)
+      {
+        size_t ix = voxel % gxSteps;
+        size_t iy = (voxel / gxSteps) % gySteps;
+        size_t iz = voxel / (gxSteps*gySteps);
+        if(iy >= size_t(gySteps/2))
+        {
+          iy = gySteps - 1 - iy;
+          no_pmt = Mirror(mirror_y_, no_pmt);
+        }
+        voxel = ix + iy*gxSteps + iz*gxSteps*(gySteps/2);
+      }
+    }
+
+    size_t Index(size_t voxel, int index) const { return (voxel*nchannels_ + index)*nfields_; }
+    float Value(size_t voxel, int no_pmt, int offset) const
+    {
+      MapSymmetry(voxel, no_pmt);
+      int index = GetChannelIndex(no_pmt);
+      if(index < 0 || offset < 0) {return zero_; }
+      if(!sparse_offsets_.empty()) {return SparseValue(voxel, no_pmt, offset); } //already mapped
+      if(store_direct_)
+      {
+        size_t k = voxel*nchannels_ + index;
+        if(offset == 0) {return store_direct_[k]; }
+        return (store_field_[offset] < 0) ? zero_ : store_refl_[k*store_nrefl_ + store_field_[offset]];
+      }
+      if(tile_fd_ >= 0 || lowrank_rank_ > 0 || analytic_)
+      {
+        const float* row = (tile_fd_ >= 0) ? TileRow(voxel) : ComputedRow(voxel);
+        return row ? row[index*nfields_ + offset] : zero_;
+      }
+      size_t k = Index(voxel, index) + offset;
+      if(encoding_ == kEncodingFloat32) {return replicas_.empty() ? data_[k] : LocalReplica()[k]; }
+      return decode_[offset][encoded_[k]];
+    }
 
     const double gLowerCorner[3] = {2.5, -200, 0};
     const double gUpperCorner[3] = {202.5, 200, 500};
-    const int gxSteps = 40;
-    const int gySteps = 80;
-    const int gzSteps = 100;
+    const int gxSteps = SBNDVoxelGrid::kNx;
+    const int gySteps = SBNDVoxelGrid::kNy;
+    const int gzSteps = SBNDVoxelGrid::kNz;
+    const SBNDVoxelGrid grid_{gLowerCorner, gUpperCorner};
+
+    //Resolution level asked for and that of the loaded table, whose grid
+    //level_grid_ is (the full grid at level 0)
+    int resolution_level_ = 0;
+    int table_level_ = 0;
+    VoxelGrid<> level_grid_ = LevelGrid(0);
 
 
 
@@ -3,14 +3,18 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <random>
 
 #include "library_access.h"
+#include "timing_tables.h"
+#include "scintillation_sampler.h"
 #include "libraryanalyze_light_histo.h"
 
 
 using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 { 
   //////////////////////////////////////////////////////////////////////////////
   ////////////-----------------FUNCTIONS-----------------------------///////////
@@ -20,16 +24,11 @@ int main()
   fSpectrum->SetParameter(0, Q_Ar);
   flandau_sn->SetParameter(0, Eav);
 
-  TRandom3 *fGauss = new TRandom3();
-  
-  TF1 *fScintillation_function = new TF1("Scintillation Timing", utility::Scintillation_function, 0, scint_time_window, 3); // NB function definition can be found in utility_functions.cc
-  fScintillation_function->SetParameter(0, t_singlet); 
-  fScintillation_function->SetParameter(1, t_triplet);  // t_singlet and t_triplet are defined in the header file (libraryanalyze_light_histo.h)
-  if(gen_argon == true || fixed_energy == true || supernova == true){ //i.e. an electron is the ionising particle
-    fScintillation_function->FixParameter(2, 0); 
-  }
-  if(gen_radon == true){fScintillation_function->FixParameter(2, 1);} // i.e. an alpha particle is the ionising particle
-  // the 3rd parameter is the type of particle 0 = electron, 1 = alpha (sets the ratio of the fast and slow components - see utility_functions.cc)
+  // Scintillation emission times: singlet and triplet exponentials in the proportion of the ionising particle (electrons
+  // for the Ar39 betas, fixed energies and supernova neutrinos, alphas for radon) at the drift field. t_singlet and
+  // t_triplet are defined in the header file (libraryanalyze_light_histo.h)
+  ScintillationSampler::Species scint_species = gen_radon ? ScintillationSampler::kAlpha : ScintillationSampler::kElectron;
+  ScintillationSampler scintillation = ScintillationSampler::Preset(scint_species, drift_field, t_singlet, t_triplet, scint_time_window);
 
 
 
@@ -60,7 +59,7 @@ int main()
     cout << "This is equal to " << time_frames << " PMT readout frames." << endl;
 
     cout << endl <<  "/////////////////////////////////////////////////////////////////////////////" << endl;
-    cout << "***NOTE. In ONE TPC, We expect to see: " << Ar_decays_per_sec << " Ar 39 decays each second.***" << endl;
+    cout << "***NOTE. In " << (both_tpcs ? "BOTH TPCs" : "ONE TPC") << ", We expect to see: " << Ar_decays_per_sec << " Ar 39 decays each second.***" << endl;
     cout << "//////////////////////////////////////////////////////////////////////////////" << endl << endl;
   }
   if(supernova == true){
@@ -77,7 +76,7 @@ int main()
     cout << "This is equal to " << time_frames << " PMT readout frames." << endl;
 
     cout << endl << "/////////////////////////////////////////////////////////////////////////////" << endl;
-    cout << "***NOTE. In ONE TPC, we expect to see: " << Rn_decays_per_sec << " radon-222 decays each second.***" << endl;
+    cout << "***NOTE. In " << (both_tpcs ? "BOTH TPCs" : "ONE TPC") << ", we expect to see: " << Rn_decays_per_sec << " radon-222 decays each second.***" << endl;
     cout << "/////////////////////////////////////////////////////////////////////////////" << endl << endl;
   }
 
@@ -156,9 +155,49 @@ int main()
   event_tree->Branch("event_z_pos", &event_z_pos, "event_z_pos/D");
   event_tree->Branch("event_E", &event_E, "event_E/D");
 
+  // ------------ PMT TREE -------------
+  //pmt_tree saves one entry for every PMT simulated: its library channel, (x,y,z) position and type (see pmt_layout.h)
+  pmt_tree->Branch("pmt_channel", &pmt_channel, "pmt_channel/I");
+  pmt_tree->Branch("pmt_x_pos", &pmt_x_pos, "pmt_x_pos/D");
+  pmt_tree->Branch("pmt_y_pos", &pmt_y_pos, "pmt_y_pos/D");
+  pmt_tree->Branch("pmt_z_pos", &pmt_z_pos, "pmt_z_pos/D");
+  pmt_tree->Branch("pmt_type", &pmt_type, "pmt_type/I");
+
+
+
+
+
 
 
 
+  ////////////////////////////////////////////////////////////////////////////////////
+  ////////////-------------FILLING A VECTOR OF PMT POSITIONS---------------///////////
+  ////////////////////////////////////////////////////////////////////////////////////
+  //NOTE: the posPMTs_setup1.txt file is just a list of the PMT positions of every PMT in the library, and the layout file
+  //the same for the PMTs to simulate, each held as arrays of x, y, z, channel and type (see pmt_layout.h)
+  string layoutfile = (argc > 1) ? argv[1] : default_pmt_layout;
+  if(!pmt_geometry.Load("posPMTs_setup1.txt") || !pmt_layout.Load(layoutfile)) {return 1; }
+  // with both TPCs, the PMTs of the second TPC's plane are the mirror images of the layout's (channels as in the library)
+  vector<int> tpc_mirror = LibraryAccess::FindMirrorChannels(pmt_geometry, 0);
+  if(both_tpcs) {
+    size_t layout_pmts = pmt_layout.size();
+    for(size_t i = 0; i < layout_pmts; i++) {
+      int partner = (pmt_layout.channel[i] < int(tpc_mirror.size())) ? tpc_mirror[pmt_layout.channel[i]] : -1;
+      if(partner < 0) {cout << "WARNING: channel " << pmt_layout.channel[i] << " has no mirror image in the other TPC" << endl; continue; }
+      if(pmt_layout.Index(partner) < 0) {pmt_layout.Add(partner, -pmt_layout.x[i], pmt_layout.y[i], pmt_layout.z[i], pmt_layout.type[i]); }
+    }
+  }
+  cout << "Simulating " << pmt_layout.size() << " PMTs from the layout " << layoutfile << (both_tpcs ? " in both TPCs" : "") << endl;
+  for(size_t i = 0; i < pmt_layout.size(); i++) {
+    pmt_channel = pmt_layout.channel[i];
+    pmt_x_pos = pmt_layout.x[i];
+    pmt_y_pos = pmt_layout.y[i];
+    pmt_z_pos = pmt_layout.z[i];
+    pmt_type = pmt_layout.type[i];
+    pmt_tree->Fill();
+  }
+  // End Reading out positions of PMT from txt file.
+
 
 
 
@@ -169,31 +208,27 @@ int main()
   if(config == 0) {libraryfile = "Lib154PMTs8inch_FullFoilsTPB.root"; }
   if(config == 1) {libraryfile = "Lib154PMTs8inch_OnlyCathodeTPB.root"; }
   if(config == 2) {libraryfile = "Lib154PMTs8inch_NoCathodeNoFoils.root"; }
-  lar_light.LoadLibraryFromFile(libraryfile, reflected, reflT);
-
-
-
+  if(use_library_store) {libraryfile = "Lib154PMTs8inch.plms"; }
+  lar_light.SelectConfiguration(config);
+  // only the channels of the PMT layout are ever looked up, so only those are loaded
+  lar_light.SetActiveChannels(pmt_layout.channel);
+  lar_light.SetEncoding(library_encoding);
+  lar_light.SetSharedMemory(shared_library);
+  lar_light.SetMemoryPlacement(library_placement);
+  lar_light.SetSparseThreshold(sparse_threshold);
+  // the PMT plane is symmetric in y, so the library can be stored for y < 0 only
+  lar_light.SetMirrorSymmetryY(library_symmetry, LibraryAccess::FindMirrorChannels(pmt_geometry, 1), symmetry_tolerance);
+  // the second TPC is looked up in the same library, through the cathode plane onto the first
+  if(both_tpcs) {lar_light.SetMirrorTPC(tpc_mirror); }
+  lar_light.SetTiling(size_t(library_memory_MB * 1048576.), tile_z_layers);
+  lar_light.SetResolutionLevel(resolution_level);
+  if(analytic_visibility) {lar_light.LoadAnalyticModel(pmt_layout, "analytic_correction.txt", reflected, reflT); }
+  else {lar_light.LoadLibraryFromFile(libraryfile, reflected, reflT); }
 
-
-  ////////////////////////////////////////////////////////////////////////////////////
-  ////////////-------------FILLING A VECTOR OF PMT POSITIONS---------------///////////
-  ////////////////////////////////////////////////////////////////////////////////////
-  //NOTE: the posPMTs_setup1.txt file is just a list of the PMT positions, which will simply be filled into a vector.
-  ifstream myfile;
-  myfile.open("posPMTs_setup1.txt");
-  if(myfile.is_open()) {cout << "File opened successfully" << endl; }
-  while(!myfile.eof())
-    {
-      double num_pmt, x_pmt, y_pmt, z_pmt;
-      if(myfile >> num_pmt >> x_pmt >> y_pmt >> z_pmt)
-	{
-	  vector<double> line_data({num_pmt, x_pmt, y_pmt, z_pmt});
-	  myfile_data.push_back(line_data);
-	}
-      else{break; }
-    }
-  myfile.close();
-  // End Reading out positions of PMT from txt file.
+  // inverse-CDF tables of the photon transport time parametrizations, read from timing_table_file (or built and saved)
+  TimingTables timing_tables;
+  if(fast_timing) {timing_tables.Load(timing_table_file); }
+  lar_light.PrintEncodingReport(scint_yield * (gen_radon ? Q_Rn : 1.), quantum_efficiency); // photons from one radon decay, or per MeV
 
 
 
@@ -206,7 +241,12 @@ int main()
   ////////////-------------------MAIN CODE---------------------------///////////
   //////////////////////////////////////////////////////////////////////////////
   
-  gRandom->SetSeed(0);  
+  // All the random numbers come from streams keyed by the run seed (see philox_random.h), positioned for each event
+  // and PMT before its draws
+  unsigned int run_seed = random_seed ? random_seed : std::random_device()();
+  cout << "Random seed: " << run_seed << endl;
+  utility::ThreadRandom* thread_random = new utility::ThreadRandom(gRandom, run_seed);
+  gRandom = thread_random;
 
 
   energy_list.reserve(max_events);
@@ -219,13 +259,14 @@ int main()
   //A loop to deal with each individual event: basically gets the details of the event and puts them into the event_tree
   for(int event = 0; event < max_events; event++)
     {
+      thread_random->SetStream(event, PhiloxRandom::kNoPMT, kEventStream);
 
       // DETERMINE THE ENERGY OF THE EVENT
       double energy;
       if(fixed_energy == true) {energy = fixedE;} 
       if(gen_argon == true) {energy = fSpectrum->GetRandom();} // pull from the Ar beta spectrum (see utility_functions.cc)
       if(supernova == true) {energy = flandau_sn->GetRandom();} // Pull from the predicted SN spectrum (see utility_functions.cc)
-      if(gen_radon == true) {energy = fGauss->Gaus(Q_Rn, 0.05);}// Gaus(av,sigma) - is a ROOT function, pulls from a Gaussian
+      if(gen_radon == true) {energy = gRandom->Gaus(Q_Rn, 0.05);}// Gaus(av,sigma) - is a ROOT function, pulls from a Gaussian
      
 
       // DETERMINE THE POSITION OF THE VOXEL IN  WHICH THE EVENT OCCURRED & THE VOXEL NUMBER 
@@ -234,19 +275,24 @@ int main()
 
       // 3 possible cases: random (x,y,z), fixed x & random (y,z) and fixed (x,y,z) - this choice is made in the header file
       if(random_pos == true) { // choose a random voxel and find its co-ords
-	rand_voxel = gRandom->Uniform(319999); // there are 320000 voxels...
-	lar_light.GetVoxelCoords(rand_voxel, position);
+	rand_voxel = gRandom->Uniform(n_tpcs*lar_light.GetNumberOfGridVoxels() - 1); // 320000 voxels per TPC at full resolution...
+	lar_light.GetVoxelPosition(rand_voxel, position);
       }
       else if(fixed_xpos == true){ // choose a random voxel with a fixed x (drift distance) position.
-	double randomY = ((rand() % 400) - 200)+0.5; // random Y voxel
-	double randomZ = (rand() % 500) + 0.5; // random Z voxel		
+	double randomY = (int(gRandom->Uniform(400)) - 200)+0.5; // random Y voxel
+	double randomZ = int(gRandom->Uniform(500)) + 0.5; // random Z voxel
 	position[0] = fixedX; position[1]= randomY; position[2] = randomZ; // fill the array
+	if(both_tpcs && gRandom->Uniform(1.) < 0.5) {position[0] = -fixedX; } // the same drift distance in the other TPC
 	rand_voxel = lar_light.GetVoxelID(position); // get the ID of the voxel
       }
       else { // fixed_pos == true
 	position[0] = fixedX; position[1]= fixedY; position[2] = fixedZ;
 	rand_voxel = lar_light.GetVoxelID(position);
       }
+      if(rand_voxel < 0) { // GetVoxelID gives -1 outside the library's grid
+	cout << "ERROR: the event position (" << position[0] << ", " << position[1] << ", " << position[2] << ") is outside the photon library" << endl;
+	return 1;
+      }
 
 
       // fill the vectors 
@@ -286,55 +332,99 @@ int main()
   // We will then do all of this for the next event, and then the next event, and so on...
 
 
+  // positions of the events' voxels, worked out once for all events rather than for every PMT
+  vector<double> event_x(voxel_list.size()), event_y(voxel_list.size()), event_z(voxel_list.size());
+  lar_light.GetVoxelPositions(voxel_list.data(), voxel_list.size(), event_x.data(), event_y.data(), event_z.data());
+
+  // The detected photons go into the trees through this, always from the main thread
+  auto fill_photon = [&](const DetectedPhoton& photon) {
+    data_time = photon.time;
+    data_pmt = photon.pmt;
+    data_event = photon.event;
+    data_x_pos = photon.x;
+    data_y_pos = photon.y;
+    data_z_pos = photon.z;
+    if(photon.visible) {
+      data_time_vis = photon.time;
+      data_pmt_vis = photon.pmt;
+      data_event_vis = photon.event;
+      data_x_pos_vis = photon.x;
+      data_y_pos_vis = photon.y;
+      data_tree_vis->Fill();
+    }
+    else {
+      data_time_vuv = photon.time;
+      data_pmt_vuv = photon.pmt;
+      data_event_vuv = photon.event;
+      data_x_pos_vuv = photon.x;
+      data_y_pos_vuv = photon.y;
+      data_tree_vuv->Fill();
+    }
+    data_tree->Fill();
+  };
+
+  // Simulates the events in event_ids (in event order) and collects the photons they leave on the PMTs. With both TPCs
+  // simulated, each TPC's events are run by a thread of their own.
+  auto simulate_events = [&](const vector<int>& event_ids, vector<DetectedPhoton>& photons) {
+  EventHits event_hits;
+  vector<double> scint_times;
+
   //Loop over each PMT for each event
-  for(int events = 0; events < max_events; events++) {
+  for(size_t n = 0; n < event_ids.size(); n++) {
+    int events = event_ids[n];
     cout << "Event: " << events + 1 << endl; //By printing the event number here I can track the progress of the generation
 
-    //Begin looping over the PMT array. SBND plans to implement 60 PMTs,
-    for(int pmt_loop = 0; pmt_loop < 60; pmt_loop++) {
+    // with a tiled library, start reading the tiles of the next batch of events while this one runs
+    if(lar_light.IsTiled() && n % prefetch_events == 0) {
+      vector<int> upcoming;
+      for(size_t k = n; k < min(event_ids.size(), n + 2*prefetch_events); k++) {upcoming.push_back(voxel_list.at(event_ids[k])); }
+      lar_light.PrefetchVoxels(upcoming);
+    }
 
-      int num_pmt = realisticPMT_IDs[pmt_loop]; // gets the pmt number
+    //The photoelectrons on every PMT of the array (the layout's PMTs; SBND plans to implement 60) that can see this
+    //event's voxel are drawn together, from a single number of photons created by the event
+    double event_position[3] = {event_x[events], event_y[events], event_z[events]};
+    thread_random->SetStream(events, PhiloxRandom::kNoPMT, kCountStream);
+    lar_light.CountEventHits(voxel_list.at(events), energy_list.at(events), scint_yield, quantum_efficiency, event_hits);
 
-        // Get the (x,y,z) position of the PMT as we need this to work out transport time
-	double x_pmt = myfile_data.at(num_pmt).at(1);
-	double y_pmt = myfile_data.at(num_pmt).at(2);
-	double z_pmt = myfile_data.at(num_pmt).at(3);
+    //and the scintillation delays of all of them, in one batch
+    int event_photons = 0;
+    for(size_t pmt_loop = 0; pmt_loop < event_hits.channel.size(); pmt_loop++) {event_photons += event_hits.vuv[pmt_loop] + event_hits.visible[pmt_loop]; }
+    thread_random->SetStream(events, PhiloxRandom::kNoPMT, kScintillationStream);
+    scintillation.Sample(event_photons, scint_times, gRandom);
+    size_t next_scint = 0;
+
+    //Begin looping over the PMTs that can see the event
+    for(size_t pmt_loop = 0; pmt_loop < event_hits.channel.size(); pmt_loop++) {
+
+      int num_pmt = event_hits.channel[pmt_loop]; // gets the pmt number
+      int pmt_index = pmt_layout.Index(num_pmt); // and where it is in the layout
+      if(pmt_index < 0) {next_scint += event_hits.vuv[pmt_loop] + event_hits.visible[pmt_loop]; continue; } // not a simulated PMT
 
-	// - This function (defined in library_access.cc) will determine how many VUV and Visble photons hit the given PMT
-	vector<double> pmt_hits = lar_light.PhotonLibraryAnalyzer(energy_list.at(events), scint_yield, quantum_efficiency, num_pmt, voxel_list.at(events));
-	//NB this vector has form: (no of VUV photons, no of visible photons, x position event/photons, y pos of event/photons, z pos of event/photons)
+        // Get the (x,y,z) position of the PMT as we need this to work out transport time
+	double x_pmt = pmt_layout.x[pmt_index];
+	double y_pmt = pmt_layout.y[pmt_index];
+	double z_pmt = pmt_layout.z[pmt_index];
 
-	int num_VUV = pmt_hits.at(0);
-	int num_VIS = pmt_hits.at(1);
+	// - How many VUV and Visble photons hit the given PMT
+	int num_VUV = event_hits.vuv[pmt_loop];
+	int num_VIS = event_hits.visible[pmt_loop];
 
 	//If no photons from this event for this PMT, go to the next event.
 	if(num_VUV+num_VIS == 0) {continue; } // forces the next iteration
 
+	thread_random->SetStream(events, num_pmt, kTimingStream); // this PMT's photon times
+
 
 	// distance to pmt = delta_x^2 + delta_y^2 + delta_z^2
 	double distance_to_pmt =
-	  std::sqrt((pmt_hits.at(2)-x_pmt)*(pmt_hits.at(2)-x_pmt) +
-	 	    (pmt_hits.at(3)-y_pmt)*(pmt_hits.at(3)-y_pmt) +
-	 	    (pmt_hits.at(4)-z_pmt)*(pmt_hits.at(4)-z_pmt));
+	  std::sqrt((event_position[0]-x_pmt)*(event_position[0]-x_pmt) +
+	 	    (event_position[1]-y_pmt)*(event_position[1]-y_pmt) +
+	 	    (event_position[2]-z_pmt)*(event_position[2]-z_pmt));
  
 
 
 
-	data_x_pos = pmt_hits.at(2);
-	data_x_pos_vuv = pmt_hits.at(2);
-	data_x_pos_vis = pmt_hits.at(2);
-
-	data_y_pos = pmt_hits.at(3);
-	data_y_pos_vuv = pmt_hits.at(3);
-	data_y_pos_vis = pmt_hits.at(3);
-
-	data_z_pos = pmt_hits.at(4);
-
-	data_event = events;
-	data_event_vuv = events;
-	data_event_vis = events;
-
-	
 	///*************************** ///
 	///***** TIMING OPERATIONS *** ///
 	///*************************** ///
@@ -344,7 +434,8 @@ int main()
 	// Fill a vector with the transport times of the VUV photons
 	//////////////////////
 	vector<double> transport_time_vuv;
-	if(num_VUV != 0) {transport_time_vuv = utility::GetVUVTime(distance_to_pmt, num_VUV);}
+	if(num_VUV != 0 && fast_timing) {timing_tables.SampleVUV(distance_to_pmt, num_VUV, transport_time_vuv, gRandom);}
+	else if(num_VUV != 0) {transport_time_vuv = utility::GetVUVTime(distance_to_pmt, num_VUV);}
 
 
 	//This statement is to prvent issues when the parameterisation is not well defined
@@ -361,7 +452,7 @@ int main()
   	      // x is the transport time (in NANOSECONDS) - x * 0.001 converts from ns -> micros_s
 	      // the scintillation function timing is also converted to microseconds
 	      // the time window offset is when the decay occured, given already in microseconds	    
-	    total_time_vuv = (x*0.001+(decay_time_list.at(events) + fScintillation_function->GetRandom())*1000000.); // in microseconds 
+	    total_time_vuv = (x*0.001+(decay_time_list.at(events) + scint_times[next_scint++])*1000000.); // in microseconds 
 
 	    //////////////////////////100ns CUT//////////////////////////////////
 	    if(total_time_vuv > time_cut && cut == true){ // 0.1 microseconds = 100 ns! 
@@ -369,14 +460,7 @@ int main()
 	    }
 
 
-	    data_time = total_time_vuv;
-	    data_time_vuv = total_time_vuv;
-
-	    data_pmt = num_pmt;
-	    data_pmt_vuv = num_pmt;
-
-	    data_tree_vuv->Fill();
-	    data_tree->Fill();
+	    photons.push_back({total_time_vuv, num_pmt, events, false, event_position[0], event_position[1], event_position[2]});
 	}//end of looping over the transport time vector
 
 	transport_time_vuv.clear();
@@ -386,22 +470,17 @@ int main()
 	///////////////////////////////
 	vector<double> transport_time_vis;
 	if(num_VIS != 0 && config == 1) { //NOTE config == 1 is cathode foils configuration
-	    transport_time_vis = utility::GetVisibleTimeOnlyCathode(pmt_hits.at(5), num_VIS);
+	    if(fast_timing) {timing_tables.SampleVisibleOnlyCathode(event_hits.reflT0[pmt_loop], num_VIS, transport_time_vis, gRandom);}
+	    else {transport_time_vis = utility::GetVisibleTimeOnlyCathode(event_hits.reflT0[pmt_loop], num_VIS);}
 	    double total_time_vis;
 	    for(auto &y : transport_time_vis) { //looping through the transport_time_vis vector
-		total_time_vis = (y*0.001+(decay_time_list.at(events) + fScintillation_function->GetRandom())*1000000.); // in microseconds
-
-		data_time = total_time_vis; 
-		data_time_vis = total_time_vis;
+		total_time_vis = (y*0.001+(decay_time_list.at(events) + scint_times[next_scint++])*1000000.); // in microseconds
 
 		if(total_time_vis > time_cut && cut == true){ // 0.1 microseconds = 100 ns! 
 		  continue; // go onto the next interation - cut has been made
 		}
-	 
-		data_pmt = num_pmt;
-		data_pmt_vis = num_pmt;
-		data_tree_vis->Fill();
-		data_tree->Fill();
+
+		photons.push_back({total_time_vis, num_pmt, events, true, event_position[0], event_position[1], event_position[2]});
 	    } // end of loop through transport_time_vis vector
 	    transport_time_vis.clear();
 	}
@@ -417,6 +496,49 @@ int main()
 
     //moving onto the next event...
   }//end loop over events
+  };
+
+  // The events are simulated in batches: the two TPCs' events of a batch in parallel when both are simulated, then
+  // their photons are written out in event order. The library is read by both threads at once, which the tiled,
+  // low-rank and analytic libraries (that cache what they read) do not allow.
+  const int batch_events = 1000;
+  bool parallel = both_tpcs && !lar_light.IsTiled() && !lar_light.IsLowRank() && !lar_light.IsAnalytic();
+  if(both_tpcs && !parallel) {cout << "The tiled, low-rank and analytic libraries are not thread safe, simulating the TPCs one after the other" << endl; }
+  if(parallel) {
+    ROOT::EnableThreadSafety();
+  }
+  for(int first = 0; first < max_events; first += batch_events) {
+    vector<int> tpc_events[2];
+    for(int events = first; events < min(max_events, first + batch_events); events++) {
+      tpc_events[voxel_list.at(events) >= lar_light.GetNumberOfGridVoxels()].push_back(events); // IDs past the grid are in the second TPC
+    }
+
+    vector<DetectedPhoton> tpc_photons[2];
+    if(parallel) {
+      vector<thread> workers;
+      for(int tpc = 0; tpc < 2; tpc++) {
+        workers.push_back(thread([&, tpc]() {
+          thread_random->StartThread();
+          simulate_events(tpc_events[tpc], tpc_photons[tpc]);
+          utility::ThreadRandom::EndThread();
+        }));
+      }
+      for(auto& worker: workers) {worker.join(); }
+    }
+    else {
+      for(int tpc = 0; tpc < 2; tpc++) {simulate_events(tpc_events[tpc], tpc_photons[tpc]); }
+    }
+
+    // merge the two TPCs' photons back into event order
+    size_t i0 = 0, i1 = 0;
+    while(i0 < tpc_photons[0].size() || i1 < tpc_photons[1].size()) {
+      bool from_tpc0 = i1 == tpc_photons[1].size() || (i0 < tpc_photons[0].size() && tpc_photons[0][i0].event <= tpc_photons[1][i1].event);
+      fill_photon(from_tpc0 ? tpc_photons[0][i0++] : tpc_photons[1][i1++]);
+    }
+  }
+  gRandom = thread_random->Parent();
+  delete thread_random;
+  lar_light.PrintTileReport();
 
 
   energy_list.clear();
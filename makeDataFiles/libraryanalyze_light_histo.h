@@ -43,10 +43,24 @@ bool gen_radon = true;
 bool random_pos = true;
 bool fixed_xpos = false; 
 bool fixed_pos = false;
-double fixedX = 100; // cm (x = 0 at cathode, x = 200 at PMTs)
+// Simulate the whole detector: events in both TPCs (x < 0 is the second), seen by the PMT planes on both sides. The
+// second TPC is looked up in the same library through the cathode plane, and the two TPCs are simulated in parallel.
+const bool both_tpcs = false;
+const int n_tpcs = both_tpcs ? 2 : 1;
+double fixedX = 100; // cm (x = 0 at cathode, x = 200 at PMTs; negative in the second TPC)
 double fixedY = 0; // cm (y = -200 bottom of TPC, y = 200 top of TPC)
 double fixedZ = 250; // cm (z = 0 front of TPC, x = 500 end of TPC)
 ///-------------------------------------
+//--------random numbers-------------
+///-------------------------------------
+// Every random number is drawn from a stream keyed by this seed and the event (and PMT) it is for, so the same seed
+// gives the same events and photons whatever the threads or how the events are split up. 0 = a new seed each run
+// (printed at the start, put it here to repeat the run).
+const unsigned int random_seed = 0;
+// The streams: generating the events, counting their photoelectrons, the photon times of each PMT, and the
+// scintillation delays of each event's photons
+enum RandomStream { kEventStream = 0, kCountStream = 1, kTimingStream = 2, kScintillationStream = 3 };
+///-------------------------------------
 //--------time cut?-------------
 ///-------------------------------------
 bool cut = false; // NB you can always make time cuts when you're analysing the files - so I tend not to use this
@@ -61,6 +75,44 @@ double time_cut = 0.1; // in microseconds - 0.1 mu_s = 100 ns
 ///1 = Cath Foils
 ///2 = VUV only
 const int config = 1; // cathode foils is the most likely candidate
+// Take the configuration from the combined store made by make_library_store instead of its own library file
+const bool use_library_store = false;
+//--------------------------------------
+// How the library is held in memory: kEncodingFloat32 (exact), kEncodingHalf or kEncodingLog16 (half the memory,
+// a report of the errors this introduces is printed at startup)
+const LibraryEncoding library_encoding = kEncodingFloat32;
+// Where the library lives in memory on multi-socket/large-memory nodes: kPlacementDefault, kPlacementInterleave,
+// kPlacementReplicate (one copy per NUMA node) or kPlacementHugePages; benchmark_library_placement compares them
+const MemoryPlacement library_placement = kPlacementDefault;
+// Share one copy of the library between all instances running on this machine (POSIX shared memory)
+const bool shared_library = false;
+// Keep only the library entries above this visibility (negative = keep the full table); PMTs that cannot see an
+// event's voxel are then skipped altogether
+const float sparse_threshold = -1;
+// Store the library for y < 0 only and look y > 0 up through the mirror image: kNoSymmetry, kDetectSymmetry (fold
+// only if the library is symmetric to within symmetry_tolerance) or kDeclaredSymmetry
+const SymmetryMode library_symmetry = kNoSymmetry;
+const double symmetry_tolerance = 0.05;
+// Memory for the library in MB, 0 = load it all. Otherwise the library cache is read from disk in tiles of
+// tile_z_layers z layers as events need them (fixed_pos runs only ever touch one tile), and the tiles of the
+// next prefetch_events events are requested ahead of time
+const double library_memory_MB = 0;
+const int tile_z_layers = 1;
+const int prefetch_events = 100;
+// Resolution of the library: 0 = full (5 cm voxels), 1 and 2 = 2x and 4x coarser, for quick approximate sweeps.
+// Event positions are then drawn on the coarse grid.
+const int resolution_level = 0;
+// Use no library at all: visibilities from the analytic model (solid angle and attenuation of each PMT), with the
+// corrections fitted by fit_analytic_visibility against a library read from analytic_correction.txt
+const bool analytic_visibility = false;
+// The PMTs to simulate, a file with one line per PMT: channel x y z [type]. Give another layout file as the first
+// argument of ./libraryanalyze_light_histo to try other arrays (e.g. 120 PMTs or staggered grids) without recompiling;
+// posPMTs_setup1.txt is the layout of every PMT in the library.
+const std::string default_pmt_layout = "pmt_layout_realistic.txt";
+// Sample the photon transport times from inverse-CDF tables of the timing parametrizations (built once, in a few
+// seconds, and kept in timing_table_file) rather than from the parametrizations' TF1s, rebuilt for every PMT of every event
+const bool fast_timing = true;
+const std::string timing_table_file = "timing_tables.bin";
 //--------------------------------------
 //--------------------------------------
 //--------------------------------------
@@ -80,6 +132,8 @@ TTree *data_tree_vuv = new TTree("data_tree_vuv", "data tree_vuv");
 TTree *data_tree_vis = new TTree("data_tree_vis", "data tree_vis");
 
 TTree *event_tree = new TTree("event_tree", "event tree");
+// the PMTs simulated (the layout, with the mirror channels of the other TPC with both_tpcs), for the analysis
+TTree *pmt_tree = new TTree("pmt_tree", "pmt tree");
 double data_time;
 double data_time_vuv;
 double data_time_vis;
@@ -92,6 +146,17 @@ int data_event;
 int data_event_vuv;
 int data_event_vis;
 
+// A detected photon, held until it is written to the data trees
+struct DetectedPhoton{
+  double time;
+  int pmt;
+  int event;
+  bool visible;
+  double x;
+  double y;
+  double z;
+};
+
 double data_x_pos;
 double data_x_pos_vuv;
 double data_x_pos_vis;
@@ -102,6 +167,12 @@ double data_y_pos_vis;
 
 double data_z_pos;
 
+int pmt_channel;
+int pmt_type;
+double pmt_x_pos;
+double pmt_y_pos;
+double pmt_z_pos;
+
 int event_no;
 int event_vox;
 double event_x_pos;
@@ -118,6 +189,7 @@ const double Q_Ar = 0.565;//Q value of decay - Ar39
 const double t_singlet = 0.000000006; //6ns
 const double t_triplet = 0.0000015; //1.5 us
 const double scint_time_window = 0.00001; //10 us
+const double drift_field = 500.; // V/cm, sets the fraction of the scintillation in the singlet (see scintillation_sampler.h)
 
 const int scint_yield_electron = 24000;//Scintillation yield of LAr at 500 V/cm
 const double activity_Ar = 1.; //Ar39 roughly 1 Bq/k
@@ -152,13 +224,13 @@ const int max_events_FE = 1;
 
 // Ar-39 events:
 //const int max_events_Ar = 10;
-const int max_events_Ar = activity_Ar * mass/2 * time_window;//Half volume for 1 TPC
-const int Ar_decays_per_sec = activity_Ar* mass/2; // decay rate in one TPC
+const int max_events_Ar = activity_Ar * mass/2 * n_tpcs * time_window;//Half volume per TPC
+const int Ar_decays_per_sec = activity_Ar* mass/2 * n_tpcs; // decay rate in the TPCs simulated
 
 // Radon events:
 const int max_events_Rn = 10;
-//const int max_events_Rn = activity_Rn * mass/2 * time_window;//Half volume for 1 (NOTE: for a small time window, this will probably return 0)
-const double Rn_decays_per_sec = activity_Rn* mass/2; // decay rate in one TPC
+//const int max_events_Rn = activity_Rn * mass/2 * n_tpcs * time_window;//Half volume per TPC (NOTE: for a small time window, this will probably return 0)
+const double Rn_decays_per_sec = activity_Rn* mass/2 * n_tpcs; // decay rate in the TPCs simulated
 
 // Supernova events:
 const int max_events_SN = 10000;
@@ -168,7 +240,12 @@ const int max_events_SN = 10000;
 
 
 // Don't worry about the stuff below too much...
-vector<vector<double>> myfile_data;
+//--------------------------------------
+//--------------------------------------
+//--PMTs: every PMT in the library and--
+//--the layout being simulated----------
+PMTLayout pmt_geometry;
+PMTLayout pmt_layout;
 //--------------------------------------
 //--------------------------------------
 //---Of type LibraryAccess-------------
@@ -181,11 +258,6 @@ vector<double> decay_time_list;
 vector<int> voxel_list;
 //--------------------------------------
 //--------------------------------------
-//--Predefined number of PMTs for-------
-//--SBND configuration------------------
-int realisticPMT_IDs[60] = {0, 4, 8, 12, 16, 20, 24, 32, 40, 44, 48, 52, 56, 60, 64, 88, 92, 96, 100, 104, 108, 112, 120, 128, 132, 136, 140, 144, 148, 152, 154, 158, 162, 166, 170, 174, 178, 186, 194, 198, 202, 206, 210, 214, 218, 242, 246, 250, 254, 258, 262, 266, 274, 282, 286, 290, 294, 298, 302, 306};
-//--------------------------------------
-//--------------------------------------
 //--For timing parameterization---------
 const double signal_t_range = 1000.;
 
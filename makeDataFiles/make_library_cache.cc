@@ -0,0 +1,56 @@
+#include <iostream>
+#include <string>
+
+#include "library_access.h"
+
+using namespace std;
+
+//One-off converter from a Lib154PMTs8inch_*.root photon library to the native
+//.plib cache that LibraryAccess::LoadLibraryFromFile maps at startup.
+//All three planes are stored if the library has them; whether the reflected
+//light is used is still decided by the simulation's config when loading.
+//The coarser resolution levels 1 and 2 are written alongside (_L1, _L2).
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      cout << "Usage: ./make_library_cache <library.root> [output.plib]" << endl;
+      return 1;
+    }
+
+  string libraryfile = argv[1];
+  string cachefile = (argc > 2) ? argv[2] : LibraryAccess::CacheFileName(libraryfile);
+
+  LibraryAccess library;
+  library.LoadLibraryFromRootFile(libraryfile, true, true);
+
+  cout << "Writing library cache: " << cachefile << endl;
+  if(!library.WriteLibraryCache(cachefile)) {return 1; }
+
+  // read it back the way the simulation will, and check the payload made it to disk intact
+  LibraryAccess check;
+  if(!check.LoadLibraryFromCache(cachefile, true, true) || !check.VerifyLibraryCache())
+    {
+      cout << "Library cache failed verification: " << cachefile << endl;
+      return 1;
+    }
+  cout << "Library cache verified." << endl;
+
+  for(int level = 1; level <= 2; level++)
+    {
+      string levelfile = LibraryAccess::CacheFileName(cachefile, level);
+      library.DownsampleTable(level);
+      cout << "Writing resolution level " << level << ": " << levelfile << endl;
+      LibraryAccess check_level;
+      check_level.SetResolutionLevel(level);
+      if(!library.WriteLibraryCache(levelfile) || !check_level.LoadLibraryFromCache(levelfile, true, true) || !check_level.VerifyLibraryCache())
+	{
+	  cout << "Library cache failed verification: " << levelfile << endl;
+	  return 1;
+	}
+      // back to full resolution for the next level
+      library.LoadLibraryFromCache(cachefile, true, true);
+    }
+
+  return 0;
+}
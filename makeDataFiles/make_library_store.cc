@@ -0,0 +1,36 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "library_access.h"
+
+using namespace std;
+
+//Combines the foil configurations of the SBND library into one store
+//(.plms) holding the direct visibility once and the reflected light of each
+//configuration. The libraries (.root, or their .plib caches) are stored in
+//the order given, which is the configuration number used to select them;
+//by default the order of config in libraryanalyze_light_histo.h.
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      cout << "Usage: ./make_library_store <output.plms> [library.root ...]" << endl;
+      return 1;
+    }
+
+  string storefile = argv[1];
+  vector<string> libraryfiles(argv + 2, argv + argc);
+  if(libraryfiles.empty())
+    {
+      libraryfiles.push_back("Lib154PMTs8inch_FullFoilsTPB.root");
+      libraryfiles.push_back("Lib154PMTs8inch_OnlyCathodeTPB.root");
+      libraryfiles.push_back("Lib154PMTs8inch_NoCathodeNoFoils.root");
+    }
+
+  // direct visibilities are compared to float precision
+  if(!LibraryAccess::WriteLibraryStore(storefile, libraryfiles, 1e-6)) {return 1; }
+  cout << "Written library store: " << storefile << endl;
+
+  return 0;
+}
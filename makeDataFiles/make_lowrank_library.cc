@@ -0,0 +1,34 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "library_access.h"
+
+using namespace std;
+
+//Builds the low-rank (.plr) version of a photon library: each plane is
+//replaced by its largest principal components over the channels, and the
+//reconstruction error of every channel is printed. Point libraryfile in
+//libraryanalyze_light_histo.cc at the .plr file to use it.
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+    {
+      cout << "Usage: ./make_lowrank_library <library.root|library.plib> [rank (default 20)] [output.plr]" << endl;
+      return 1;
+    }
+
+  string libraryfile = argv[1];
+  int rank = (argc > 2) ? atoi(argv[2]) : 20;
+  string lowrankfile = libraryfile.substr(0, libraryfile.find_last_of('.')) + ".plr";
+  if(argc > 3) {lowrankfile = argv[3]; }
+
+  LibraryAccess library;
+  library.LoadLibraryFromFile(libraryfile, true, true);
+
+  cout << "Factorizing the library with rank " << rank << endl;
+  if(!library.WriteLowRankLibrary(lowrankfile, rank)) {return 1; }
+  cout << "Written low-rank library: " << lowrankfile << endl;
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "library_access.h"
+#include "photon_library_generator.h"
+
+using namespace std;
+
+//Generates a photon library with the toy optical Monte Carlo, for PMT
+//layouts (from a posPMTs_setup1.txt style file) and foil configurations
+//there is no library for, or checks the Monte Carlo against an existing
+//library on a sample of voxels. Point libraryfile in
+//libraryanalyze_light_histo.cc at the output to use it.
+int main(int argc, char* argv[])
+{
+  bool validate = argc > 1 && string(argv[1]) == "--validate";
+  int first = validate ? 2 : 1;
+  if(argc <= first)
+    {
+      cout << "Usage: ./make_photon_library <output.root> [config (default 1)] [photons per voxel (default 10000)] [threads (default all)] [PMT layout (default posPMTs_setup1.txt)]" << endl;
+      cout << "       ./make_photon_library --validate <library.root|library.plib> [config (default 1)] [photons per voxel (default 10000)] [voxels (default 200)] [PMT layout]" << endl;
+      cout << "config: 0 = full foils, 1 = cathode foils, 2 = VUV only" << endl;
+      return 1;
+    }
+
+  string file = argv[first];
+  int config = (argc > first + 1) ? atoi(argv[first + 1]) : 1;
+  int photons = (argc > first + 2) ? atoi(argv[first + 2]) : 10000;
+  int count = (argc > first + 3) ? atoi(argv[first + 3]) : (validate ? 200 : 0);
+  string pmtfile = (argc > first + 4) ? argv[first + 4] : "posPMTs_setup1.txt";
+
+  PMTLayout pmts;
+  if(!pmts.Load(pmtfile)) {return 1; }
+
+  LibraryAccess library;
+  if(validate) {library.LoadLibraryFromFile(file, true, true); }
+
+  PhotonLibraryGenerator generator(library.GetLevelGrid(), pmts, config);
+  generator.SetPhotonsPerVoxel(photons);
+  if(validate)
+    {
+      generator.Validate(library, count);
+      return 0;
+    }
+  generator.SetThreads(count);
+  return generator.Generate(file) ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#ifndef PHILOX_RANDOM_H
+#define PHILOX_RANDOM_H
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include "TRandom.h"
+
+//Counter-based random numbers (Philox4x32-10, Salmon et al., "Parallel
+//random numbers: as easy as 1, 2, 3", SC11). Every number is a function of
+//the run seed and of its position: the stream it belongs to, the event and
+//PMT it is drawn for, and its index within them. Positioning the generator
+//with SetStream before an event's (or a PMT's) draws therefore makes them
+//the same whichever thread or job simulates the event, and in whatever order.
+class PhiloxRandom : public TRandom {
+
+  public:
+    //PMT of SetStream for draws that belong to the whole event
+    static const uint32_t kNoPMT = 0xFFFFFFFFu;
+
+    explicit PhiloxRandom(uint32_t seed = 0) : seed_(seed) { SetStream(0, kNoPMT, 0); }
+
+    void SetRunSeed(uint32_t seed) { seed_ = seed; SetStream(0, kNoPMT, 0); }
+    uint32_t GetRunSeed() const { return seed_; }
+
+    //Moves to the start of the numbers of (event, pmt, stream)
+    void SetStream(uint64_t event, uint32_t pmt, uint32_t stream)
+    {
+      key_[0] = seed_;
+      key_[1] = stream;
+      counter_[0] = 0;
+      counter_[1] = pmt;
+      counter_[2] = uint32_t(event);
+      counter_[3] = uint32_t(event >> 32);
+      used_ = 4;
+    }
+
+    //Uniform in (0, 1), 32 bit resolution like TRandom3
+    Double_t Rndm() override
+    {
+      if(used_ == 4) {NextBlock(block_); used_ = 0; }
+      return ToUniform(block_[used_++]);
+    }
+    void RndmArray(Int_t n, Float_t* array) override
+    {
+      for(Int_t i = 0; i < n; i++) {array[i] = Rndm(); }
+    }
+    void RndmArray(Int_t n, Double_t* array) override { Uniforms(n, array); }
+
+    //Batches, drawn kBatchBlocks blocks at a time with their rounds
+    //interleaved so the multiplications pipeline. They carry on in the
+    //stream from the blocks already used; numbers left over in a block are
+    //not used.
+    void Uniforms(int n, double* out)
+    {
+      uint32_t blocks[4][kBatchBlocks];
+      int i = 0;
+      while(i < n)
+      {
+        Blocks(counter_, key_, blocks);
+        counter_[0] += kBatchBlocks;
+        int m = std::min(n - i, 4*kBatchBlocks);
+        for(int k = 0; k < m; k++) {out[i + k] = ToUniform(blocks[k & 3][k >> 2]); }
+        i += m;
+      }
+      used_ = 4;
+    }
+    void Exponentials(int n, double* out, double tau)
+    {
+      Uniforms(n, out);
+      for(int i = 0; i < n; i++) {out[i] = -tau * std::log(out[i]); }
+    }
+    //Box-Muller, two Gaussians from each pair of uniforms
+    void Gaussians(int n, double* out, double mean, double sigma)
+    {
+      scratch_.resize(n + (n & 1));
+      Uniforms(scratch_.size(), scratch_.data());
+      const double* u = scratch_.data();
+      for(int i = 0; i < n; i += 2)
+      {
+        double r = sigma * std::sqrt(-2 * std::log(u[i]));
+        double phi = 2 * M_PI * u[i + 1];
+        out[i] = mean + r * std::cos(phi);
+        if(i + 1 < n) {out[i + 1] = mean + r * std::sin(phi); }
+      }
+    }
+
+    //One Philox4x32-10 block: ten rounds of the counter under the key
+    static void Block(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+    {
+      uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+      uint32_t k0 = key[0], k1 = key[1];
+      for(int round = 0; round < 10; round++)
+      {
+        uint64_t p0 = uint64_t(0xD2511F53u) * c0;
+        uint64_t p1 = uint64_t(0xCD9E8D57u) * c2;
+        uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+        c1 = uint32_t(p1);
+        c3 = uint32_t(p0);
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+      }
+      out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+  private:
+    static const int kBatchBlocks = 8;
+
+    static double ToUniform(uint32_t x) { return (x + 0.5) * (1. / 4294967296.); }
+
+    //kBatchBlocks consecutive blocks from counter, out[word][block]
+    static void Blocks(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4][kBatchBlocks])
+    {
+      uint32_t c0[kBatchBlocks], c1[kBatchBlocks], c2[kBatchBlocks], c3[kBatchBlocks];
+      for(int b = 0; b < kBatchBlocks; b++)
+      {
+        c0[b] = counter[0] + b; c1[b] = counter[1]; c2[b] = counter[2]; c3[b] = counter[3];
+      }
+      uint32_t k0 = key[0], k1 = key[1];
+      for(int round = 0; round < 10; round++)
+      {
+        for(int b = 0; b < kBatchBlocks; b++)
+        {
+          uint64_t p0 = uint64_t(0xD2511F53u) * c0[b];
+          uint64_t p1 = uint64_t(0xCD9E8D57u) * c2[b];
+          uint32_t n0 = uint32_t(p1 >> 32) ^ c1[b] ^ k0;
+          uint32_t n2 = uint32_t(p0 >> 32) ^ c3[b] ^ k1;
+          c1[b] = uint32_t(p1);
+          c3[b] = uint32_t(p0);
+          c0[b] = n0;
+          c2[b] = n2;
+        }
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+      }
+      for(int b = 0; b < kBatchBlocks; b++)
+      {
+        out[0][b] = c0[b]; out[1][b] = c1[b]; out[2][b] = c2[b]; out[3][b] = c3[b];
+      }
+    }
+
+    void NextBlock(uint32_t out[4])
+    {
+      Block(counter_, key_, out);
+      counter_[0]++;
+    }
+
+    uint32_t seed_;
+    uint32_t key_[2];
+    uint32_t counter_[4];
+    uint32_t block_[4];
+    int used_;
+    std::vector<double> scratch_;
+};
+
+#endif
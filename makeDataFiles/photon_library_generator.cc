@@ -0,0 +1,486 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include "TRandom3.h"
+#include "TMath.h"
+
+#include "photon_library_generator.h"
+#include "library_access.h"
+
+using namespace std;
+
+namespace {
+
+	const char kCheckpointMagic[8] = {'S','B','N','D','G','E','N','2'};
+
+	//Optical properties, approximate
+	const double kVUVRayleigh = 60.;          //cm
+	const double kVUVAbsorption = 2000.;      //cm
+	const double kVUVSpeed = 29.98/1.36;      //cm/ns
+	const double kVisibleRayleigh = 500.;     //cm
+	const double kVisibleAbsorption = 2000.;  //cm
+	const double kVisibleSpeed = 29.98/1.23;  //cm/ns
+	const double kTPBEfficiency = 0.5;        //visible photons per VUV photon on a foil
+	const double kFoilReflectivity = 0.95;    //for visible light
+	const double kPMTRadius = 10.16;          //cm, 8" PMTs
+	const int kMaxInteractions = 1000;
+
+	//FNV-1a, continuing from h
+	uint64_t Checksum(uint64_t h, const void* data, size_t bytes)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for(size_t i = 0; i < bytes; i++) {h = (h ^ p[i]) * 1099511628211ULL; }
+		return h;
+	}
+
+	//Walls: 2*axis for the lower side, 2*axis + 1 for the upper one
+	const int kCathode = 0;
+	const int kPMTPlane = 1;
+
+	void IsotropicDirection(TRandom3& rng, double direction[3])
+	{
+		double cos_theta = 2*rng.Rndm() - 1;
+		double sin_theta = sqrt(std::max(0., 1 - cos_theta*cos_theta));
+		double phi = 2*TMath::Pi()*rng.Rndm();
+		direction[0] = sin_theta*cos(phi);
+		direction[1] = sin_theta*sin(phi);
+		direction[2] = cos_theta;
+	}
+
+	//Turns direction by the angle theta (cosine cos_theta) about a random axis
+	void Deflect(TRandom3& rng, double cos_theta, double direction[3])
+	{
+		double sin_theta = sqrt(std::max(0., 1 - cos_theta*cos_theta));
+		double phi = 2*TMath::Pi()*rng.Rndm();
+		//an orthonormal pair perpendicular to direction
+		double u[3], v[3];
+		if(fabs(direction[2]) < 0.9) {u[0] = -direction[1]; u[1] = direction[0]; u[2] = 0; }
+		else {u[0] = 0; u[1] = -direction[2]; u[2] = direction[1]; }
+		double norm = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+		for(int i = 0; i < 3; i++) {u[i] /= norm; }
+		v[0] = direction[1]*u[2] - direction[2]*u[1];
+		v[1] = direction[2]*u[0] - direction[0]*u[2];
+		v[2] = direction[0]*u[1] - direction[1]*u[0];
+		for(int i = 0; i < 3; i++) {direction[i] = cos_theta*direction[i] + sin_theta*(cos(phi)*u[i] + sin(phi)*v[i]); }
+	}
+
+	//Rayleigh phase function, 1 + cos^2
+	double RayleighCosine(TRandom3& rng)
+	{
+		while(true)
+		{
+			double c = 2*rng.Rndm() - 1;
+			if(2*rng.Rndm() < 1 + c*c) {return c; }
+		}
+	}
+
+	//Diffuse (Lambertian) emission from a wall, into the box
+	void LambertianDirection(TRandom3& rng, int wall, double direction[3])
+	{
+		int axis = wall/2;
+		double cos_theta = sqrt(rng.Rndm());
+		double normal[3] = {0, 0, 0};
+		normal[axis] = (wall % 2) ? -1 : 1;
+		for(int i = 0; i < 3; i++) {direction[i] = normal[i]; }
+		Deflect(rng, cos_theta, direction);
+	}
+}
+
+PhotonLibraryGenerator::PhotonLibraryGenerator(const VoxelGrid<>& grid, const PMTLayout& pmts, int config)
+	: grid_(grid),
+	config_(config),
+	photons_(10000),
+	nthreads_(0),
+	seed_(1),
+	slab_layers_(1),
+	nchannels_(0)
+{
+	double pmt_plane = grid.Upper()[0];
+	for(size_t i = 0; i < pmts.size(); i++)
+	{
+		if(pmts.x[i] <= 0) {continue; } //the other TPC's
+		pmt_channel_.push_back(pmts.channel[i]);
+		pmt_y_.push_back(pmts.y[i]);
+		pmt_z_.push_back(pmts.z[i]);
+		pmt_plane = std::max(pmt_plane, double(pmts.x[i]));
+		nchannels_ = std::max(nchannels_, pmts.channel[i] + 1);
+	}
+	box_lower_[0] = 0;
+	box_upper_[0] = pmt_plane;
+	for(int i = 1; i < 3; i++)
+	{
+		box_lower_[i] = grid.Lower()[i];
+		box_upper_[i] = grid.Upper()[i];
+	}
+}
+
+bool PhotonLibraryGenerator::HasFoil(int wall) const
+{
+	if(config_ == 0) {return wall != kPMTPlane; }
+	if(config_ == 1) {return wall == kCathode; }
+	return false;
+}
+
+//The PMT whose disc contains (y, z) on the PMT plane, -1 if none
+int PhotonLibraryGenerator::FindPMT(double y, double z) const
+{
+	for(size_t i = 0; i < pmt_channel_.size(); i++)
+	{
+		double dy = y - pmt_y_[i];
+		double dz = z - pmt_z_[i];
+		if(dy*dy + dz*dz < kPMTRadius*kPMTRadius) {return i; }
+	}
+	return -1;
+}
+
+void PhotonLibraryGenerator::TrackPhoton(Photon& photon, TRandom3& rng, std::vector<double>& hits, std::vector<double>& refl_hits, std::vector<float>& tfirst) const
+{
+	double* position = photon.position;
+	double* direction = photon.direction;
+	double absorption = -kVUVAbsorption*log(1 - rng.Rndm());
+
+	for(int n = 0; n < kMaxInteractions; n++)
+	{
+		double rayleigh = photon.visible ? kVisibleRayleigh : kVUVRayleigh;
+		double speed = photon.visible ? kVisibleSpeed : kVUVSpeed;
+		double scatter = -rayleigh*log(1 - rng.Rndm());
+
+		//the wall the photon is heading for
+		double to_wall = 1e30;
+		int wall = -1;
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(direction[axis] == 0) {continue; }
+			bool upper = direction[axis] > 0;
+			double t = ((upper ? box_upper_[axis] : box_lower_[axis]) - position[axis])/direction[axis];
+			if(t < to_wall) {to_wall = t; wall = 2*axis + upper; }
+		}
+
+		double step = std::min(scatter, to_wall);
+		if(absorption <= step) {return; }
+		absorption -= step;
+		for(int i = 0; i < 3; i++) {position[i] += step*direction[i]; }
+		photon.time += step/speed;
+
+		if(scatter < to_wall)
+		{
+			Deflect(rng, RayleighCosine(rng), direction);
+			continue;
+		}
+
+		if(wall == kPMTPlane)
+		{
+			int pmt = FindPMT(position[1], position[2]);
+			if(pmt < 0) {return; }
+			int channel = pmt_channel_[pmt];
+			if(!photon.visible) {hits[channel]++; return; }
+			refl_hits[channel]++;
+			tfirst[channel] = std::min(tfirst[channel], float(photon.time));
+			return;
+		}
+		if(!HasFoil(wall)) {return; }
+		if(!photon.visible)
+		{
+			if(rng.Rndm() >= kTPBEfficiency) {return; }
+			photon.visible = true;
+			absorption = -kVisibleAbsorption*log(1 - rng.Rndm());
+		}
+		else if(rng.Rndm() >= kFoilReflectivity) {return; }
+		LambertianDirection(rng, wall, direction);
+	}
+}
+
+void PhotonLibraryGenerator::SimulateVoxel(int voxel, TRandom3& rng, std::vector<double>& hits, std::vector<double>& refl_hits, std::vector<float>& tfirst, std::vector<GeneratedLibraryEntry>& entries) const
+{
+	//a stream of its own for every voxel (0 would ask ROOT for a random seed)
+	uint32_t seed = seed_*2654435761u + uint32_t(voxel)*40503u + 1;
+	rng.SetSeed(seed ? seed : 1);
+	std::fill(hits.begin(), hits.end(), 0);
+	std::fill(refl_hits.begin(), refl_hits.end(), 0);
+	std::fill(tfirst.begin(), tfirst.end(), 1e30f);
+
+	int ix, iy, iz;
+	grid_.Coords(voxel, ix, iy, iz);
+	double size[3], corner[3];
+	int steps[3] = {grid_.nx(), grid_.ny(), grid_.nz()};
+	int coords[3] = {ix, iy, iz};
+	for(int i = 0; i < 3; i++)
+	{
+		size[i] = (grid_.Upper()[i] - grid_.Lower()[i])/steps[i];
+		corner[i] = grid_.Lower()[i] + coords[i]*size[i];
+	}
+
+	for(int n = 0; n < photons_; n++)
+	{
+		Photon photon;
+		for(int i = 0; i < 3; i++) {photon.position[i] = corner[i] + size[i]*rng.Rndm(); }
+		IsotropicDirection(rng, photon.direction);
+		photon.time = 0;
+		photon.visible = false;
+		TrackPhoton(photon, rng, hits, refl_hits, tfirst);
+	}
+
+	for(size_t i = 0; i < pmt_channel_.size(); i++)
+	{
+		int channel = pmt_channel_[i];
+		if(hits[channel] == 0 && refl_hits[channel] == 0) {continue; }
+		GeneratedLibraryEntry entry;
+		entry.voxel = voxel;
+		entry.channel = channel;
+		entry.vis = hits[channel]/photons_;
+		entry.refl = refl_hits[channel]/photons_;
+		entry.reflT = (refl_hits[channel] > 0) ? tfirst[channel] : 0;
+		entries.push_back(entry);
+	}
+}
+
+void PhotonLibraryGenerator::SimulateVoxels(const std::vector<int>& voxels, std::vector<GeneratedLibraryEntry>& entries) const
+{
+	int nthreads = (nthreads_ > 0) ? nthreads_ : std::max(1u, std::thread::hardware_concurrency());
+	nthreads = std::max(1, std::min(nthreads, int(voxels.size())));
+
+	std::vector<std::vector<GeneratedLibraryEntry> > thread_entries(nthreads);
+	std::atomic<size_t> next_voxel(0);
+	std::vector<std::thread> workers;
+	for(int t = 0; t < nthreads; t++)
+	{
+		workers.push_back(std::thread([&, t]()
+		{
+			TRandom3 rng;
+			std::vector<double> hits(nchannels_), refl_hits(nchannels_);
+			std::vector<float> tfirst(nchannels_);
+			for(size_t i = next_voxel++; i < voxels.size(); i = next_voxel++)
+			{
+				SimulateVoxel(voxels[i], rng, hits, refl_hits, tfirst, thread_entries[t]);
+			}
+		}));
+	}
+	for(int t = 0; t < nthreads; t++) {workers[t].join(); }
+
+	for(int t = 0; t < nthreads; t++)
+	{
+		entries.insert(entries.end(), thread_entries[t].begin(), thread_entries[t].end());
+		std::vector<GeneratedLibraryEntry>().swap(thread_entries[t]);
+	}
+	std::sort(entries.begin(), entries.end(), [](const GeneratedLibraryEntry& a, const GeneratedLibraryEntry& b)
+	{ return (a.voxel != b.voxel) ? a.voxel < b.voxel : a.channel < b.channel; });
+}
+
+uint64_t PhotonLibraryGenerator::GeometryChecksum() const
+{
+	int32_t steps[3] = {grid_.nx(), grid_.ny(), grid_.nz()};
+	uint64_t h = 14695981039346656037ULL;
+	h = Checksum(h, steps, sizeof(steps));
+	h = Checksum(h, grid_.Lower(), 3*sizeof(double));
+	h = Checksum(h, grid_.Upper(), 3*sizeof(double));
+	if(!pmt_channel_.empty())
+	{
+		h = Checksum(h, &pmt_channel_[0], pmt_channel_.size()*sizeof(int));
+		h = Checksum(h, &pmt_y_[0], pmt_y_.size()*sizeof(double));
+		h = Checksum(h, &pmt_z_[0], pmt_z_.size()*sizeof(double));
+	}
+	return Checksum(h, box_upper_, sizeof(box_upper_));
+}
+
+std::string PhotonLibraryGenerator::CheckpointName(const std::string& outputfile, int slab) const
+{
+	std::string base = outputfile.substr(0, outputfile.find_last_of('.'));
+	char name[32];
+	snprintf(name, sizeof(name), "_slab%04d.ckpt", slab);
+	return base + name;
+}
+
+//A checkpoint is only used if it was made with the same settings, grid and
+//PMTs
+bool PhotonLibraryGenerator::ReadCheckpoint(const std::string& name, int first_voxel, int last_voxel, std::vector<GeneratedLibraryEntry>& entries) const
+{
+	ifstream in(name.c_str(), ios::binary);
+	GeneratorCheckpointHeader header;
+	if(!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {return false; }
+	if(memcmp(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic)) != 0 || header.first_voxel != first_voxel || header.last_voxel != last_voxel ||
+	   header.photons != photons_ || header.config != config_ || header.seed != seed_)
+	{
+		cout << "Ignoring checkpoint " << name << ", it was made with other settings" << endl;
+		return false;
+	}
+	if(header.geometry != GeometryChecksum())
+	{
+		cout << "Ignoring checkpoint " << name << ", it was made for another PMT layout or voxel grid" << endl;
+		return false;
+	}
+	entries.resize(header.nentries);
+	if(header.nentries > 0 && !in.read(reinterpret_cast<char*>(&entries[0]), entries.size()*sizeof(GeneratedLibraryEntry)))
+	{
+		cout << "Ignoring truncated checkpoint " << name << endl;
+		entries.clear();
+		return false;
+	}
+	return true;
+}
+
+//Written under a temporary name and renamed, so a checkpoint is either
+//complete or absent
+bool PhotonLibraryGenerator::WriteCheckpoint(const std::string& name, int first_voxel, int last_voxel, const std::vector<GeneratedLibraryEntry>& entries) const
+{
+	GeneratorCheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic));
+	header.first_voxel = first_voxel;
+	header.last_voxel = last_voxel;
+	header.photons = photons_;
+	header.config = config_;
+	header.seed = seed_;
+	header.nentries = entries.size();
+	header.geometry = GeometryChecksum();
+
+	std::string tmpname = name + ".tmp";
+	ofstream out(tmpname.c_str(), ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	if(!entries.empty()) {out.write(reinterpret_cast<const char*>(&entries[0]), entries.size()*sizeof(GeneratedLibraryEntry)); }
+	out.close();
+	if(!out || rename(tmpname.c_str(), name.c_str()) != 0)
+	{
+		cout << "Could not write checkpoint " << name << endl;
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool PhotonLibraryGenerator::Generate(std::string outputfile)
+{
+	int nvoxels = grid_.NumberOfVoxels();
+	int slab_voxels = std::max(1, slab_layers_)*grid_.nx()*grid_.ny();
+	int nslabs = (nvoxels + slab_voxels - 1)/slab_voxels;
+	cout << "Generating a photon library of " << nvoxels << " voxels, " << pmt_channel_.size() << " PMTs, foil configuration " << config_
+	     << ", " << photons_ << " photons per voxel, in " << nslabs << " slabs" << endl;
+
+	TFile f(outputfile.c_str(), "RECREATE");
+	if(f.IsZombie())
+	{
+		cout << "Could not create " << outputfile << endl;
+		return false;
+	}
+	TTree* tree = new TTree("PhotonLibraryData", "PhotonLibraryData");
+	GeneratedLibraryEntry entry;
+	tree->Branch("Voxel", &entry.voxel, "Voxel/I");
+	tree->Branch("OpChannel", &entry.channel, "OpChannel/I");
+	tree->Branch("Visibility", &entry.vis, "Visibility/F");
+	tree->Branch("ReflVisibility", &entry.refl, "ReflVisibility/F");
+	tree->Branch("ReflTfirst", &entry.reflT, "ReflTfirst/F");
+
+	auto start = std::chrono::steady_clock::now();
+	for(int slab = 0; slab < nslabs; slab++)
+	{
+		int first = slab*slab_voxels;
+		int last = std::min(nvoxels, first + slab_voxels);
+		std::string checkpoint = CheckpointName(outputfile, slab);
+		std::vector<GeneratedLibraryEntry> entries;
+		if(ReadCheckpoint(checkpoint, first, last, entries)) {cout << "Slab " << slab << " read from " << checkpoint << endl; }
+		else
+		{
+			std::vector<int> voxels;
+			for(int v = first; v < last; v++) {voxels.push_back(v); }
+			SimulateVoxels(voxels, entries);
+			if(!WriteCheckpoint(checkpoint, first, last, entries)) {return false; }
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			cout << "Slab " << slab + 1 << "/" << nslabs << " done, " << elapsed << " s" << endl;
+		}
+		for(size_t i = 0; i < entries.size(); i++)
+		{
+			entry = entries[i];
+			tree->Fill();
+		}
+	}
+	tree->Write();
+	f.Close();
+
+	for(int slab = 0; slab < nslabs; slab++) {remove(CheckpointName(outputfile, slab).c_str()); }
+	cout << "Written photon library: " << outputfile << endl;
+	return true;
+}
+
+void PhotonLibraryGenerator::Validate(LibraryAccess& library, int nvoxels)
+{
+	if(library.GetNumberOfGridVoxels() != grid_.NumberOfVoxels())
+	{
+		cout << "The library is not on the generator's grid" << endl;
+		return;
+	}
+
+	TRandom3 rng(seed_);
+	std::vector<int> voxels;
+	for(int i = 0; i < nvoxels; i++) {voxels.push_back(int(rng.Uniform(grid_.NumberOfVoxels()))); }
+	std::sort(voxels.begin(), voxels.end());
+	voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+	cout << "Simulating " << voxels.size() << " voxels for validation, " << photons_ << " photons each" << endl;
+	std::vector<GeneratedLibraryEntry> entries;
+	SimulateVoxels(voxels, entries);
+
+	//generated values, voxel by voxel
+	size_t nch = pmt_channel_.size();
+	std::vector<float> mc[3];
+	for(int f = 0; f < 3; f++) {mc[f].assign(voxels.size()*nchannels_, 0); }
+	for(size_t i = 0; i < entries.size(); i++)
+	{
+		size_t v = std::lower_bound(voxels.begin(), voxels.end(), entries[i].voxel) - voxels.begin();
+		mc[0][v*nchannels_ + entries[i].channel] = entries[i].vis;
+		mc[1][v*nchannels_ + entries[i].channel] = entries[i].refl;
+		mc[2][v*nchannels_ + entries[i].channel] = entries[i].reflT;
+	}
+
+	const char* plane[2] = {"vis", "refl"};
+	double total_mc[2] = {0, 0}, total_library[2] = {0, 0}, total_diff2[2] = {0, 0}, total_library2[2] = {0, 0};
+	double total_dt = 0, total_nt = 0;
+	cout << "channel   vis mc/library  vis rms   refl mc/library  refl rms  ReflTfirst mc-library [ns]" << endl;
+	for(size_t c = 0; c < nch; c++)
+	{
+		int channel = pmt_channel_[c];
+		double sum_mc[2] = {0, 0}, sum_library[2] = {0, 0}, diff2[2] = {0, 0}, library2[2] = {0, 0};
+		double dt = 0, nt = 0;
+		for(size_t v = 0; v < voxels.size(); v++)
+		{
+			float lib[2] = {library.GetCounts(voxels[v], channel), library.GetReflCounts(voxels[v], channel, true)};
+			for(int f = 0; f < 2; f++)
+			{
+				float m = mc[f][v*nchannels_ + channel];
+				sum_mc[f] += m;
+				sum_library[f] += lib[f];
+				diff2[f] += (m - lib[f])*(m - lib[f]);
+				library2[f] += lib[f]*lib[f];
+			}
+			if(lib[1] > 0 && mc[1][v*nchannels_ + channel] > 0)
+			{
+				dt += mc[2][v*nchannels_ + channel] - library.GetReflT0(voxels[v], channel);
+				nt++;
+			}
+		}
+		cout << channel;
+		for(int f = 0; f < 2; f++)
+		{
+			cout << "\t" << (sum_library[f] > 0 ? sum_mc[f]/sum_library[f] : 0) << "\t" << (library2[f] > 0 ? sqrt(diff2[f]/library2[f]) : 0);
+			total_mc[f] += sum_mc[f];
+			total_library[f] += sum_library[f];
+			total_diff2[f] += diff2[f];
+			total_library2[f] += library2[f];
+		}
+		cout << "\t" << (nt > 0 ? dt/nt : 0) << endl;
+		total_dt += dt;
+		total_nt += nt;
+	}
+	for(int f = 0; f < 2; f++)
+	{
+		cout << "All channels, " << plane[f] << ": mc/library " << (total_library[f] > 0 ? total_mc[f]/total_library[f] : 0)
+		     << ", rms relative difference " << (total_library2[f] > 0 ? sqrt(total_diff2[f]/total_library2[f]) : 0) << endl;
+	}
+	cout << "All channels, ReflTfirst: mean mc-library " << (total_nt > 0 ? total_dt/total_nt : 0) << " ns" << endl;
+}
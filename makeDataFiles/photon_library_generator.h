@@ -0,0 +1,119 @@
+#ifndef PHOTON_LIBRARY_GENERATOR_H
+#define PHOTON_LIBRARY_GENERATOR_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "voxel_grid.h"
+#include "pmt_layout.h"
+
+class TRandom3;
+class LibraryAccess;
+
+//One (voxel, channel) entry of a generated library, as in the
+//PhotonLibraryData tree
+struct GeneratedLibraryEntry{
+    int32_t voxel;
+    int32_t channel;
+    float vis;
+    float refl;
+    float reflT;
+};
+
+//Checkpoint of one finished slab of voxels, followed by its entries
+struct GeneratorCheckpointHeader{
+    char magic[8];
+    int32_t first_voxel;
+    int32_t last_voxel;    //one past the end
+    int32_t photons;       //per voxel
+    int32_t config;
+    uint32_t seed;
+    int32_t reserved;
+    uint64_t nentries;
+    uint64_t geometry;     //checksum of the voxel grid and the PMTs
+};
+
+//Toy optical Monte Carlo for building photon libraries for other PMT layouts
+//and foil coverages. Photons are generated isotropically in each voxel of
+//one TPC (x > 0) and tracked through the box between the cathode (x = 0)
+//and the PMT plane:
+//  - VUV photons Rayleigh scatter and are absorbed in the argon; on a foil
+//    they are wavelength shifted into visible photons, re-emitted diffusely
+//  - visible photons scatter less and are reflected diffusely by the foils
+//  - walls without foils absorb, and so does the PMT plane outside the
+//    PMT discs
+//Visibility and ReflVisibility are the fractions of the photons that reach
+//each PMT as VUV and as visible light, ReflTfirst the arrival time (ns) of
+//the first visible one. Foils follow the library configurations: 0 = the
+//cathode and field cage walls, 1 = the cathode only, 2 = none.
+//
+//Voxels are shared out over threads; each voxel is simulated with a
+//generator seeded from (seed, voxel), so the library does not depend on
+//the number of threads or on restarts from checkpoints.
+class PhotonLibraryGenerator{
+
+  public:
+    //The PMTs of the layout at x > 0 face the simulated TPC
+    PhotonLibraryGenerator(const VoxelGrid<>& grid, const PMTLayout& pmts, int config);
+
+    void SetPhotonsPerVoxel(int photons) { photons_ = photons; }
+    void SetThreads(int nthreads) { nthreads_ = nthreads; } //0 = all cores
+    void SetSeed(uint32_t seed) { seed_ = seed; }
+    //Voxels per checkpoint: this many z layers
+    void SetSlabLayers(int zlayers) { slab_layers_ = zlayers; }
+
+    //Simulates the whole grid and writes the library to outputfile. Every
+    //finished slab is saved to outputfile_slab<n>.ckpt; slabs that already
+    //have a checkpoint from the same settings are not simulated again, so
+    //an interrupted run continues where it stopped. The checkpoints are
+    //removed once the library is written.
+    bool Generate(std::string outputfile);
+
+    //Simulates nvoxels voxels drawn at random and compares them with the
+    //library (loaded with reflected light): per channel and overall, the
+    //ratio of the summed visibilities and the rms of the relative
+    //differences, and the mean ReflTfirst difference
+    void Validate(LibraryAccess& library, int nvoxels);
+
+    //Simulates the given voxels, all threads
+    void SimulateVoxels(const std::vector<int>& voxels, std::vector<GeneratedLibraryEntry>& entries) const;
+
+  private:
+    struct Photon{
+      double position[3];
+      double direction[3];
+      double time;       //ns
+      bool visible;      //wavelength shifted
+    };
+
+    void SimulateVoxel(int voxel, TRandom3& rng, std::vector<double>& hits, std::vector<double>& refl_hits, std::vector<float>& tfirst, std::vector<GeneratedLibraryEntry>& entries) const;
+    void TrackPhoton(Photon& photon, TRandom3& rng, std::vector<double>& hits, std::vector<double>& refl_hits, std::vector<float>& tfirst) const;
+    bool HasFoil(int wall) const;
+    int FindPMT(double y, double z) const;
+
+    //Checksum of what the entries depend on besides the header's settings:
+    //the grid's steps and bounds, the PMT channels and positions
+    uint64_t GeometryChecksum() const;
+    std::string CheckpointName(const std::string& outputfile, int slab) const;
+    bool ReadCheckpoint(const std::string& name, int first_voxel, int last_voxel, std::vector<GeneratedLibraryEntry>& entries) const;
+    bool WriteCheckpoint(const std::string& name, int first_voxel, int last_voxel, const std::vector<GeneratedLibraryEntry>& entries) const;
+
+    VoxelGrid<> grid_;
+    int config_;
+    int photons_;
+    int nthreads_;
+    uint32_t seed_;
+    int slab_layers_;
+
+    //PMTs facing the TPC, and the box: x from the cathode to the PMT plane,
+    //y and z the grid's
+    std::vector<int> pmt_channel_;
+    std::vector<double> pmt_y_;
+    std::vector<double> pmt_z_;
+    int nchannels_;   //largest channel + 1
+    double box_lower_[3];
+    double box_upper_[3];
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef PMT_LAYOUT_H
+#define PMT_LAYOUT_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//Detector types of a layout entry
+enum PMTType {kCoatedPMT = 0, kUncoatedPMT = 1};
+
+//A set of photon detectors, read at run time from a text file with one line
+//per detector: library channel, x, y, z (cm) and optionally the type
+//(PMTType, default coated); lines starting with # are comments.
+//posPMTs_setup1.txt is itself a layout, of every PMT in the library.
+//
+//The detectors are held as a structure of arrays, in file order, with a
+//table from library channel to position in the layout, so any number of
+//channels can be used without recompiling.
+struct PMTLayout{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<int> channel;  //library channel
+    std::vector<int> type;
+    std::vector<int> index;    //library channel -> position in the layout, -1 if not in it
+
+    size_t size() const { return channel.size(); }
+    int Index(int ch) const { return (ch >= 0 && ch < int(index.size())) ? index[ch] : -1; }
+
+    void Add(int ch, float px, float py, float pz, int ptype = kCoatedPMT)
+    {
+      if(ch >= int(index.size())) {index.resize(ch + 1, -1); }
+      index[ch] = channel.size();
+      channel.push_back(ch);
+      x.push_back(px);
+      y.push_back(py);
+      z.push_back(pz);
+      type.push_back(ptype);
+    }
+
+    bool Load(const std::string& file)
+    {
+      *this = PMTLayout();
+      std::ifstream in(file.c_str());
+      if(!in.is_open())
+        {
+          std::cout << "Could not open the PMT layout " << file << std::endl;
+          return false;
+        }
+      std::string line;
+      int nline = 0;
+      while(std::getline(in, line))
+        {
+          nline++;
+          std::istringstream fields(line);
+          double ch, px, py, pz;
+          int ptype = kCoatedPMT;
+          if(!(fields >> ch)) {continue; } //blank line or comment
+          if(!(fields >> px >> py >> pz) || ch < 0)
+            {
+              std::cout << "Bad line " << nline << " in the PMT layout " << file << ": " << line << std::endl;
+              return false;
+            }
+          fields >> ptype;
+          if(Index(int(ch)) >= 0)
+            {
+              std::cout << "Channel " << int(ch) << " appears twice in the PMT layout " << file << std::endl;
+              return false;
+            }
+          Add(int(ch), px, py, pz, ptype);
+        }
+      return true;
+    }
+};
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef TIMING_KERNELS_H
+#define TIMING_KERNELS_H
+
+#include <cmath>
+#include <algorithm>
+
+//The photon transport time parametrizations (Diego's, see
+//utility_functions.cc) without ROOT. Their coefficients are constexpr
+//tables evaluated by Horner's rule, the Landau density is CERNLIB's DENLAN
+//approximation (what TMath::Landau computes), and the point where the two
+//components of a distribution are joined is solved for rather than found by
+//minimising a TF1. Nothing here uses ROOT or any global state, so it can be
+//called from any thread, and working out a distribution's parameters costs
+//a few hundred flops.
+//
+//Each Parameters function gives false outside the range its parametrization
+//is valid in, where the utility:: sampling functions return no photons.
+//Distances in cm, times in ns.
+namespace timing{
+
+  //c[0] + c[1]*x + ... + c[N-1]*x^(N-1)
+  template<int N> constexpr double Horner(const double (&c)[N], double x, int i = 0)
+  { return (i == N - 1) ? c[i] : c[i] + x*Horner(c, x, i + 1); }
+
+  //Landau density, as TMath::Landau(x, mpv, sigma) (not divided by sigma)
+  inline double Landau(double x, double mpv, double sigma)
+  {
+    static constexpr double p1[5] = {0.4259894875, -0.1249762550, 0.03984243700, -0.006298287635, 0.001511162253};
+    static constexpr double q1[5] = {1.0, -0.3388260629, 0.09594393323, -0.01608042283, 0.003778942063};
+    static constexpr double p2[5] = {0.1788541609, 0.1173957403, 0.01488850518, -0.001394989411, 0.0001283617211};
+    static constexpr double q2[5] = {1.0, 0.7428795082, 0.3153932961, 0.06694219548, 0.008790609714};
+    static constexpr double p3[5] = {0.1788544503, 0.09359161662, 0.006325387654, 0.00006611667319, -0.000002031049101};
+    static constexpr double q3[5] = {1.0, 0.6097809921, 0.2560616665, 0.04746722384, 0.006957301675};
+    static constexpr double p4[5] = {0.9874054407, 118.6723273, 849.2794360, -743.7792444, 427.0262186};
+    static constexpr double q4[5] = {1.0, 106.8615961, 337.6496214, 2016.712389, 1597.063511};
+    static constexpr double p5[5] = {1.003675074, 167.5702434, 4789.711289, 21217.86767, -22324.94910};
+    static constexpr double q5[5] = {1.0, 156.9424537, 3745.310488, 9834.698876, 66924.28357};
+    static constexpr double p6[5] = {1.000827619, 664.9143136, 62972.92665, 475554.6998, -5743609.109};
+    static constexpr double q6[5] = {1.0, 651.4101098, 56974.73333, 165917.4725, -2815759.939};
+    static constexpr double a1[3] = {0.04166666667, -0.01996527778, 0.02709538966};
+    static constexpr double a2[3] = {1, -1.845568670, -4.284640743};
+
+    if(sigma <= 0) {return 0; }
+    double v = (x - mpv)/sigma;
+    if(v < -5.5)
+    {
+      double u = std::exp(v + 1.0);
+      if(u < 1e-10) {return 0; }
+      return 0.3989422803*(std::exp(-1/u)/std::sqrt(u))*(1 + u*Horner(a1, u));
+    }
+    if(v < -1)
+    {
+      double u = std::exp(-v - 1);
+      return std::exp(-u)*std::sqrt(u)*Horner(p1, v)/Horner(q1, v);
+    }
+    if(v < 1) {return Horner(p2, v)/Horner(q2, v); }
+    if(v < 5) {return Horner(p3, v)/Horner(q3, v); }
+    double u = 1/v;
+    if(v < 12) {return u*u*Horner(p4, u)/Horner(q4, u); }
+    if(v < 50) {return u*u*Horner(p5, u)/Horner(q5, u); }
+    if(v < 300) {return u*u*Horner(p6, u)/Horner(q6, u); }
+    u = 1/(v - v*std::log(v)/(v + 1));
+    return u*u*Horner(a2, u);
+  }
+
+  //The density above peaks at (x - mpv)/sigma = kLandauPeak
+  constexpr double kLandauPeak = -0.22278298;
+  //Where the parametrizations' Landau components peak, within the range of
+  //their TF1s
+  inline double LandauMaximumX(double mpv, double sigma)
+  { return std::min(500., std::max(0., mpv + kLandauPeak*sigma)); }
+
+  //Where f and g (positive on [lower, upper]) cross. The first sign change
+  //of f - g on a grid is refined by Newton's method, bisecting whenever a
+  //step would leave the bracket. If they never cross, where they come
+  //closest, which is what minimising |f - g| finds.
+  template<class F, class G> double Intersection(F f, G g, double lower, double upper)
+  {
+    const int ngrid = 100;
+    double dx = (upper - lower)/ngrid;
+    double a = lower, ha = f(a) - g(a);
+    double closest = a, closest_diff = std::fabs(ha);
+    for(int i = 1; i <= ngrid; i++)
+    {
+      double b = lower + i*dx;
+      double hb = f(b) - g(b);
+      if(std::fabs(hb) < closest_diff) {closest = b; closest_diff = std::fabs(hb); }
+      if((ha < 0) != (hb < 0) || hb == 0)
+      {
+        double t = (ha != hb) ? a - ha*(b - a)/(hb - ha) : b;
+        for(int iteration = 0; iteration < 50; iteration++)
+        {
+          double h = f(t) - g(t);
+          if(h == 0) {return t; }
+          if((h < 0) == (ha < 0)) {a = t; ha = h; }
+          else {b = t; hb = h; }
+          double eps = 1e-7*(std::fabs(t) + 1);
+          double slope = ((f(t + eps) - g(t + eps)) - (f(t - eps) - g(t - eps)))/(2*eps);
+          double next = (slope != 0) ? t - h/slope : 0.5*(a + b);
+          if(!(next > a && next < b)) {next = 0.5*(a + b); }
+          if(std::fabs(next - t) < 1e-10*(std::fabs(t) + 1)) {return next; }
+          t = next;
+        }
+        return t;
+      }
+      a = b;
+      ha = hb;
+    }
+    //golden section search for the minimum of |f - g| about the closest point
+    a = std::max(lower, closest - dx);
+    double b = std::min(upper, closest + dx);
+    const double r = 0.618033988749895;
+    for(int iteration = 0; iteration < 60; iteration++)
+    {
+      double x1 = b - r*(b - a), x2 = a + r*(b - a);
+      if(std::fabs(f(x1) - g(x1)) < std::fabs(f(x2) - g(x2))) {b = x2; }
+      else {a = x1; }
+    }
+    return 0.5*(a + b);
+  }
+
+  //The distributions sampled: a Landau joined to an exponential or to a
+  //second Landau at pars[0], in the parameter order of
+  //utility::LandauPlusExpoFinal and utility::LandauPlusLandauFinal
+  inline double LandauPlusExpo(double t, const double pars[6])
+  {
+    double y1 = (t > pars[0]) ? 0 : pars[3]*Landau(t, pars[1], pars[2]);
+    double y2 = (t < pars[0]) ? 0 : std::exp(pars[4] + t*pars[5]);
+    return y1 + y2;
+  }
+  inline double LandauPlusLandau(double t, const double pars[7])
+  {
+    double y1 = (t > pars[0]) ? 0 : pars[3]*Landau(t, pars[1], pars[2]);
+    double y2 = (t < pars[0]) ? 0 : pars[6]*Landau(t, pars[4], pars[5]);
+    return y1 + y2;
+  }
+
+  constexpr double kVUVGroupVelocity = 10.13; //cm/ns
+
+  //-----VUV light (direct transport + Rayleigh scattering), Landau + expo vs distance
+  constexpr double kVUVLogNorm[8] = {7.85903, -0.108075, 0.00110999, -6.90009e-06, 2.52576e-08, -5.39078e-11, 6.20863e-14, -2.97559e-17};
+  constexpr double kVUVMPV[5] = {1.20259, 0.0582674, 0.000308053, -2.71782e-07, -3.37159e-10};
+  constexpr double kVUVWidth[4] = {0.346667, -0.00768231, 0.000211825, -3.81361e-07};
+  constexpr double kVUVExpoCte[7] = {13.6592, -0.188798, 0.00192431, -1.10689e-05, 3.38425e-08, -5.20737e-11, 3.17657e-14};
+  constexpr double kVUVExpoSlope[8] = {-0.57011, 0.0156393, -0.000197461, 1.34491e-06, -5.24544e-09, 1.1703e-11, -1.38811e-14, 6.78368e-18};
+  //beyond the fitted range the parameters are extrapolated: log(log10(norm))
+  //and log(cte) linear, MPV linear
+  constexpr double kVUVLogNormFar[2] = {2.23151, -0.00627503};
+  constexpr double kVUVMPVFar[2] = {-3.04952, 0.128638};
+  constexpr double kVUVExpoCteFar[2] = {3.69578, -0.00989582};
+  constexpr double kVUVMinDistance = 10.;
+  constexpr double kVUVBreakDistance = 500.;
+  constexpr double kVUVMaxDistance = 750.;
+
+  inline bool VUVParameters(double distance, double pars[6])
+  {
+    if(distance < kVUVMinDistance || distance > kVUVMaxDistance) {return false; }
+    double t_direct = distance/kVUVGroupVelocity;
+    double mpv = Horner(kVUVMPV, distance);
+    double width = Horner(kVUVWidth, distance);
+    double norm = std::pow(10., Horner(kVUVLogNorm, distance));
+    if(distance > kVUVBreakDistance)
+    {
+      mpv = Horner(kVUVMPVFar, distance);
+      width = Horner(kVUVWidth, kVUVBreakDistance);
+      norm = std::pow(10., std::exp(Horner(kVUVLogNormFar, distance)));
+    }
+    double cte = Horner(kVUVExpoCte, distance);
+    double slope = Horner(kVUVExpoSlope, distance);
+    if(distance > kVUVBreakDistance - 50.)
+    {
+      cte = std::exp(Horner(kVUVExpoCteFar, distance));
+      slope = Horner(kVUVExpoSlope, kVUVBreakDistance - 50.);
+    }
+    pars[0] = Intersection([=](double t) { return norm*Landau(t, mpv, width); },
+                           [=](double t) { return std::exp(cte + t*slope); },
+                           LandauMaximumX(mpv, width), 3*t_direct);
+    pars[1] = mpv;
+    pars[2] = width;
+    pars[3] = norm;
+    pars[4] = cte;
+    pars[5] = slope;
+    return true;
+  }
+
+  //-----Visible light, foils on the cathode only, Landau + expo vs t0
+  constexpr double kCathodeLogNorm[4] = {7.54642, -0.441946, 0.0107579, -9.53399e-05};
+  constexpr double kCathodeMPV[4] = {-1.61482, 1.18624, 0.00105223, -9.52016e-05};
+  constexpr double kCathodeWidth[4] = {0.440124, -0.0557912, 0.00544957, -9.39128e-05};
+  constexpr double kCathodeExpoCte[4] = {14.6874, -0.896761, 0.0214977, -0.000185728};
+  constexpr double kCathodeExpoSlope[5] = {-0.650584, 0.0800897, -0.00379933, 7.91909e-05, -6.10836e-07};
+  //past the break point the fit lacks statistics: MPV linear, the rest frozen
+  constexpr double kCathodeMPVFar[2] = {-0.798934, 1.06216};
+  constexpr double kCathodeMinT0 = 8.;
+  constexpr double kCathodeBreakT0 = 42.;
+  constexpr double kCathodeMaxT0 = 55.;
+
+  inline bool VisibleOnlyCathodeParameters(double t0, double pars[6])
+  {
+    if(t0 < kCathodeMinT0 || t0 > kCathodeMaxT0) {return false; }
+    double x = std::min(t0, kCathodeBreakT0);
+    double mpv = (t0 > kCathodeBreakT0) ? Horner(kCathodeMPVFar, t0) : Horner(kCathodeMPV, t0);
+    double width = Horner(kCathodeWidth, x);
+    double norm = std::pow(10., Horner(kCathodeLogNorm, x));
+    double cte = Horner(kCathodeExpoCte, x);
+    double slope = Horner(kCathodeExpoSlope, x);
+    pars[0] = Intersection([=](double t) { return norm*Landau(t, mpv, width); },
+                           [=](double t) { return std::exp(cte + t*slope); },
+                           LandauMaximumX(mpv, width), 2*t0);
+    pars[1] = mpv;
+    pars[2] = width;
+    pars[3] = norm;
+    pars[4] = cte;
+    pars[5] = slope;
+    return true;
+  }
+
+  //-----Visible light, foils on the cathode and field cage, Landau + Landau
+  //vs t0 (the second Landau's width vs the direct VUV time in version 2)
+  constexpr double kFull1LogNorm1[3] = {4.80632, -0.227272, 0.00409071};
+  constexpr double kFull1MPV1[3] = {4.27391, 0.48747, 0.0312366};
+  constexpr double kFull1Width1[3] = {0.789521, -0.0763977, 0.0094536};
+  constexpr double kFull1LogNorm2[3] = {2.88774, -0.0188192, -0.00111117};
+  constexpr double kFull1MPV2[4] = {-55.8751, 14.6612, -0.878218, 0.0198729};
+  constexpr double kFull1Width2[3] = {10.5582, -0.539349, 0.0360326};
+  constexpr double kFull1MinT0 = 4.;
+  constexpr double kFull1MinMPV2T0 = 6.; //the MPV2 polynomial misbehaves below
+  constexpr double kFull1MaxT0 = 52.;
+
+  constexpr double kFull2LogNorm1[4] = {9.78924, -0.808646, 0.0286551, -0.000342326};
+  constexpr double kFull2MPV1[2] = {-9.04501, 1.76972};
+  constexpr double kFull2Width1[5] = {24.7515, -5.71531, 0.45703, -0.0144995, 0.000163086};
+  constexpr double kFull2LogNorm2[3] = {3.44352, -0.0812814, 0.00118423};
+  constexpr double kFull2MPV2[5] = {282.128, -57.8334, 4.50742, -0.143848, 0.00164436};
+  constexpr double kFull2Width2[3] = {15.1667, -0.0786729, -0.000696796};
+  constexpr double kFull2MinT0 = 10.;
+  constexpr double kFull2BreakT0 = 35.;
+  constexpr double kFull2MaxT0 = 52.;
+  constexpr double kFull2MaxDirectTime = 60.;
+
+  inline double LandauLandauIntersection(const double pars[7], double upper)
+  {
+    return Intersection([=](double t) { return pars[3]*Landau(t, pars[1], pars[2]); },
+                        [=](double t) { return pars[6]*Landau(t, pars[4], pars[5]); },
+                        LandauMaximumX(pars[1], pars[2]), upper);
+  }
+
+  inline bool VisibleFullConfig1Parameters(double t0, double pars[7])
+  {
+    if(t0 < kFull1MinT0 || t0 > kFull1MaxT0) {return false; }
+    pars[1] = Horner(kFull1MPV1, t0);
+    pars[2] = Horner(kFull1Width1, t0);
+    pars[3] = std::pow(10., Horner(kFull1LogNorm1, t0));
+    pars[4] = Horner(kFull1MPV2, std::max(t0, kFull1MinMPV2T0));
+    pars[5] = Horner(kFull1Width2, t0);
+    pars[6] = std::pow(10., Horner(kFull1LogNorm2, t0));
+    pars[0] = LandauLandauIntersection(pars, 2*t0);
+    return true;
+  }
+
+  inline bool VisibleFullConfig2Parameters(double t0, double distance, double pars[7])
+  {
+    double t_direct = distance/kVUVGroupVelocity;
+    if(t0 < kFull2MinT0 || t0 > kFull2MaxT0 || t_direct > kFull2MaxDirectTime) {return false; }
+    double x = std::min(t0, kFull2BreakT0);
+    pars[1] = Horner(kFull2MPV1, t0);
+    pars[2] = Horner(kFull2Width1, x);
+    pars[3] = std::pow(10., Horner(kFull2LogNorm1, x));
+    pars[4] = Horner(kFull2MPV2, x);
+    pars[5] = Horner(kFull2Width2, t_direct);
+    pars[6] = std::pow(10., Horner(kFull2LogNorm2, x));
+    pars[0] = LandauLandauIntersection(pars, 2*t0);
+    return true;
+  }
+
+}
+
+#endif
@@ -0,0 +1,283 @@
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include "TRandom.h"
+
+#include "timing_sampler.h"
+#include "timing_sampler_simd.h"
+#include "timing_kernels.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+	//The parametrizations are defined to 1 us
+	const double kTimeRange = 1000.;   //ns
+	//The first level starts where this fraction of a level's probability is
+	//reached rather than at t = 0, so none of it is spread over the times
+	//before the Landau rises
+	const double kFirstLevel = 1e-3;
+	//Cells the Landau pieces are integrated in; the second Landau of the
+	//Landau + Landau shape is integrated finely to kSecondLandauWidths
+	//widths past its MPV, coarsely in its tail beyond
+	const int kFirstLandauCells = 512;
+	const int kSecondLandauCells = 384;
+	const int kSecondLandauTailCells = 128;
+	const double kSecondLandauWidths = 40.;
+
+	void TransformScalar(const TimingSampler::Table& table, int n, double* u)
+	{
+		TransformBatch<ScalarOps>(table, n, u);
+	}
+
+	void TransformBetweenScalar(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+	{
+		TransformBetweenBatch<ScalarOps>(a, b, w, n, u);
+	}
+
+	typedef void (*TransformFunction)(const TimingSampler::Table&, int, double*);
+	typedef void (*TransformBetweenFunction)(const TimingSampler::Table&, const TimingSampler::Table&, double, int, double*);
+	struct Dispatch{
+		TransformFunction function;
+		TransformBetweenFunction between;
+		const char* name;
+	};
+
+	//The kernel of an instruction set, no function if this build or CPU
+	//cannot run it
+	Dispatch FindTransform(const std::string& name)
+	{
+		Dispatch dispatch = {0, 0, 0};
+		if(name == "scalar") {Dispatch d = {TransformScalar, TransformBetweenScalar, "scalar"}; dispatch = d; }
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		if(name == "sse2") {Dispatch d = {timing::TransformSse2, timing::TransformBetweenSse2, "sse2"}; dispatch = d; }
+		if(name == "avx2" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		{
+			Dispatch d = {timing::TransformAvx2, timing::TransformBetweenAvx2, "avx2"};
+			dispatch = d;
+		}
+		if(name == "avx512" && __builtin_cpu_supports("avx512f"))
+		{
+			Dispatch d = {timing::TransformAvx512, timing::TransformBetweenAvx512, "avx512"};
+			dispatch = d;
+		}
+#endif
+		return dispatch;
+	}
+
+	//The widest the CPU has
+	Dispatch ChooseTransform()
+	{
+		const char* order[] = {"avx512", "avx2", "sse2"};
+		for(int i = 0; i < 3; i++)
+		{
+			Dispatch dispatch = FindTransform(order[i]);
+			if(dispatch.function) {return dispatch; }
+		}
+		return FindTransform("scalar");
+	}
+
+	const Dispatch& Chosen()
+	{
+		static const Dispatch dispatch = ChooseTransform();
+		return dispatch;
+	}
+
+#ifdef __SSE2__
+	struct Sse2Ops{
+		typedef __m128d Vec;
+		typedef __m128i Index;
+		typedef __m128d Mask;
+		static const int kWidth = 2;
+		static Vec Load(const double* p) { return _mm_loadu_pd(p); }
+		static void Store(double* p, Vec a) { _mm_storeu_pd(p, a); }
+		static Vec Set1(double a) { return _mm_set1_pd(a); }
+		static Vec Add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+		static Vec Sub(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+		static Vec Mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+		static Vec Div(Vec a, Vec b) { return _mm_div_pd(a, b); }
+		static Vec MulAdd(Vec a, Vec b, Vec c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+		static Vec Min(Vec a, Vec b) { return _mm_min_pd(a, b); }
+		static Mask GreaterEqual(Vec a, Vec b) { return _mm_cmpge_pd(a, b); }
+		static Mask Greater(Vec a, Vec b) { return _mm_cmpgt_pd(a, b); }
+		static Vec Blend(Vec a, Vec b, Mask mask) { return _mm_or_pd(_mm_and_pd(mask, b), _mm_andnot_pd(mask, a)); }
+		static Index Truncate(Vec a) { return _mm_cvttpd_epi32(a); }
+		static Vec ToDouble(Index i) { return _mm_cvtepi32_pd(i); }
+		static Vec Gather(const double* base, Index i)
+		{
+			return _mm_set_pd(base[_mm_cvtsi128_si32(_mm_srli_si128(i, 4))], base[_mm_cvtsi128_si32(i)]);
+		}
+		//exponent bits made into a double by putting them under 2^52
+		static Vec Frexp(Vec x, Vec& e)
+		{
+			__m128i bits = _mm_castpd_si128(x);
+			__m128i exponent = _mm_or_si128(_mm_srli_epi64(bits, 52), _mm_castpd_si128(_mm_set1_pd(4503599627370496.)));
+			e = _mm_sub_pd(_mm_castsi128_pd(exponent), _mm_set1_pd(4503599627370496. + 1023.));
+			__m128i mantissa = _mm_and_si128(bits, _mm_set1_epi64x(0x000FFFFFFFFFFFFFLL));
+			return _mm_castsi128_pd(_mm_or_si128(mantissa, _mm_castpd_si128(_mm_set1_pd(1.))));
+		}
+		static Vec Log(Vec a) { return VectorLog<Sse2Ops>(a); }
+	};
+#endif
+
+}
+
+#ifdef __SSE2__
+void timing::TransformSse2(const TimingSampler::Table& table, int n, double* u)
+{
+	TransformBatch<Sse2Ops>(table, n, u);
+}
+
+void timing::TransformBetweenSse2(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+{
+	TransformBetweenBatch<Sse2Ops>(a, b, w, n, u);
+}
+#endif
+
+const int TimingSampler::kLevels;
+
+TimingSampler::TimingSampler() :
+	table_()
+{
+}
+
+bool TimingSampler::SetLandauPlusExpo(const double pars[6])
+{
+	double t_int = min(kTimeRange, max(0., pars[0]));
+	vector<Piece> pieces(1);
+	Piece first = {0., t_int, kFirstLandauCells, pars[1], pars[2], pars[3]};
+	pieces[0] = first;
+	return Build(pieces, true, t_int, pars[4], pars[5]);
+}
+
+bool TimingSampler::SetLandauPlusLandau(const double pars[7])
+{
+	double t_int = min(kTimeRange, max(0., pars[0]));
+	double t_fine = min(kTimeRange, max(t_int, pars[4]) + kSecondLandauWidths*fabs(pars[5]));
+	vector<Piece> pieces(3);
+	Piece first = {0., t_int, kFirstLandauCells, pars[1], pars[2], pars[3]};
+	Piece second = {t_int, t_fine, kSecondLandauCells, pars[4], pars[5], pars[6]};
+	Piece second_tail = {t_fine, kTimeRange, kSecondLandauTailCells, pars[4], pars[5], pars[6]};
+	pieces[0] = first;
+	pieces[1] = second;
+	pieces[2] = second_tail;
+	return Build(pieces, false, kTimeRange, 0, 0);
+}
+
+bool TimingSampler::Build(const std::vector<Piece>& pieces, bool tail, double tail_start, double cte, double slope)
+{
+	quantiles_.clear();
+	table_ = Table();
+
+	//cumulative distribution of the Landau pieces, trapezoids
+	vector<double> t(1, pieces[0].start);
+	vector<double> cdf(1, 0.);
+	for(size_t p = 0; p < pieces.size(); p++)
+	{
+		const Piece& piece = pieces[p];
+		if(piece.end <= piece.start) {continue; }
+		double step = (piece.end - piece.start)/piece.cells;
+		double f_prev = piece.norm*timing::Landau(piece.start, piece.mpv, piece.width);
+		for(int c = 1; c <= piece.cells; c++)
+		{
+			double x = piece.start + c*step;
+			double f = piece.norm*timing::Landau(x, piece.mpv, piece.width);
+			t.push_back(x);
+			cdf.push_back(cdf.back() + 0.5*(f + f_prev)*step);
+			f_prev = f;
+		}
+	}
+	double head = cdf.back();
+
+	//the exponential tail, integrated exactly. A tail flat to within 1e-6 over
+	//its range is made to fall that much, so the inversion stays accurate.
+	double length = kTimeRange - tail_start;
+	double tail_mass = 0;
+	if(tail && length > 0)
+	{
+		if(fabs(slope*length) < 1e-6) {slope = -1e-6/length; }
+		tail_mass = exp(cte + slope*tail_start)*expm1(slope*length)/slope;
+	}
+	double total = head + tail_mass;
+	if(!(total > 0) || !std::isfinite(total)) {return false; }
+
+	//the time at each level of the Landau pieces, linear within the cells
+	quantiles_.assign(kLevels + 1, t[0]);
+	if(head > 0)
+	{
+		size_t k = 0;
+		for(int level = 0; level <= kLevels; level++)
+		{
+			double target = head*max(double(level), kFirstLevel)/kLevels;
+			while(k + 1 < t.size() - 1 && cdf[k+1] < target) {k++; }
+			double width = cdf[k+1] - cdf[k];
+			double frac = (width > 0) ? (target - cdf[k])/width : 0;
+			quantiles_[level] = t[k] + min(1., max(0., frac))*(t[k+1] - t[k]);
+		}
+	}
+
+	table_.nlevels = kLevels;
+	table_.head = head/total;
+	table_.scale = (head > 0) ? kLevels/table_.head : 0;
+	table_.tail = tail_mass > 0;
+	if(table_.tail)
+	{
+		table_.tail_norm = 1/(1 - table_.head);
+		table_.tail_start = tail_start;
+		table_.tail_scale = 1/slope;
+		table_.tail_c = expm1(slope*length);
+	}
+	return true;
+}
+
+void TimingSampler::Sample(int number_photons, double* times, TRandom* rng) const
+{
+	if(number_photons <= 0) {return; }
+	rng->RndmArray(number_photons, times);
+	Transform(number_photons, times);
+}
+
+void TimingSampler::Transform(int n, double* u) const
+{
+	if(quantiles_.empty()) {return; }
+	Chosen().function(GetTable(), n, u);
+}
+
+TimingSampler::Table TimingSampler::GetTable() const
+{
+	Table table = table_;
+	table.quantiles = quantiles_.empty() ? 0 : &quantiles_[0];
+	return table;
+}
+
+void TimingSampler::TransformBetween(const Table& a, const Table& b, double w, int n, double* u)
+{
+	if(!a.quantiles || !b.quantiles) {return; }
+	Chosen().between(a, b, w, n, u);
+}
+
+bool TimingSampler::TransformWith(const char* instruction_set, const Table& table, int n, double* u)
+{
+	Dispatch dispatch = FindTransform(instruction_set);
+	if(!dispatch.function) {return false; }
+	if(table.quantiles) {dispatch.function(table, n, u); }
+	return true;
+}
+
+bool TimingSampler::TransformBetweenWith(const char* instruction_set, const Table& a, const Table& b, double w, int n, double* u)
+{
+	Dispatch dispatch = FindTransform(instruction_set);
+	if(!dispatch.between) {return false; }
+	if(a.quantiles && b.quantiles) {dispatch.between(a, b, w, n, u); }
+	return true;
+}
+
+const char* TimingSampler::InstructionSet()
+{
+	return Chosen().name;
+}
@@ -0,0 +1,89 @@
+#ifndef TIMING_SAMPLER_H
+#define TIMING_SAMPLER_H
+
+#include <vector>
+
+class TRandom;
+
+//Draws photon arrival times from one of the transport time distributions of
+//timing_kernels.h (a Landau joined to an exponential or to a second Landau)
+//a buffer at a time. The Landau pieces are tabulated once per parameter set
+//as equal-probability quantiles and the exponential tail is inverted
+//exactly. The uniforms are turned into times by SIMD code chosen for the CPU
+//at run time: AVX-512, AVX2 or SSE2 (plain C++ elsewhere). Set one sampler up
+//per parameter set (a PMT's distance or t0) and draw all its photons at once.
+class TimingSampler{
+
+  public:
+    TimingSampler();
+
+    //Tabulates the distribution with parameters pars, in the order of
+    //utility::LandauPlusExpoFinal (LandauPlusLandauFinal), over the 1 us the
+    //parametrizations are defined to; false if it has no probability there
+    bool SetLandauPlusExpo(const double pars[6]);
+    bool SetLandauPlusLandau(const double pars[7]);
+
+    //Fills times[0, number_photons) with arrival times (ns). Thread safe,
+    //given a generator per thread.
+    void Sample(int number_photons, double* times, TRandom* rng) const;
+    //Turns n uniforms in (0, 1) into arrival times, in place
+    void Transform(int n, double* u) const;
+
+    //The instruction set Transform runs with: "avx512", "avx2", "sse2" or "scalar"
+    static const char* InstructionSet();
+
+    //Quantile levels of a tabulated distribution
+    static const int kLevels = 2048;
+
+    //What the SIMD kernels read. Below head a uniform u picks level
+    //u*scale of the quantiles, interpolating between the two either side;
+    //above it, v = (u - head)*tail_norm gives the time
+    //tail_start + tail_scale*log(1 + tail_c*v), the inverse of the
+    //exponential tail.
+    struct Table{
+      int nlevels;
+      const double* quantiles;  //nlevels + 1
+      double head;
+      double scale;
+      bool tail;
+      double tail_norm;
+      double tail_start;
+      double tail_scale;
+      double tail_c;
+    };
+
+    //The tabulated distribution, with its quantiles pointing into this
+    //sampler; to keep one without the sampler, copy them out
+    Table GetTable() const;
+    //As Transform, from the mixture of two tables kept elsewhere
+    //(TimingTables' grid points): b's distribution with weight w, a's with
+    //1 - w, the density interpolated linearly between them
+    static void TransformBetween(const Table& a, const Table& b, double w, int n, double* u);
+    //Transform and TransformBetween with the kernel of the given
+    //instruction set rather than the best one; false if this build or CPU
+    //cannot run it. For checking the kernels against each other
+    //(check_timing_sampler).
+    static bool TransformWith(const char* instruction_set, const Table& table, int n, double* u);
+    static bool TransformBetweenWith(const char* instruction_set, const Table& a, const Table& b, double w, int n, double* u);
+
+  private:
+    //One piece of the distribution: density norm*Landau(t, mpv, width) from
+    //start to end, integrated in cells equal steps
+    struct Piece{
+      double start;
+      double end;
+      int cells;
+      double mpv;
+      double width;
+      double norm;
+    };
+
+    //Integrates the pieces, and the exponential exp(cte + slope t) from
+    //tail_start to the end of the range if tail is set, and tabulates them
+    bool Build(const std::vector<Piece>& pieces, bool tail, double tail_start, double cte, double slope);
+
+    std::vector<double> quantiles_;
+    Table table_;
+};
+
+#endif
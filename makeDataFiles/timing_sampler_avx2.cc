@@ -0,0 +1,67 @@
+#include "timing_sampler_simd.h"
+
+//Compiled with -mavx2 -mfma (see the Makefile); only called on CPUs that
+//have them
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+
+namespace {
+
+	struct Avx2Ops{
+		typedef __m256d Vec;
+		typedef __m128i Index;
+		typedef __m256d Mask;
+		static const int kWidth = 4;
+		static Vec Load(const double* p) { return _mm256_loadu_pd(p); }
+		static void Store(double* p, Vec a) { _mm256_storeu_pd(p, a); }
+		static Vec Set1(double a) { return _mm256_set1_pd(a); }
+		static Vec Add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+		static Vec Sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+		static Vec Mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+		static Vec Div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+		static Vec MulAdd(Vec a, Vec b, Vec c) { return _mm256_fmadd_pd(a, b, c); }
+		static Vec Min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+		static Mask GreaterEqual(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+		static Mask Greater(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+		static Vec Blend(Vec a, Vec b, Mask mask) { return _mm256_blendv_pd(a, b, mask); }
+		static Index Truncate(Vec a) { return _mm256_cvttpd_epi32(a); }
+		static Vec ToDouble(Index i) { return _mm256_cvtepi32_pd(i); }
+		static Vec Gather(const double* base, Index i) { return _mm256_i32gather_pd(base, i, 8); }
+		//exponent bits made into a double by putting them under 2^52
+		static Vec Frexp(Vec x, Vec& e)
+		{
+			__m256i bits = _mm256_castpd_si256(x);
+			__m256i exponent = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(_mm256_set1_pd(4503599627370496.)));
+			e = _mm256_sub_pd(_mm256_castsi256_pd(exponent), _mm256_set1_pd(4503599627370496. + 1023.));
+			__m256i mantissa = _mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL));
+			return _mm256_castsi256_pd(_mm256_or_si256(mantissa, _mm256_castpd_si256(_mm256_set1_pd(1.))));
+		}
+		static Vec Log(Vec a) { return VectorLog<Avx2Ops>(a); }
+	};
+
+}
+
+void timing::TransformAvx2(const TimingSampler::Table& table, int n, double* u)
+{
+	TransformBatch<Avx2Ops>(table, n, u);
+}
+
+void timing::TransformBetweenAvx2(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+{
+	TransformBetweenBatch<Avx2Ops>(a, b, w, n, u);
+}
+
+#else
+
+//Built without AVX2: never chosen, but keeps the dispatch linking
+void timing::TransformAvx2(const TimingSampler::Table& table, int n, double* u)
+{
+	TransformBatch<ScalarOps>(table, n, u);
+}
+
+void timing::TransformBetweenAvx2(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+{
+	TransformBetweenBatch<ScalarOps>(a, b, w, n, u);
+}
+
+#endif
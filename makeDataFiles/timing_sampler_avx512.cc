@@ -0,0 +1,62 @@
+#include "timing_sampler_simd.h"
+
+//Compiled with -mavx512f (see the Makefile); only called on CPUs that have it
+#ifdef __AVX512F__
+#include <immintrin.h>
+
+namespace {
+
+	struct Avx512Ops{
+		typedef __m512d Vec;
+		typedef __m256i Index;
+		typedef __mmask8 Mask;
+		static const int kWidth = 8;
+		static Vec Load(const double* p) { return _mm512_loadu_pd(p); }
+		static void Store(double* p, Vec a) { _mm512_storeu_pd(p, a); }
+		static Vec Set1(double a) { return _mm512_set1_pd(a); }
+		static Vec Add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+		static Vec Sub(Vec a, Vec b) { return _mm512_sub_pd(a, b); }
+		static Vec Mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+		static Vec Div(Vec a, Vec b) { return _mm512_div_pd(a, b); }
+		static Vec MulAdd(Vec a, Vec b, Vec c) { return _mm512_fmadd_pd(a, b, c); }
+		static Vec Min(Vec a, Vec b) { return _mm512_min_pd(a, b); }
+		static Mask GreaterEqual(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+		static Mask Greater(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+		static Vec Blend(Vec a, Vec b, Mask mask) { return _mm512_mask_blend_pd(mask, a, b); }
+		static Index Truncate(Vec a) { return _mm512_cvttpd_epi32(a); }
+		static Vec ToDouble(Index i) { return _mm512_cvtepi32_pd(i); }
+		static Vec Gather(const double* base, Index i) { return _mm512_i32gather_pd(i, base, 8); }
+		static Vec Frexp(Vec x, Vec& e)
+		{
+			e = _mm512_getexp_pd(x);
+			return _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero);
+		}
+		static Vec Log(Vec a) { return VectorLog<Avx512Ops>(a); }
+	};
+
+}
+
+void timing::TransformAvx512(const TimingSampler::Table& table, int n, double* u)
+{
+	TransformBatch<Avx512Ops>(table, n, u);
+}
+
+void timing::TransformBetweenAvx512(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+{
+	TransformBetweenBatch<Avx512Ops>(a, b, w, n, u);
+}
+
+#else
+
+//Built without AVX-512: never chosen, but keeps the dispatch linking
+void timing::TransformAvx512(const TimingSampler::Table& table, int n, double* u)
+{
+	TransformBatch<ScalarOps>(table, n, u);
+}
+
+void timing::TransformBetweenAvx512(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+{
+	TransformBetweenBatch<ScalarOps>(a, b, w, n, u);
+}
+
+#endif
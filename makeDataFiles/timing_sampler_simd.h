@@ -0,0 +1,147 @@
+#ifndef TIMING_SAMPLER_SIMD_H
+#define TIMING_SAMPLER_SIMD_H
+
+#include <cmath>
+#include "timing_sampler.h"
+
+//The TimingSampler::Transform kernel, written once over a set of vector
+//operations and compiled for each instruction set in its own translation unit
+//(timing_sampler.cc for SSE2, timing_sampler_avx2.cc, timing_sampler_avx512.cc)
+//with that unit's compiler flags. Everything in the unnamed namespace is
+//private to the unit including it, so the linker can never swap one unit's
+//AVX code in for another's.
+//
+//An operation set V provides: Vec (kWidth doubles), Index (kWidth ints),
+//Mask; Load, Store, Set1, Add, Sub, Mul, Div, MulAdd (a*b + c), Min,
+//GreaterEqual, Greater, Blend (b where mask, else a), Truncate, ToDouble,
+//Gather (base[index]) and Frexp (x = m 2^e, m in [1, 2)).
+
+namespace timing{
+
+  //The entry points of the units, chosen between at run time
+  void TransformSse2(const TimingSampler::Table& table, int n, double* u);
+  void TransformAvx2(const TimingSampler::Table& table, int n, double* u);
+  void TransformAvx512(const TimingSampler::Table& table, int n, double* u);
+  void TransformBetweenSse2(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u);
+  void TransformBetweenAvx2(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u);
+  void TransformBetweenAvx512(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u);
+
+}
+
+namespace{
+
+  struct ScalarOps{
+    typedef double Vec;
+    typedef int Index;
+    typedef bool Mask;
+    static const int kWidth = 1;
+    static Vec Load(const double* p) { return *p; }
+    static void Store(double* p, Vec a) { *p = a; }
+    static Vec Set1(double a) { return a; }
+    static Vec Add(Vec a, Vec b) { return a + b; }
+    static Vec Sub(Vec a, Vec b) { return a - b; }
+    static Vec Mul(Vec a, Vec b) { return a*b; }
+    static Vec Div(Vec a, Vec b) { return a/b; }
+    static Vec MulAdd(Vec a, Vec b, Vec c) { return a*b + c; }
+    static Vec Min(Vec a, Vec b) { return a < b ? a : b; }
+    static Mask GreaterEqual(Vec a, Vec b) { return a >= b; }
+    static Mask Greater(Vec a, Vec b) { return a > b; }
+    static Vec Blend(Vec a, Vec b, Mask mask) { return mask ? b : a; }
+    static Index Truncate(Vec a) { return int(a); }
+    static Vec ToDouble(Index i) { return i; }
+    static Vec Gather(const double* base, Index i) { return base[i]; }
+    static Vec Log(Vec a) { return std::log(a); }
+  };
+
+  //Natural log from the exponent and a series in s = (m - 1)/(m + 1),
+  //|s| < 0.172 once m is brought into [sqrt(1/2), sqrt(2)): relative error
+  //below 1e-14 for the positive, finite arguments the tail gives it
+  template<class V> typename V::Vec VectorLog(typename V::Vec x)
+  {
+    typedef typename V::Vec Vec;
+    static const double kSeries[8] = {2., 2./3, 2./5, 2./7, 2./9, 2./11, 2./13, 2./15};
+    Vec e;
+    Vec m = V::Frexp(x, e);
+    typename V::Mask high = V::Greater(m, V::Set1(M_SQRT2));
+    m = V::Blend(m, V::Mul(m, V::Set1(0.5)), high);
+    e = V::Blend(e, V::Add(e, V::Set1(1.)), high);
+    Vec s = V::Div(V::Sub(m, V::Set1(1.)), V::Add(m, V::Set1(1.)));
+    Vec z = V::Mul(s, s);
+    Vec p = V::Set1(kSeries[7]);
+    for(int k = 6; k >= 0; k--) {p = V::MulAdd(p, z, V::Set1(kSeries[k])); }
+    return V::MulAdd(e, V::Set1(M_LN2), V::Mul(s, p));
+  }
+
+  //One vector of uniforms into times, see TimingSampler::Table
+  template<class V> typename V::Vec TransformVector(const TimingSampler::Table& table, typename V::Vec u)
+  {
+    typedef typename V::Vec Vec;
+    Vec level = V::Min(V::Mul(u, V::Set1(table.scale)), V::Set1(table.nlevels));
+    typename V::Index j = V::Truncate(V::Min(level, V::Set1(table.nlevels - 1)));
+    Vec f = V::Sub(level, V::ToDouble(j));
+    Vec q0 = V::Gather(table.quantiles, j);
+    Vec q1 = V::Gather(table.quantiles + 1, j);
+    Vec t = V::MulAdd(f, V::Sub(q1, q0), q0);
+    if(table.tail)
+    {
+      Vec v = V::Mul(V::Sub(u, V::Set1(table.head)), V::Set1(table.tail_norm));
+      Vec x = V::MulAdd(v, V::Set1(table.tail_c), V::Set1(1.));
+      Vec tail = V::MulAdd(V::Log(x), V::Set1(table.tail_scale), V::Set1(table.tail_start));
+      t = V::Blend(t, tail, V::GreaterEqual(u, V::Set1(table.head)));
+    }
+    return t;
+  }
+
+  template<class V> void TransformBatch(const TimingSampler::Table& table, int n, double* u)
+  {
+    int i = 0;
+    for(; i + V::kWidth <= n; i += V::kWidth)
+    {
+      V::Store(u + i, TransformVector<V>(table, V::Load(u + i)));
+    }
+    for(; i < n; i++) {u[i] = TransformVector<ScalarOps>(table, u[i]); }
+  }
+
+  //One vector of uniforms into times from the mixture of two tables (with
+  //the same nlevels), b's distribution with weight w: a uniform below w is
+  //b's, scaled up to cover (0, 1), one above a's, so each costs one table
+  //lookup. A table without a tail is given a head no uniform reaches.
+  template<class V> typename V::Vec TransformMixtureVector(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, typename V::Vec u)
+  {
+    typedef typename V::Vec Vec;
+    typename V::Mask from_a = V::GreaterEqual(u, V::Set1(w));
+    Vec x = V::Blend(V::Mul(u, V::Set1(1/w)), V::Mul(V::Sub(u, V::Set1(w)), V::Set1(1/(1 - w))), from_a);
+    Vec scale = V::Blend(V::Set1(b.scale), V::Set1(a.scale), from_a);
+    Vec level = V::Min(V::Mul(x, scale), V::Set1(a.nlevels));
+    typename V::Index j = V::Truncate(V::Min(level, V::Set1(a.nlevels - 1)));
+    Vec f = V::Sub(level, V::ToDouble(j));
+    Vec q0 = V::Blend(V::Gather(b.quantiles, j), V::Gather(a.quantiles, j), from_a);
+    Vec q1 = V::Blend(V::Gather(b.quantiles + 1, j), V::Gather(a.quantiles + 1, j), from_a);
+    Vec t = V::MulAdd(f, V::Sub(q1, q0), q0);
+    if(a.tail || b.tail)
+    {
+      Vec head = V::Blend(V::Set1(b.tail ? b.head : 2.), V::Set1(a.tail ? a.head : 2.), from_a);
+      Vec v = V::Mul(V::Sub(x, head), V::Blend(V::Set1(b.tail_norm), V::Set1(a.tail_norm), from_a));
+      Vec y = V::MulAdd(v, V::Blend(V::Set1(b.tail_c), V::Set1(a.tail_c), from_a), V::Set1(1.));
+      Vec tail = V::MulAdd(V::Log(y), V::Blend(V::Set1(b.tail_scale), V::Set1(a.tail_scale), from_a),
+                           V::Blend(V::Set1(b.tail_start), V::Set1(a.tail_start), from_a));
+      t = V::Blend(t, tail, V::GreaterEqual(x, head));
+    }
+    return t;
+  }
+
+  template<class V> void TransformBetweenBatch(const TimingSampler::Table& a, const TimingSampler::Table& b, double w, int n, double* u)
+  {
+    if(w <= 0) {TransformBatch<V>(a, n, u); return; }
+    if(w >= 1) {TransformBatch<V>(b, n, u); return; }
+    int i = 0;
+    for(; i + V::kWidth <= n; i += V::kWidth)
+    {
+      V::Store(u + i, TransformMixtureVector<V>(a, b, w, V::Load(u + i)));
+    }
+    for(; i < n; i++) {u[i] = TransformMixtureVector<ScalarOps>(a, b, w, u[i]); }
+  }
+
+}
+
+#endif
@@ -0,0 +1,201 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "TRandom.h"
+
+#include "timing_tables.h"
+#include "utility_functions.h"
+
+using namespace std;
+
+namespace {
+
+	const char kTimingMagic[8] = {'S','B','N','D','T','I','M','E'};
+	const uint32_t kTimingVersion = 3;
+
+	//The grids: the ranges the parametrizations are valid in
+	const double kVUVFirst = 10.;      //cm
+	const double kVUVStep = 2.5;
+	const int kVUVPoints = 297;        //to 750 cm
+	const double kVisibleFirst = 8.;   //ns
+	const double kVisibleStep = 0.25;
+	const int kVisiblePoints = 189;    //to 55 ns
+
+}
+
+TimingTables::TimingTables() :
+	nlevels_(0)
+{
+}
+
+//A point whose parameters fail, or whose distribution has no probability,
+//gives times of 0
+void TimingTables::BuildGrid(Grid& grid, bool (*parameters)(double, double[6])) const
+{
+	TimingSampler::Table empty = {nlevels_, 0, 1., double(nlevels_), false, 0, 0, 0, 0};
+	grid.points.assign(grid.npoints, empty);
+	grid.quantiles.assign(size_t(grid.npoints)*(nlevels_ + 1), 0);
+	for(int i = 0; i < grid.npoints; i++)
+	{
+		double pars[6];
+		TimingSampler sampler;
+		if(!parameters(grid.first + i*grid.step, pars) || !sampler.SetLandauPlusExpo(pars)) {continue; }
+		TimingSampler::Table table = sampler.GetTable();
+		std::copy(table.quantiles, table.quantiles + nlevels_ + 1, &grid.quantiles[size_t(i)*(nlevels_ + 1)]);
+		table.quantiles = 0;
+		grid.points[i] = table;
+	}
+}
+
+void TimingTables::Build()
+{
+	cout << "Building the photon timing tables..." << endl;
+	nlevels_ = TimingSampler::kLevels;
+	grids_[0].npoints = kVUVPoints;
+	grids_[0].first = kVUVFirst;
+	grids_[0].step = kVUVStep;
+	grids_[1].npoints = kVisiblePoints;
+	grids_[1].first = kVisibleFirst;
+	grids_[1].step = kVisibleStep;
+	BuildGrid(grids_[0], utility::VUVTimingParameters);
+	BuildGrid(grids_[1], utility::VisibleTimingParametersOnlyCathode);
+}
+
+bool TimingTables::Load(std::string cachefile)
+{
+	//what the parametrizations give now, to compare with the cache's
+	double probe[2][6];
+	utility::VUVTimingParameters(kVUVFirst, probe[0]);
+	utility::VisibleTimingParametersOnlyCathode(kVisibleFirst, probe[1]);
+
+	ifstream in(cachefile.c_str(), ios::binary);
+	TimingTableHeader header;
+	bool ok = in.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+	          memcmp(header.magic, kTimingMagic, sizeof(kTimingMagic)) == 0 && header.version == kTimingVersion &&
+	          header.nlevels == TimingSampler::kLevels && header.npoints[0] == kVUVPoints && header.npoints[1] == kVisiblePoints &&
+	          header.first[0] == kVUVFirst && header.step[0] == kVUVStep && header.first[1] == kVisibleFirst && header.step[1] == kVisibleStep;
+	for(int j = 0; ok && j < 2; j++)
+	{
+		for(int p = 0; p < 6; p++)
+		{
+			if(fabs(header.probe[j][p] - probe[j][p]) > 1e-6*max(1., fabs(probe[j][p]))) {ok = false; }
+		}
+	}
+	if(ok)
+	{
+		nlevels_ = header.nlevels;
+		for(int j = 0; j < 2; j++)
+		{
+			Grid& grid = grids_[j];
+			grid.npoints = header.npoints[j];
+			grid.first = header.first[j];
+			grid.step = header.step[j];
+			vector<TimingPointRecord> records(grid.npoints);
+			in.read(reinterpret_cast<char*>(&records[0]), records.size()*sizeof(TimingPointRecord));
+			grid.points.resize(grid.npoints);
+			for(int i = 0; i < grid.npoints; i++)
+			{
+				const TimingPointRecord& r = records[i];
+				TimingSampler::Table table = {nlevels_, 0, r.head, r.scale, r.tail != 0, r.tail_norm, r.tail_start, r.tail_scale, r.tail_c};
+				grid.points[i] = table;
+			}
+			grid.quantiles.resize(size_t(grid.npoints)*(nlevels_ + 1));
+			in.read(reinterpret_cast<char*>(&grid.quantiles[0]), grid.quantiles.size()*sizeof(double));
+		}
+		if(in)
+		{
+			cout << "Photon timing tables read from " << cachefile << endl;
+			return true;
+		}
+	}
+
+	Build();
+	return Write(cachefile);
+}
+
+bool TimingTables::Write(std::string cachefile) const
+{
+	TimingTableHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kTimingMagic, sizeof(kTimingMagic));
+	header.version = kTimingVersion;
+	header.nlevels = nlevels_;
+	for(int j = 0; j < 2; j++)
+	{
+		header.npoints[j] = grids_[j].npoints;
+		header.first[j] = grids_[j].first;
+		header.step[j] = grids_[j].step;
+	}
+	utility::VUVTimingParameters(grids_[0].first, header.probe[0]);
+	utility::VisibleTimingParametersOnlyCathode(grids_[1].first, header.probe[1]);
+
+	string tmpfile = cachefile + ".tmp";
+	ofstream out(tmpfile.c_str(), ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for(int j = 0; j < 2; j++)
+	{
+		const Grid& grid = grids_[j];
+		vector<TimingPointRecord> records(grid.npoints);
+		memset(&records[0], 0, records.size()*sizeof(TimingPointRecord));
+		for(int i = 0; i < grid.npoints; i++)
+		{
+			const TimingSampler::Table& table = grid.points[i];
+			TimingPointRecord& r = records[i];
+			r.head = table.head;
+			r.scale = table.scale;
+			r.tail_norm = table.tail_norm;
+			r.tail_start = table.tail_start;
+			r.tail_scale = table.tail_scale;
+			r.tail_c = table.tail_c;
+			r.tail = table.tail;
+		}
+		out.write(reinterpret_cast<const char*>(&records[0]), records.size()*sizeof(TimingPointRecord));
+		out.write(reinterpret_cast<const char*>(&grid.quantiles[0]), grid.quantiles.size()*sizeof(double));
+	}
+	out.close();
+	if(!out || rename(tmpfile.c_str(), cachefile.c_str()) != 0)
+	{
+		cout << "Error writing the photon timing tables: " << cachefile << endl;
+		remove(tmpfile.c_str());
+		return false;
+	}
+	cout << "Photon timing tables written to " << cachefile << endl;
+	return true;
+}
+
+//Point i's table, with its quantiles
+TimingSampler::Table TimingTables::Point(const Grid& grid, int i) const
+{
+	TimingSampler::Table table = grid.points[i];
+	table.quantiles = &grid.quantiles[size_t(i)*(nlevels_ + 1)];
+	return table;
+}
+
+//From the tables of the grid points either side, mixed in proportion to how
+//close x is to each
+void TimingTables::Sample(const Grid& grid, double x, int number_photons, std::vector<double>& times, TRandom* rng) const
+{
+	times.clear();
+	double position = (x - grid.first)/grid.step;
+	if(number_photons <= 0 || position < 0 || position > grid.npoints - 1) {return; }
+
+	int i = std::min(int(position), grid.npoints - 2);
+	double w = position - i;
+
+	times.resize(number_photons);
+	rng->RndmArray(number_photons, &times[0]);
+	TimingSampler::TransformBetween(Point(grid, i), Point(grid, i + 1), w, number_photons, &times[0]);
+}
+
+void TimingTables::SampleVUV(double distance, int number_photons, std::vector<double>& times, TRandom* rng) const
+{
+	Sample(grids_[0], distance, number_photons, times, rng);
+}
+
+void TimingTables::SampleVisibleOnlyCathode(double t0, int number_photons, std::vector<double>& times, TRandom* rng) const
+{
+	Sample(grids_[1], t0, number_photons, times, rng);
+}
@@ -0,0 +1,84 @@
+#ifndef TIMING_TABLES_H
+#define TIMING_TABLES_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "timing_sampler.h"
+
+class TRandom;
+
+//Header of the timing table cache written by TimingTables::Write. The VUV
+//grid follows, then the visible one, each npoints TimingPointRecords and
+//then npoints x (nlevels + 1) doubles of quantiles. probe holds the
+//parametrization's parameters at the first point of each grid when the
+//cache was written, so a cache from other parametrizations is not used.
+struct TimingTableHeader{
+    char magic[8];          //"SBNDTIME"
+    uint32_t version;
+    int32_t nlevels;
+    int32_t npoints[2];     //VUV, visible
+    double first[2];
+    double step[2];
+    double probe[2][6];
+};
+
+//A grid point's TimingSampler::Table in the cache, without its quantiles
+struct TimingPointRecord{
+    double head;
+    double scale;
+    double tail_norm;
+    double tail_start;
+    double tail_scale;
+    double tail_c;
+    int32_t tail;
+    int32_t reserved;
+};
+
+//Inverse-CDF tables of the photon transport time parametrizations, so that a
+//photon's arrival time costs one random number and two table lookups rather
+//than building the parametrization's TF1s for every PMT of every event.
+//The VUV tables are on a grid of distance (10 - 750 cm), the visible ones of
+//t0 (8 - 55 ns), the ranges utility::GetVUVTime and
+//utility::GetVisibleTimeOnlyCathode cover. Each grid point holds the
+//TimingSampler table of its parameters (quantiles of the Landau, the
+//exponential tail inverted exactly), and a PMT's photons are turned into
+//times by the sampler's SIMD kernels from the tables of the two grid points
+//either side, mixed in proportion to how close the distance (t0) is to
+//each, so the distribution moves smoothly between grid points.
+class TimingTables{
+
+  public:
+    TimingTables();
+
+    //Reads the tables from cachefile, or builds them (a few seconds) and
+    //writes cachefile if it is missing or was made from other parametrizations
+    bool Load(std::string cachefile);
+    void Build();
+    bool Write(std::string cachefile) const;
+
+    //The transport times (ns) of number_photons photons, in place of what
+    //times held; none outside the range of the parametrization, as
+    //GetVUVTime and GetVisibleTimeOnlyCathode. Thread safe.
+    void SampleVUV(double distance, int number_photons, std::vector<double>& times, TRandom* rng) const;
+    void SampleVisibleOnlyCathode(double t0, int number_photons, std::vector<double>& times, TRandom* rng) const;
+
+  private:
+    struct Grid{
+      int npoints;
+      double first;
+      double step;
+      std::vector<TimingSampler::Table> points; //quantiles not set, they are in quantiles
+      std::vector<double> quantiles;            //npoints x (nlevels_ + 1)
+    };
+
+    void BuildGrid(Grid& grid, bool (*parameters)(double, double[6])) const;
+    TimingSampler::Table Point(const Grid& grid, int i) const;
+    void Sample(const Grid& grid, double x, int number_photons, std::vector<double>& times, TRandom* rng) const;
+
+    int nlevels_;
+    Grid grids_[2]; //VUV, visible
+};
+
+#endif
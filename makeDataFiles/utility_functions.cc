@@ -1,8 +1,32 @@
 #include "utility_functions.h"
 #include <cmath>
+#include <cstdlib>
 #include "TMath.h"
 #include "TVector3.h"
 #include "TF1.h"
+#include "timing_kernels.h"
+#include "timing_sampler.h"
+
+namespace {
+	thread_local PhiloxRandom* thread_generator = nullptr;
+}
+
+PhiloxRandom* utility::ThreadRandom::Generator()
+{
+	return thread_generator ? thread_generator : &main_;
+}
+
+void utility::ThreadRandom::StartThread()
+{
+	delete thread_generator;
+	thread_generator = new PhiloxRandom(main_.GetRunSeed());
+}
+
+void utility::ThreadRandom::EndThread()
+{
+	delete thread_generator;
+	thread_generator = nullptr;
+}
 
 //Poisson Distribution
 int utility::poisson(double mean, double draw, double eng)
@@ -35,6 +59,115 @@ int utility::poisson(double mean, double draw, double eng)
 }
 
 
+namespace {
+
+//log(k!) - log of Stirling's approximation to it
+double stirling_correction(int k)
+{
+	static const double table[10] = {0.08106146679532726, 0.04134069595540929, 0.02767792568499834, 0.02079067210376509, 0.01664469118982119,
+	                                 0.01387612882307075, 0.01189670994589177, 0.01041126526197209, 0.009255462182712733, 0.008330563433362871};
+	if(k < 10) {return table[k]; }
+	double ikp1 = 1. / (k + 1);
+	double ikp1_2 = ikp1 * ikp1;
+	return (1. / 12 - (1. / 360 - ikp1_2 / 1260) * ikp1_2) * ikp1;
+}
+
+}
+
+//Binomial number of successes in n trials of probability p. Below a mean of
+//10 the cumulative distribution is walked from 0; above it BTRD (Hormann,
+//"The generation of binomial random variates", 1993) samples by transformed
+//rejection, two or three random numbers per draw on average.
+int utility::binomial(int n, double p, TRandom* rng)
+{
+	if(n <= 0 || p <= 0) {return 0; }
+	if(p >= 1) {return n; }
+	if(p > 0.5) {return n - binomial(n, 1 - p, rng); }
+
+	if(n * p < 10) {
+		const double q = 1 - p;
+		const double s = p / q;
+		const double a = (n + 1) * s;
+		const double r0 = std::pow(q, n);
+		while(true) {
+			double u = rng->Rndm();
+			double r = r0;
+			int x = 0;
+			while(u > r && x < n) {
+				u -= r;
+				x++;
+				r *= a / x - s;
+			}
+			if(u <= r) {return x; }
+			//rounding left u above the last term: draw again
+		}
+	}
+
+	const double q = 1 - p;
+	const int m = int((n + 1) * p);
+	const double r = p / q;
+	const double nr = (n + 1) * r;
+	const double npq = n * p * q;
+	const double sqrt_npq = std::sqrt(npq);
+	const double b = 1.15 + 2.53 * sqrt_npq;
+	const double a = -0.0873 + 0.0248 * b + 0.01 * p;
+	const double c = n * p + 0.5;
+	const double alpha = (2.83 + 5.1 / b) * sqrt_npq;
+	const double v_r = 0.92 - 4.2 / b;
+	const double u_rv_r = 0.86 * v_r;
+
+	while(true) {
+		double v = rng->Rndm();
+		double u;
+		if(v <= u_rv_r) {
+			//inside the box under the hat: accept straight away
+			u = v / v_r - 0.43;
+			return int(std::floor((2 * a / (0.5 - std::fabs(u)) + b) * u + c));
+		}
+		if(v >= v_r) {
+			u = rng->Rndm() - 0.5;
+		}
+		else {
+			u = v / v_r - 0.93;
+			u = ((u < 0) ? -0.5 : 0.5) - u;
+			v = rng->Rndm() * v_r;
+		}
+
+		double us = 0.5 - std::fabs(u);
+		double kd = std::floor((2 * a / us + b) * u + c);
+		if(kd < 0 || kd > n) {continue; }
+		int k = int(kd);
+		v = v * alpha / (a / (us * us) + b);
+		int km = std::abs(k - m);
+
+		if(km <= 15) {
+			//f(k)/f(m) by recursion
+			double f = 1;
+			if(m < k) {
+				for(int i = m + 1; i <= k; i++) {f *= nr / i - r; }
+			}
+			else if(m > k) {
+				for(int i = k + 1; i <= m; i++) {v *= nr / i - r; }
+			}
+			if(v <= f) {return k; }
+			continue;
+		}
+
+		//squeeze between bounds on log(f(k)/f(m)), and the exact value only
+		//when that fails
+		v = std::log(v);
+		double rho = (km / npq) * (((km / 3. + 0.625) * km + 1. / 6) / npq + 0.5);
+		double t = -double(km) * km / (2 * npq);
+		if(v < t - rho) {return k; }
+		if(v > t + rho) {continue; }
+		double nm = n - m + 1;
+		double h = (m + 0.5) * std::log((m + 1) / (r * nm)) + stirling_correction(m) + stirling_correction(n - m);
+		double nk = n - k + 1;
+		if(v <= h + (n + 1) * std::log(nm / nk) + (k + 0.5) * std::log(nk * r / (k + 1)) - stirling_correction(k) - stirling_correction(n - k)) {return k; }
+	}
+}
+
+
 //Beta decay function
 double utility::SpectrumFunction(double *x, double *par)
 {
@@ -167,6 +300,11 @@ double utility::LandauPlusLandauFinal(double *x, double *par)
    std::vector<double> arrival_time_distrb;
    return arrival_time_distrb;
    }*/
+bool utility::VUVTimingParameters(double distance, double parsfinal[6]) {
+	//-----Distances in cm and times in ns-----//
+	return timing::VUVParameters(distance, parsfinal);
+}
+
 std::vector<double> utility::GetVUVTime(double distance, int number_photons) {
 	//-----Distances in cm and times in ns-----//
 
@@ -175,105 +313,14 @@ std::vector<double> utility::GetVUVTime(double distance, int number_photons) {
 	std::vector<double> arrival_time_distrb;
 	arrival_time_distrb.clear();
 	arrival_time_distrb.reserve(number_photons);
-	// Parametrization data:
-	double landauNormpars[8] = {7.85903, -0.108075, 0.00110999, -6.90009e-06,
-		                    2.52576e-08, -5.39078e-11, 6.20863e-14, -2.97559e-17};
-	double landauMPVpars[5] = {1.20259, 0.0582674, 0.000308053, -2.71782e-07, -3.37159e-10};
-	double landauWidthpars[4] = {0.346667, -0.00768231, 0.000211825, -3.81361e-07};
-	double expoCtepars[7] = {13.6592, -0.188798, 0.00192431, -1.10689e-05, 3.38425e-08,
-		                 -5.20737e-11, 3.17657e-14};
-	double expoSlopepars[8] = {-0.57011, 0.0156393, -0.000197461, 1.34491e-06, -5.24544e-09,
-		                   1.1703e-11, -1.38811e-14, 6.78368e-18};
-	//range of distances where the parametrization is valid [~10 - 500cm], then:
-	const double d_break = 500.;
-	const double d_max = 750.;
-	// Defining the function for the different parameters:
-	TF1 fparslogNorm ("fparslogNorm","pol7",0,d_break);
-	fparslogNorm.SetParameters(landauNormpars);
-	TF1 fparsMPV ("fparsMPV","pol4",0,d_break);
-	fparsMPV.SetParameters(landauMPVpars);
-	TF1 fparsWidth ("fparsWidth","pol3",0,d_break);
-	fparsWidth.SetParameters(landauWidthpars);
-	TF1 fparsCte ("fparsCte","pol6",0,d_break);
-	fparsCte.SetParameters(expoCtepars);
-	TF1 fparsSlope ("fparsSlope","pol7",0,d_break);
-	fparsSlope.SetParameters(expoSlopepars);
-	// At long distances we extrapolate the behaviour of the parameters:
-	TF1 fparslogNorm_far ("fparslogNorm_far","expo",d_break, d_max);
-	double landauNormpars_far[2] = {2.23151, -0.00627503};
-	fparslogNorm_far.SetParameters(landauNormpars_far);
-	TF1 fparsMPV_far ("fparsMPV_far","pol1",d_break, d_max);
-	double landauMPVpars_far[2] = {-3.04952, 0.128638};
-	fparsMPV_far.SetParameters(landauMPVpars_far);
-	TF1 fparsCte_far ("fparsCte_far","expo",d_break-50., d_max);
-	double expoCtepars_far[2] = {3.69578, -0.00989582};
-	fparsCte_far.SetParameters(expoCtepars_far);
-
-	if(distance < 10 || distance > d_max) {
-		//std::cout<<"WARNING: Parametrization of Direct Light not fully reliable"<<std::endl;
-		//std::cout<<"Too close/far to the PMT  -> set 0 VUV photons(?)!!!!!!"<<std::endl;
-		return arrival_time_distrb;
-	}
-	//signals (remember this is transportation) no longer than 1us
-	const double signal_t_range = 1000.;
-	const double vuv_vgroup = 10.13;//cm/ns
-	double t_direct = distance/vuv_vgroup;
-
-	// Defining the two functions (Landau + Exponential) describing the timing vs distance
-	double pars_landau[3]= {fparsMPV.Eval(distance), fparsWidth.Eval(distance),
-		                pow(10.,fparslogNorm.Eval(distance))};
-	if(distance > d_break) {
-		pars_landau[0]=fparsMPV_far.Eval(distance);
-		pars_landau[1]=fparsWidth.Eval(d_break);
-		pars_landau[2]=pow(10.,fparslogNorm_far.Eval(distance));
-	}
-	TF1 flandau ("flandau","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau.SetParameters(pars_landau);
+	double parsfinal[6];
+	if(!VUVTimingParameters(distance, parsfinal)) {return arrival_time_distrb; }
+	//tabulated once, then all the photons in one batch (timing_sampler.h)
+	TimingSampler sampler;
+	if(number_photons <= 0 || !sampler.SetLandauPlusExpo(parsfinal)) {return arrival_time_distrb; }
+	arrival_time_distrb.resize(number_photons);
+	sampler.Sample(number_photons, &arrival_time_distrb[0], gRandom);
 
-	double pars_expo[2] = {fparsCte.Eval(distance), fparsSlope.Eval(distance)};
-	if(distance > (d_break - 50.)) {
-		pars_expo[0] = fparsCte_far.Eval(distance);
-		pars_expo[1] = fparsSlope.Eval(d_break - 50.);
-	}
-	TF1 fexpo ("fexpo","expo",0, signal_t_range/2);
-	fexpo.SetParameters(pars_expo);
-
-	//this is to find the intersection point between the two functions:
-	TF1 fint ("fint",utility::finter_d,flandau.GetMaximumX(),3*t_direct,5);
-	double parsInt[5] = {pars_landau[0], pars_landau[1], pars_landau[2], pars_expo[0], pars_expo[1]};
-	fint.SetParameters(parsInt);
-	double t_int = fint.GetMinimumX();
-	double minVal = fint.Eval(t_int);
-	//the functions must intersect!!!
-	//if(minVal>0.015)
-	//std::cout<<"WARNING: Parametrization of Direct Light discontinuous (landau + expo)!!!!!!"<<std::endl;
-
-
-	TF1 fVUVTiming ("fTiming",utility::LandauPlusExpoFinal,0,signal_t_range,6);
-	double parsfinal[6] = {t_int, pars_landau[0], pars_landau[1], pars_landau[2], pars_expo[0], pars_expo[1]};
-	fVUVTiming.SetParameters(parsfinal);
-	// Set the number of points used to sample the function
-
-	int f_sampling = 1000;
-	if(distance < 50)
-		f_sampling *= 10;
-	fVUVTiming.SetNpx(f_sampling);
-
-	for(int i=0; i<number_photons; i++)
-		arrival_time_distrb.push_back(fVUVTiming.GetRandom());
-
-	//deleting ...
-/*
-        delete fparslogNorm;
-        delete fparsMPV;
-        delete fparsWidth;
-        delete fparsCte;
-        delete fparsSlope;
-        delete flandau;
-        delete fexpo;
-        delete fint;
-        delete fVUVTiming;
- */
 	return arrival_time_distrb;
 }
 
@@ -287,6 +334,11 @@ std::vector<double> utility::GetVUVTime(double distance, int number_photons) {
    return arrival_time_distrb;
    }*/
 
+bool utility::VisibleTimingParametersOnlyCathode(double t0, double parsfinal[6]){
+	//-----Distances in cm and times in ns-----//
+	return timing::VisibleOnlyCathodeParameters(t0, parsfinal);
+}
+
 std::vector<double> utility::GetVisibleTimeOnlyCathode(double t0, int number_photons){
 	//-----Distances in cm and times in ns-----//
 
@@ -295,87 +347,14 @@ std::vector<double> utility::GetVisibleTimeOnlyCathode(double t0, int number_pho
 	std::vector<double> arrival_time_distrb;
 	arrival_time_distrb.clear();
 	arrival_time_distrb.reserve(number_photons);
-	// Parametrization data:
-	double landauNormpars[4] = {7.54642, -0.441946, 0.0107579, -9.53399e-05};
-	double landauMPVpars[4] = {-1.61482, 1.18624, 0.00105223, -9.52016e-05};
-	double landauWidthpars[4] = {0.440124, -0.0557912, 0.00544957, -9.39128e-05};
-	double expoCtepars[4] = {14.6874, -0.896761, 0.0214977, -0.000185728};
-	double expoSlopepars[5] = {-0.650584, 0.0800897, -0.00379933, 7.91909e-05, -6.10836e-07};
-	//range of t0s where the parametrization is valid [~8 - 55ns], then:
-	const double t0_max = 55.;
-	// Defining the function for the different parameters:
-	TF1 fparslogNorm ("fparslogNorm","pol3",0,t0_max);
-	fparslogNorm.SetParameters(landauNormpars);
-	TF1 fparsMPV ("fparsMPV","pol3",0,t0_max);
-	fparsMPV.SetParameters(landauMPVpars);
-	TF1 fparsWidth ("fparsWidth","pol3",0,t0_max);
-	fparsWidth.SetParameters(landauWidthpars);
-	TF1 fparsCte ("fparsCte","pol3",0,t0_max);
-	fparsCte.SetParameters(expoCtepars);
-	TF1 fparsSlope ("fparsSlope","pol4",0,t0_max);
-	fparsSlope.SetParameters(expoSlopepars);
-
-
-	if(t0 < 8 || t0 > t0_max) {
-		//std::cout<<"WARNING: Parametrization of Cathode-Only reflected Light not fully reliable"<<std::endl;
-		//std::cout<<"Too close/far to the PMT  -> set 0 Visible photons(?)!!!!!!"<<std::endl;
-		return arrival_time_distrb;
-	}
-	//signals (remember this is transportation) no longer than 1us
-	const double signal_t_range = 1000.;
-
-	double pars_landau[3] = {fparsMPV.Eval(t0), fparsWidth.Eval(t0),
-		                 pow(10.,fparslogNorm.Eval(t0))};
-	double pars_expo[2] = {fparsCte.Eval(t0), fparsSlope.Eval(t0)};
-	double t0_break_point = 42.;//ns after the parametrization must be corrected (lack of statistics!)
-	if(t0 > t0_break_point) {
-		pars_landau[0] = -0.798934 + 1.06216*t0;
-		pars_landau[1] = fparsWidth.Eval(t0_break_point);
-		pars_landau[2] = pow(10.,fparslogNorm.Eval(t0_break_point));
-		pars_expo[0] = fparsCte.Eval(t0_break_point);
-		pars_expo[1] = fparsSlope.Eval(t0_break_point);
-	}
+	double parsfinal[6];
+	if(!VisibleTimingParametersOnlyCathode(t0, parsfinal)) {return arrival_time_distrb; }
+	//tabulated once, then all the photons in one batch (timing_sampler.h)
+	TimingSampler sampler;
+	if(number_photons <= 0 || !sampler.SetLandauPlusExpo(parsfinal)) {return arrival_time_distrb; }
+	arrival_time_distrb.resize(number_photons);
+	sampler.Sample(number_photons, &arrival_time_distrb[0], gRandom);
 
-	// Defining the two functions (Landau + Exponential) describing the timing vs t0
-	TF1 flandau ("flandau","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau.SetParameters(pars_landau);
-	TF1 fexpo ("fexpo","expo",0, signal_t_range/2);
-	fexpo.SetParameters(pars_expo);
-	//this is to find the intersection point between the two functions:
-	TF1 fint ("fint",utility::finter_d,flandau.GetMaximumX(),2*t0,5);
-	double parsInt[5] = {pars_landau[0], pars_landau[1], pars_landau[2], pars_expo[0], pars_expo[1]};
-	fint.SetParameters(parsInt);
-	double t_int = fint.GetMinimumX();
-	double minVal = fint.Eval(t_int);
-	//the functions must intersect!!!
-	//if(minVal>0.015)
-	//std::cout<<"WARNING: Parametrization of Direct Light discontinuous (landau + expo)!!!!!!"<<std::endl;
-
-	TF1 fVisTiming ("fTiming",utility::LandauPlusExpoFinal,0,signal_t_range,6);
-	double parsfinal[6] = {t_int, pars_landau[0], pars_landau[1], pars_landau[2], pars_expo[0], pars_expo[1]};
-	fVisTiming.SetParameters(parsfinal);
-	// Set the number of points used to sample the function
-
-	int f_sampling = 1000;
-	if(t0 < 20)
-		f_sampling *= 10;
-	fVisTiming.SetNpx(f_sampling);
-
-	for(int i=0; i<number_photons; i++)
-		arrival_time_distrb.push_back(fVisTiming.GetRandom());
-
-	//deleting ...
-/*
-        delete fparslogNorm;
-        delete fparsMPV;
-        delete fparsWidth;
-        delete fparsCte;
-        delete fparsSlope;
-        delete flandau;
-        delete fexpo;
-        delete fint;
-        delete fVisTiming;
- */
 	return arrival_time_distrb;
 }
 
@@ -397,97 +376,20 @@ std::vector<double> utility::GetVisibleTimeFullConfig2(double t0, double tmean,
 	arrival_time_distrb.clear();
 	arrival_time_distrb.reserve(number_photons);
 
-	double divide = 0.43*tmean + 7;
-	double vuv_vgroup = 10.13;//cm/ns
-	double t_direct = distance/vuv_vgroup;
-
-	std::string pols[6] = {"pol3", "pol1", "pol4", "pol2", "pol4", "pol2"};
-	double landau1Norm[4] = {9.78924, -0.808646, 0.0286551, -0.000342326};
-	double landau1MPV[2] = {-9.04501, 1.76972};
-	double landau1Width[5] = {24.7515, -5.71531, 0.45703, -0.0144995, 0.000163086};
-	double landau2Norm[3] = {3.44352, -0.0812814, 0.00118423};
-	double landau2MPV[5] = {282.128, -57.8334, 4.50742, -0.143848, 0.00164436};
-	double landau2Width[3] = {15.1667, -0.0786729, -0.000696796};
-
-	///range of t0s where the parametrization is valid [~4 - 52ns (60ns for t_direct)], then:
-	const double t0_max = 52.;
-	const double t_direct_max = 60.;
-	double t0_break_point = 35.;//ns after the parametrization must be corrected (lack of statistics!)
-	double t0_max_mod = t_direct_max;
-
-	if(t0 < 10 || t0 > t0_max || t_direct > t_direct_max) {
+	//Landau2's width follows the direct VUV time rather than t0, for a better
+	//correlation; valid for t0 ~10 - 52ns and t_direct up to 60ns
+	double parsfinal[7];
+	if(!timing::VisibleFullConfig2Parameters(t0, distance, parsfinal)) {
 		//std::cout<<"WARNING: Parametrization of Full coverage reflected Light not fully reliable"<<std::endl;
 		//std::cout<<"Too close/far to the PMT  -> set 0 Visible photons(?)!!!!!!"<<std::endl;
 		return arrival_time_distrb;
 	}
+	//tabulated once, then all the photons in one batch (timing_sampler.h)
+	TimingSampler sampler;
+	if(number_photons <= 0 || !sampler.SetLandauPlusLandau(parsfinal)) {return arrival_time_distrb; }
+	arrival_time_distrb.resize(number_photons);
+	sampler.Sample(number_photons, &arrival_time_distrb[0], gRandom);
 
-
-	// Defining the function for the different parameters:
-	TF1 fparslogNorm1 ("fparslogNorm1",pols[0].c_str(),0,t0_max);
-	fparslogNorm1.SetParameters(landau1Norm);
-	TF1 fparsMPV1 ("fparsMPV1",pols[1].c_str(),0,t0_max);
-	fparsMPV1.SetParameters(landau1MPV);
-	TF1 fparsWidth1 ("fparsWidth1",pols[2].c_str(),0,t0_max);
-	fparsWidth1.SetParameters(landau1Width);
-	TF1 fparslogNorm2 ("fparslogNorm2",pols[3].c_str(),0,t0_max);
-	fparslogNorm2.SetParameters(landau2Norm);
-	TF1 fparsMPV2 ("fparsMPV2",pols[4].c_str(),0,t0_max);
-	fparsMPV2.SetParameters(landau2MPV);
-	TF1 fparsWidth2 ("fparsWidth2",pols[5].c_str(),0,t0_max_mod);
-	fparsWidth2.SetParameters(landau2Width);
-
-
-	//signals (remember this is transportation) no longer than 1us
-	const double signal_t_range = 1000.;
-
-	double pars_landau1[3] = {fparsMPV1.Eval(t0), fparsWidth1.Eval(t0), pow(10.,fparslogNorm1.Eval(t0))};
-	double pars_landau2[3] = {fparsMPV2.Eval(t0), fparsWidth2.Eval(t_direct), pow(10.,fparslogNorm2.Eval(t0))};
-	//To improve the degree of correlation in the estimation of Landau2-width,
-	//in the population2 this parameter is estimated as a function of t_vuv, insted of t0
-
-	if(t0 > t0_break_point) {
-		pars_landau1[1] = fparsWidth1.Eval(t0_break_point);
-		pars_landau1[2] = pow(10.,fparslogNorm1.Eval(t0_break_point));
-		pars_landau2[0] = fparsMPV2.Eval(t0_break_point);
-		pars_landau2[2] = pow(10.,fparslogNorm2.Eval(t0_break_point));
-	}
-
-	// Defining the two functions (Landau + Landau) describing the timing vs t0:
-	TF1 flandau1 ("flandau1","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau1.SetParameters(pars_landau1);
-	TF1 flandau2 ("flandau2","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau2.SetParameters(pars_landau2);
-	TF1 fint ("fint",utility::finter_r,flandau1.GetMaximumX(),2*t0,6);
-	double parsInt[6] = {pars_landau1[0], pars_landau1[1], pars_landau1[2], pars_landau2[0],
-		             pars_landau2[1], pars_landau2[2]};
-	fint.SetParameters(parsInt);
-	double t_int = fint.GetMinimumX();
-	double minVal = fint.Eval(t_int);
-
-	TF1 fVisibleTiming ("fTiming",utility::LandauPlusLandauFinal,0,signal_t_range,7);
-	double parsfinal[7] = {t_int, pars_landau1[0], pars_landau1[1], pars_landau1[2], pars_landau2[0],
-		               pars_landau2[1], pars_landau2[2]};
-	fVisibleTiming.SetParameters(parsfinal);
-	// Set the number of points used to sample the function
-
-	int f_sampling = 1500;
-	fVisibleTiming.SetNpx(f_sampling);
-	for(int i=0; i<number_photons; i++)
-		arrival_time_distrb.push_back(fVisibleTiming.GetRandom());
-
-	//deleting ...
-/*
-        delete fparslogNorm1;
-        delete fparsMPV1;
-        delete fparsWidth1;
-        delete fparslogNorm2;
-        delete fparsMPV2;
-        delete fparsWidth2;
-        delete flandau1;
-        delete flandau2;
-        delete fint;
-        delete fVisibleTiming;
- */
 	return arrival_time_distrb;
 
 }
@@ -498,97 +400,20 @@ std::vector<double> utility::GetVisibleTimeFullConfig1(double t0, double tmean,
 	std::vector<double> arrival_time_distrb;
 	arrival_time_distrb.clear();
 	arrival_time_distrb.reserve(number_photons);
-	// Parametrization data:
-	double divide = 0.43*tmean + 7;
-	double vuv_vgroup = 10.13;//cm/ns
-	double t_direct = distance/vuv_vgroup;
-
-	// Defining the parameters of the two populations:
-	std::string pols[6] = {"pol2", "pol2", "pol2", "pol2", "pol3", "pol2"};
-	double landau1Norm[3] = {4.80632, -0.227272, 0.00409071};
-	double landau1MPV[3] = {4.27391, 0.48747, 0.0312366};
-	double landau1Width[3] = {0.789521, -0.0763977, 0.0094536};
-	double landau2Norm[3] = {2.88774, -0.0188192, -0.00111117};
-	double landau2MPV[4] = {-55.8751, 14.6612, -0.878218, 0.0198729};
-	double landau2Width[3] = {10.5582, -0.539349, 0.0360326};
-
-	///range of t0s where the parametrization is valid [~4 - 52ns (60ns for t_direct)], then:
-	const double t0_max = 52.;
-	const double t_direct_max = 60.;
-	double t0_break_point = 35.;//ns after the parametrization must be corrected (lack of statistics!)
-	double t0_max_mod = t0_max;
-
-	if(t0 < 4 || t0 > t0_max) {
+
+	//valid for t0 ~4 - 52ns
+	double parsfinal[7];
+	if(!timing::VisibleFullConfig1Parameters(t0, parsfinal)) {
 		//std::cout<<"WARNING: Parametrization of Full coverage reflected Light not fully reliable"<<std::endl;
 		//std::cout<<"Too close/far to the PMT  -> set 0 Visible photons(?)!!!!!!"<<std::endl;
 		return arrival_time_distrb;
 	}
+	//tabulated once, then all the photons in one batch (timing_sampler.h)
+	TimingSampler sampler;
+	if(number_photons <= 0 || !sampler.SetLandauPlusLandau(parsfinal)) {return arrival_time_distrb; }
+	arrival_time_distrb.resize(number_photons);
+	sampler.Sample(number_photons, &arrival_time_distrb[0], gRandom);
 
-	// Defining the function for the different parameters:
-	TF1 fparslogNorm1 ("fparslogNorm1",pols[0].c_str(),0,t0_max);
-	fparslogNorm1.SetParameters(landau1Norm);
-	TF1 fparsMPV1 ("fparsMPV1",pols[1].c_str(),0,t0_max);
-	fparsMPV1.SetParameters(landau1MPV);
-	TF1 fparsWidth1 ("fparsWidth1",pols[2].c_str(),0,t0_max);
-	fparsWidth1.SetParameters(landau1Width);
-	TF1 fparslogNorm2 ("fparslogNorm2",pols[3].c_str(),0,t0_max);
-	fparslogNorm2.SetParameters(landau2Norm);
-	TF1 fparsMPV2 ("fparsMPV2",pols[4].c_str(),0,t0_max);
-	fparsMPV2.SetParameters(landau2MPV);
-	TF1 fparsWidth2 ("fparsWidth2",pols[5].c_str(),0,t0_max_mod);
-	fparsWidth2.SetParameters(landau2Width);
-
-
-	//signals (remember this is transportation) no longer than 1us
-	const double signal_t_range = 1000.;
-
-	double pars_landau1[3] = {fparsMPV1.Eval(t0), fparsWidth1.Eval(t0), pow(10.,fparslogNorm1.Eval(t0))};
-	double pars_landau2[3] = {fparsMPV2.Eval(t0), fparsWidth2.Eval(t0), pow(10.,fparslogNorm2.Eval(t0))};
-	//To improve the degree of correlation in the estimation of Landau2-width,
-	//in the population2 this parameter is estimated as a function of t_vuv, insted of t0
-	//prevent "bad" behaviour (below 6 ns) of the pol parametrizing this parameter (lack in stats):
-	if(t0 < 6)
-		pars_landau2[0] = fparsMPV2.Eval(6.);
-
-	// Defining the two functions (Landau + Landau) describing the timing vs t0:
-	TF1 flandau1 ("flandau1","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau1.SetParameters(pars_landau1);
-	TF1 flandau2 ("flandau2","[2]*TMath::Landau(x,[0],[1])",0,signal_t_range/2);
-	flandau2.SetParameters(pars_landau2);
-	TF1 fint ("fint",utility::finter_r,flandau1.GetMaximumX(),2*t0,6);
-	double parsInt[6] = {pars_landau1[0], pars_landau1[1], pars_landau1[2], pars_landau2[0],
-		             pars_landau2[1], pars_landau2[2]};
-	fint.SetParameters(parsInt);
-	double t_int = fint.GetMinimumX();
-	double minVal = fint.Eval(t_int);
-	//the functions must intersect!!!
-	//if(minVal>0.015)
-	//std::cout<<"WARNING: Parametrization of Reflected Light discontinuous (landau + landau)!!!!!!"<<std::endl;
-
-	TF1 fVisibleTiming ("fTiming",utility::LandauPlusLandauFinal,0,signal_t_range,7);
-	double parsfinal[7] = {t_int, pars_landau1[0], pars_landau1[1], pars_landau1[2], pars_landau2[0],
-		               pars_landau2[1], pars_landau2[2]};
-	fVisibleTiming.SetParameters(parsfinal);
-	// Set the number of points used to sample the function
-
-	int f_sampling = 1500;
-	fVisibleTiming.SetNpx(f_sampling);
-	for(int i=0; i<number_photons; i++)
-		arrival_time_distrb.push_back(fVisibleTiming.GetRandom());
-
-	//deleting ...
-/*
-        delete fparslogNorm1;
-        delete fparsMPV1;
-        delete fparsWidth1;
-        delete fparslogNorm2;
-        delete fparsMPV2;
-        delete fparsWidth2;
-        delete flandau1;
-        delete flandau2;
-        delete fint;
-        delete fVisibleTiming;
- */
 	return arrival_time_distrb;
 }
 
@@ -3,6 +3,8 @@
 
 #include <vector>
 #include "TVector3.h"
+#include "TRandom.h"
+#include "philox_random.h"
 
 //A large number of these are simple functions needed to create the distributions
 //such as beta decay or a poisson distribution.
@@ -12,12 +14,20 @@
   namespace utility{
 
     int poisson(double mean, double draw, double eng);
+    //Exact binomial draw (inversion for small means, Hormann's BTRD
+    //otherwise): a handful of random numbers whatever n is
+    int binomial(int n, double p, TRandom* rng);
     double SpectrumFunction(double *x, double *par);
     double fsn(double *x, double *par);
     double Rn_function(double *x, double *par);
     double Scintillation_function(double *t, double *par);
     std::vector<double> GetVUVTime(double distance, int number_photons);
     std::vector<double> GetVisibleTimeOnlyCathode(double t0, int number_photons);
+    //Parameters of the LandauPlusExpoFinal arrival time distribution those two
+    //sample from; false outside the range the parametrization covers. ROOT
+    //free (timing_kernels.h), so thread safe
+    bool VUVTimingParameters(double distance, double parsfinal[6]);
+    bool VisibleTimingParametersOnlyCathode(double t0, double parsfinal[6]);
     std::vector<double> GetVisibleTimeFullConfig1(double t0, double tmean, double distance, int number_photons);
     std::vector<double> GetVisibleTimeFullConfig2(double t0, double tmean, double distance, int number_photons);
     double TimingParamReflected(TVector3 ScintPoint, TVector3 OpDetPoint );
@@ -26,6 +36,29 @@
     double finter_r(double *x, double *par);
     double LandauPlusLandauFinal(double *x, double *par);
 
+    //Stands in for gRandom during the simulation: each thread draws from a
+    //PhiloxRandom of its own, all keyed with the run seed, and SetStream
+    //positions the calling thread's generator for the event (and PMT) it is
+    //about to simulate. The thread that makes it uses a generator held here;
+    //other threads draw from one of their own between StartThread and EndThread.
+    class ThreadRandom : public TRandom {
+      public:
+        ThreadRandom(TRandom* parent, uint32_t seed) : parent_(parent), main_(seed) {}
+        Double_t Rndm() override { return Generator()->Rndm(); }
+        void RndmArray(Int_t n, Float_t* array) override { Generator()->RndmArray(n, array); }
+        void RndmArray(Int_t n, Double_t* array) override { Generator()->RndmArray(n, array); }
+        void SetStream(uint64_t event, uint32_t pmt, uint32_t stream) { Generator()->SetStream(event, pmt, stream); }
+        PhiloxRandom* Generator();
+        TRandom* Parent() const { return parent_; } //the gRandom it replaced
+
+        void StartThread();
+        static void EndThread();
+
+      private:
+        TRandom* parent_;
+        PhiloxRandom main_;
+    };
+
   }
 
 #endif
@@ -0,0 +1,143 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <cstddef>
+
+//Regular voxel grid of a photon library: voxel IDs run x fastest, then y,
+//then z (id = ix + iy*nx + iz*nx*ny) and a voxel's position is its centre.
+//
+//The step counts are template parameters, so for a known grid such as the
+//SBND one the index arithmetic divides by constants. VoxelGrid<> takes them
+//at run time instead, for libraries on other grids. Nothing here allocates,
+//and the batch conversions are plain loops over separate x/y/z arrays
+//that the compiler can vectorise.
+
+const int kRuntimeExtent = 0;
+
+//Step counts, fixed at compile time...
+template<int NX, int NY, int NZ> struct VoxelGridExtents{
+    static constexpr int kNx = NX;
+    static constexpr int kNy = NY;
+    static constexpr int kNz = NZ;
+    constexpr int nx() const { return NX; }
+    constexpr int ny() const { return NY; }
+    constexpr int nz() const { return NZ; }
+};
+
+template<int NX, int NY, int NZ> constexpr int VoxelGridExtents<NX, NY, NZ>::kNx;
+template<int NX, int NY, int NZ> constexpr int VoxelGridExtents<NX, NY, NZ>::kNy;
+template<int NX, int NY, int NZ> constexpr int VoxelGridExtents<NX, NY, NZ>::kNz;
+
+//...or at run time
+template<> struct VoxelGridExtents<kRuntimeExtent, kRuntimeExtent, kRuntimeExtent>{
+    VoxelGridExtents(const int steps[3]) : nx_(steps[0]), ny_(steps[1]), nz_(steps[2]) {}
+    int nx() const { return nx_; }
+    int ny() const { return ny_; }
+    int nz() const { return nz_; }
+  private:
+    int nx_;
+    int ny_;
+    int nz_;
+};
+
+template<int NX = kRuntimeExtent, int NY = kRuntimeExtent, int NZ = kRuntimeExtent>
+class VoxelGrid : public VoxelGridExtents<NX, NY, NZ>{
+
+  public:
+    typedef VoxelGridExtents<NX, NY, NZ> Extents;
+
+    //Compile time grid: only the bounds are given
+    VoxelGrid(const double lower[3], const double upper[3]) : Extents() { SetBounds(lower, upper); }
+    //Run time grid
+    VoxelGrid(const int steps[3], const double lower[3], const double upper[3]) : Extents(steps) { SetBounds(lower, upper); }
+
+    int NumberOfVoxels() const { return this->nx()*this->ny()*this->nz(); }
+    const double* Lower() const { return lower_; }
+    const double* Upper() const { return upper_; }
+
+    int ID(int ix, int iy, int iz) const { return ix + this->nx()*(iy + this->ny()*iz); }
+    void Coords(int id, int& ix, int& iy, int& iz) const
+    {
+      ix = id % this->nx();
+      iy = (id / this->nx()) % this->ny();
+      iz = id / (this->nx()*this->ny());
+    }
+
+    void Position(int ix, int iy, int iz, double position[3]) const
+    {
+      position[0] = lower_[0] + (ix + 0.5)*size_[0];
+      position[1] = lower_[1] + (iy + 0.5)*size_[1];
+      position[2] = lower_[2] + (iz + 0.5)*size_[2];
+    }
+    void Position(int id, double position[3]) const
+    {
+      int ix, iy, iz;
+      Coords(id, ix, iy, iz);
+      Position(ix, iy, iz, position);
+    }
+
+    //Step along one axis; points below the lower edge by less than a step
+    //truncate to step 0, as the LArSoft photon library voxelisation does
+    int Step(int axis, double x, int nsteps) const { return int((x - lower_[axis]) / extent_[axis] * nsteps); }
+
+    //-1 outside the grid
+    int FindID(const double position[3]) const
+    {
+      int ix = Step(0, position[0], this->nx());
+      int iy = Step(1, position[1], this->ny());
+      int iz = Step(2, position[2], this->nz());
+      bool inside = 0 <= ix && ix < this->nx() && 0 <= iy && iy < this->ny() && 0 <= iz && iz < this->nz();
+      return inside ? ID(ix, iy, iz) : -1;
+    }
+
+    //Batch conversions
+    void Coords(const int* ids, size_t n, int* ix, int* iy, int* iz) const
+    {
+      for(size_t i = 0; i < n; i++) {Coords(ids[i], ix[i], iy[i], iz[i]); }
+    }
+    void Positions(const int* ids, size_t n, double* x, double* y, double* z) const
+    {
+      for(size_t i = 0; i < n; i++)
+      {
+        int ix, iy, iz;
+        Coords(ids[i], ix, iy, iz);
+        x[i] = lower_[0] + (ix + 0.5)*size_[0];
+        y[i] = lower_[1] + (iy + 0.5)*size_[1];
+        z[i] = lower_[2] + (iz + 0.5)*size_[2];
+      }
+    }
+    void FindIDs(const double* x, const double* y, const double* z, size_t n, int* ids) const
+    {
+      for(size_t i = 0; i < n; i++)
+      {
+        int ix = Step(0, x[i], this->nx());
+        int iy = Step(1, y[i], this->ny());
+        int iz = Step(2, z[i], this->nz());
+        bool inside = 0 <= ix && ix < this->nx() && 0 <= iy && iy < this->ny() && 0 <= iz && iz < this->nz();
+        ids[i] = inside ? ID(ix, iy, iz) : -1;
+      }
+    }
+
+  private:
+    void SetBounds(const double lower[3], const double upper[3])
+    {
+      int steps[3] = {this->nx(), this->ny(), this->nz()};
+      for(int i = 0; i < 3; i++)
+      {
+        lower_[i] = lower[i];
+        upper_[i] = upper[i];
+        extent_[i] = upper[i] - lower[i];
+        size_[i] = extent_[i]/steps[i];
+      }
+    }
+
+    double lower_[3];
+    double upper_[3];
+    double extent_[3];
+    double size_[3];   //voxel size
+};
+
+//The grid of the SBND photon libraries
+typedef VoxelGrid<40, 80, 100> SBNDVoxelGrid;
+
+#endif